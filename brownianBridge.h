@@ -0,0 +1,138 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+/*	Brownian bridge construction of the increments of a Brownian motion on a time grid
+	Gaussian number 0 sets the final point, number 1 the middle point conditionally on the final point,
+		then numbers 2 and 3 the middle points of the two halves, and so forth
+	So the first Gaussian numbers drive the large scale moves of the path,
+		which is what makes quasi-random sequences efficient, their first coordinates being the best distributed
+	The result is a vector of independent standard Gaussian increments, one per time step, 
+		with the same distribution as the input, applied to the model as usual */
+
+#include <vector>
+#include <cmath>
+using namespace std;
+
+class BrownianBridge
+{
+	size_t				myDim;
+
+	//	Step i of the construction sets the point myIndex[i] 
+	//		from the points myLeft[i] - 1 (or the origin if myLeft[i] = 0) and myRight[i]
+	vector<size_t>		myIndex;
+	vector<size_t>		myLeft;
+	vector<size_t>		myRight;
+	vector<double>		myLeftWeight;
+	vector<double>		myRightWeight;
+	vector<double>		myStdDev;
+
+	//	To normalize the increments
+	vector<double>		mySqrtDt;
+
+public:
+
+	BrownianBridge() : myDim( 0) {}
+
+	//	Initialize with the lengths of the time steps
+	void init( const vector<double>& dt)
+	{
+		myDim = dt.size();
+
+		myIndex.assign( myDim, 0);
+		myLeft.assign( myDim, 0);
+		myRight.assign( myDim, 0);
+		myLeftWeight.assign( myDim, 0.0);
+		myRightWeight.assign( myDim, 0.0);
+		myStdDev.assign( myDim, 0.0);
+		mySqrtDt.resize( myDim);
+
+		if( !myDim) return;
+
+		//	Times of the points
+		vector<double> t( myDim);
+		double time = 0.0;
+		for( size_t i=0; i<myDim; ++i)
+		{
+			time += dt[i];
+			t[i] = time;
+			mySqrtDt[i] = sqrt( dt[i]);
+		}
+
+		//	Which points are already set, and by which step
+		vector<bool> set( myDim, false);
+
+		//	Final point
+		set[myDim-1] = true;
+		myIndex[0] = myDim-1;
+		myStdDev[0] = sqrt( t[myDim-1]);
+
+		//	Then the middle points of the gaps between set points, from left to right, coarse to fine
+		size_t j = 0;
+		for( size_t i=1; i<myDim; ++i)
+		{
+			//	Next gap, from j to k-1, between the set points j-1 (or the origin) and k
+			while( set[j]) ++j;
+			size_t k = j;
+			while( !set[k]) ++k;
+
+			const size_t l = j + (k - 1 - j) / 2;
+			set[l] = true;
+
+			myIndex[i] = l;
+			myLeft[i] = j;
+			myRight[i] = k;
+
+			const double tLeft = j ? t[j-1] : 0.0;
+			myLeftWeight[i] = (t[k] - t[l]) / (t[k] - tLeft);
+			myRightWeight[i] = (t[l] - tLeft) / (t[k] - tLeft);
+			myStdDev[i] = sqrt( (t[l] - tLeft) * (t[k] - t[l]) / (t[k] - tLeft));
+
+			//	Next gap, from the start when done with this level
+			j = k + 1;
+			if( j >= myDim) j = 0;
+		}
+	}
+
+	size_t dim() const
+	{
+		return myDim;
+	}
+
+	//	Turn independent Gaussian numbers G into independent standard Gaussian increments, of dimension dim()
+	void transform( const vector<double>& G, vector<double>& increments) const
+	{
+		if( !myDim) return;
+
+		//	Points of the Brownian motion
+		vector<double>& W = increments;
+		W[myIndex[0]] = myStdDev[0] * G[0];
+		for( size_t i=1; i<myDim; ++i)
+		{
+			const size_t j = myLeft[i];
+			W[myIndex[i]] = (j ? myLeftWeight[i] * W[j-1] : 0.0) 
+				+ myRightWeight[i] * W[myRight[i]] 
+				+ myStdDev[i] * G[i];
+		}
+
+		//	Normalized increments, in place, from the end
+		for( size_t i=myDim-1; i>0; --i)
+		{
+			W[i] = (W[i] - W[i-1]) / mySqrtDt[i];
+		}
+		W[0] /= mySqrtDt[0];
+	}
+};
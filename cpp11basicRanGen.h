@@ -9,6 +9,8 @@
 #include <random>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <cstdint>
 using namespace std;
 
 struct randomgen_error : public runtime_error
@@ -21,6 +23,8 @@ class RandomGen
 {
 public:
 
+    virtual ~RandomGen() {}
+
     //  Initialise for a given dimension
     virtual void init( const size_t dim) = 0;
 
@@ -30,6 +34,19 @@ public:
     //  Access Gaussian vector byRef
     virtual const vector<double>& getNorm() const = 0;
 
+    //  Generate the next numPoints random points into out, point after point, numPoints * dim Gaussian numbers
+    //  Same numbers as numPoints calls to genNextNormVec(), getNorm() is left unspecified
+    //  Generators that can produce Gaussian numbers in bulk override it
+    virtual void genNextNormVecs( const size_t numPoints, double* out)
+    {
+        for( size_t p=0; p<numPoints; ++p)
+        {
+            genNextNormVec();
+            const vector<double>& norm = getNorm();
+            copy( norm.begin(), norm.end(), out + p * norm.size());
+        }
+    }
+
     //  Clone
     virtual unique_ptr<RandomGen> clone() const = 0;
 
@@ -38,11 +55,19 @@ public:
 	{
 		throw randomgen_error("Concrete random generator cannot be used for parallel simulations");
 	}
+
+	//	Restart on independent stream number stream, a deterministic function of the seed and the stream number
+	//	(for parallel Monte-Carlo in batches, where batch b runs on stream b whatever the thread)
+	virtual void setStream(const size_t /*stream*/)
+	{
+		throw randomgen_error("Concrete random generator does not support streams");
+	}
 };
 
 //  Basic C++11
 class BasicRanGen : public RandomGen
 {
+	unsigned				mySeed;
 	default_random_engine	myEngine;
 	normal_distribution<>	myDist;
 	size_t				    myDim;
@@ -51,7 +76,7 @@ class BasicRanGen : public RandomGen
 
 public:
 
-	BasicRanGen( const unsigned seed = 0)
+	BasicRanGen( const unsigned seed = 0) : mySeed( seed)
 	{
 		myEngine = seed > 0? default_random_engine( seed): default_random_engine();
 		myDist = normal_distribution<>();
@@ -81,4 +106,26 @@ public:
     {
         return unique_ptr<RandomGen>(new BasicRanGen(*this));
     }
+
+	//	Bulk generation is left to the base class: the normal distribution rejects a random number of uniforms,
+	//		so Gaussian numbers are produced sequentially, in the order of genNextNormVec()
+
+	//	Skip ahead by skip points
+	//	The normal distribution consumes a variable number of uniforms per Gaussian number,
+	//		so the points are generated and discarded, in linear time
+	void skipAhead(const long skip) override
+	{
+		for( long i=0; i<skip; ++i)
+		{
+			genNextNormVec();
+		}
+	}
+
+	//	Streams: the engine is seeded with the seed and the stream number
+	void setStream(const size_t stream) override
+	{
+		seed_seq seq{ mySeed, unsigned( stream & 0xffffffff), unsigned( uint64_t( stream) >> 32)};
+		myEngine.seed( seq);
+		myDist.reset();
+	}
 };
\ No newline at end of file
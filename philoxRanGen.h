@@ -0,0 +1,220 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+/*	Counter based Philox4x32-10 random generator (Salmon, Moraes, Dror and Shaw, 2011)
+	Point i of the sequence is a pure function of i, the seed and the stream,
+		so skipAhead() is constant time and any point may be generated independently, on any thread or process
+	Each call to the block function produces 4 uniforms, turned into 4 Gaussians with the inverse normal CDF
+	Streams are keyed by the stream number and independent of one another */
+
+#include "cpp11basicRanGen.h"
+#include "xlCpp/cppFiles/gaussians.h"
+
+#include <cstdint>
+#include <chrono>
+
+class PhiloxRanGen : public RandomGen
+{
+	//	Philox4x32 constants
+	static const uint32_t	M0 = 0xD2511F53;
+	static const uint32_t	M1 = 0xCD9E8D57;
+	static const uint32_t	W0 = 0x9E3779B9;
+	static const uint32_t	W1 = 0xBB67AE85;
+
+	uint32_t				mySeed;
+	uint64_t				myStream;
+
+	//	Index of the next point
+	uint64_t				myPoint;
+	size_t				    myDim;
+
+	vector<double>			myNormVec;
+
+	static void mulhilo( const uint32_t a, const uint32_t b, uint32_t& hi, uint32_t& lo)
+	{
+		const uint64_t prod = uint64_t( a) * b;
+		hi = uint32_t( prod >> 32);
+		lo = uint32_t( prod);
+	}
+
+public:
+
+	PhiloxRanGen( const unsigned seed = 0, const size_t stream = 0) : mySeed( seed), myStream( stream), myPoint( 0), myDim( 0) {}
+
+	//	Block function: 10 rounds on the counter ctr with the key
+	static void philox( uint32_t ctr[4], const uint32_t key[2])
+	{
+		uint32_t k0 = key[0], k1 = key[1];
+		for( int round=0; round<10; ++round)
+		{
+			if( round)
+			{
+				k0 += W0;
+				k1 += W1;
+			}
+
+			uint32_t hi0, lo0, hi1, lo1;
+			mulhilo( M0, ctr[0], hi0, lo0);
+			mulhilo( M1, ctr[2], hi1, lo1);
+
+			const uint32_t c1 = ctr[1], c3 = ctr[3];
+			ctr[0] = hi1 ^ c1 ^ k0;
+			ctr[1] = lo1;
+			ctr[2] = hi0 ^ c3 ^ k1;
+			ctr[3] = lo0;
+		}
+	}
+
+	//	Uniform in (0,1) out of 32 random bits, never 0 or 1
+	static double uniform( const uint32_t bits)
+	{
+		return (bits + 0.5) * 2.3283064365386963e-10;
+	}
+
+	//	Uniforms of point number point, of dimension dim(), into out, independently of the state
+	//	Coordinates 4b to 4b+3 come from the block function on the counter (b, point, high bits of the stream)
+	//		with the key (seed, low bits of the stream)
+	void genUniforms( const uint64_t point, double* out) const
+	{
+		const uint32_t key[2] = { mySeed, uint32_t( myStream)};
+
+		for( size_t i=0; i<myDim; i+=4)
+		{
+			uint32_t ctr[4] = { uint32_t( i / 4), uint32_t( point), uint32_t( point >> 32), uint32_t( myStream >> 32)};
+			philox( ctr, key);
+
+			const size_t n = min( size_t( 4), myDim - i);
+			for( size_t j=0; j<n; ++j)
+			{
+				out[i + j] = uniform( ctr[j]);
+			}
+		}
+	}
+
+	//	Gaussian vector number point into out, independently of the state
+	void genNormVec( const uint64_t point, double* out) const
+	{
+		genNormVecs( point, 1, out);
+	}
+
+	//	Same for numPoints consecutive points from firstPoint, into out, point after point
+	//	All the uniforms are generated first, then turned into Gaussians in one batch
+	void genNormVecs( const uint64_t firstPoint, const size_t numPoints, double* out) const
+	{
+		for( size_t p=0; p<numPoints; ++p)
+		{
+			genUniforms( firstPoint + p, out + p * myDim);
+		}
+		invNormalCdfBatch( out, out, numPoints * myDim);
+	}
+
+    void init( const size_t dim) override
+    {
+        myDim = dim;
+        myNormVec.resize( dim);
+    }
+
+	void genNextNormVec() override
+	{
+		genNormVec( myPoint++, myNormVec.data());
+	}
+
+    const vector<double>& getNorm() const override
+	{
+		return myNormVec;
+	}
+
+	//	Bulk generation
+	void genNextNormVecs( const size_t numPoints, double* out) override
+	{
+		genNormVecs( myPoint, numPoints, out);
+		myPoint += numPoints;
+	}
+
+    //  Clone
+    unique_ptr<RandomGen> clone() const override
+    {
+        return unique_ptr<RandomGen>( new PhiloxRanGen( *this));
+    }
+
+	//	Skip ahead by skip points, constant time
+	void skipAhead( const long skip) override
+	{
+		myPoint += skip;
+	}
+
+	//	Restart on another stream, constant time
+	void setStream( const size_t stream) override
+	{
+		myStream = stream;
+		myPoint = 0;
+	}
+
+	//	Index of the next point
+	uint64_t point() const
+	{
+		return myPoint;
+	}
+};
+
+//	Throughput benchmark: Gaussian numbers generated per second by gen, in numPoints points of dimension dim,
+//		one point at a time, or block points at a time with genNextNormVecs() if block > 0
+inline double ranGenThroughput( RandomGen& gen, const size_t dim, const size_t numPoints, const size_t block = 0)
+{
+	gen.init( dim);
+	vector<double> buffer( block * dim);
+
+	//	Consume the results so the generation is not optimized away
+	volatile double sink = 0.0;
+
+	const auto start = chrono::steady_clock::now();
+	if( block)
+	{
+		for( size_t i=0; i<numPoints; i+=block)
+		{
+			gen.genNextNormVecs( min( block, numPoints - i), buffer.data());
+			sink = buffer[0];
+		}
+	}
+	else
+	{
+		for( size_t i=0; i<numPoints; ++i)
+		{
+			gen.genNextNormVec();
+			sink = gen.getNorm()[0];
+		}
+	}
+	const double secs = chrono::duration<double>( chrono::steady_clock::now() - start).count();
+
+	//	Read the sink: a generator that produces NaNs has no meaningful throughput
+	const double last = sink;
+	if( last != last) return 0.0;
+
+	return secs > 0.0 ? dim * numPoints / secs : 0.0;
+}
+
+//	Compare the throughput of the Philox generator with the basic C++11 generator, 
+//		returns Gaussian numbers per second for BasicRanGen, PhiloxRanGen point by point 
+//		and PhiloxRanGen in bulk, block points at a time, in that order
+inline vector<double> compareRanGenThroughput( const size_t dim, const size_t numPoints, const unsigned seed = 1, const size_t block = 256)
+{
+	BasicRanGen basic( seed);
+	PhiloxRanGen philox( seed);
+
+	return { ranGenThroughput( basic, dim, numPoints), ranGenThroughput( philox, dim, numPoints), 
+		ranGenThroughput( philox, dim, numPoints, block) };
+}
@@ -18,6 +18,7 @@ As long as this comment is preserved at the top of the file
 
 #include <iterator>
 #include <vector>
+#include <cassert>
 
 using namespace std;
 
@@ -273,4 +274,80 @@ public:
     {
         return mySp < 0;
     }
-};
\ No newline at end of file
+};
+
+//  Stack over memory allocated elsewhere, once, and reused across calls
+//  Same interface as staticStack, the memory must be large enough for the maximum depth, 
+//      pushes beyond the capacity are caught by an assertion in debug builds
+template <class T>
+class stackView
+{
+
+private:
+
+    T*              myData;
+    int			    mySp = -1;
+    size_t          myCapacity;
+
+public:
+
+    stackView(T* data, const size_t capacity) : myData(data), myCapacity(capacity) {}
+
+    template <typename T2>
+    inline void push(T2&& value)
+    {
+        assert(size_t(mySp + 1) < myCapacity);
+        myData[++mySp] = forward<T2>(value);
+    }
+
+    inline T& top()
+    {
+        return myData[mySp];
+    }
+
+    inline const T& top() const
+    {
+        return myData[mySp];
+    }
+
+    //	Random access
+    inline T& operator[](const int i)
+    {
+        return myData[mySp - i];
+    }
+
+    inline const T& operator[](const int i) const
+    {
+        return myData[mySp - i];
+    }
+
+    inline T topAndPop()
+    {
+        return move(myData[mySp--]);
+    }
+
+    void pop()
+    {
+        --mySp;
+    }
+
+    void pop(const int n)
+    {
+        mySp -= n;
+    }
+
+    void reset()
+    {
+        mySp = -1;
+    }
+
+    size_t size() const
+    {
+        return static_cast<size_t>((mySp+1));
+    }
+
+    bool empty() const
+    {
+        return mySp < 0;
+    }
+};
@@ -0,0 +1,155 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Ahead of time compiled products
+//  The C++ file written by Product::generateCpp() is compiled by the C++ compiler into a shared library,
+//      for instance on Linux:
+//          g++ -O3 -march=native -ffp-contract=off -shared -fPIC script.cpp -o libscript.so
+//      and loaded at run time into an AotProduct
+//  Floating point contraction (fused multiply-add) must be off for results to match the Evaluator
+//  Evaluation takes the same scenarios and states as the compiled product, with the semantics of the Evaluator
+
+#include "scriptingScenarios.h"
+#include "scriptingCompiler.h"
+
+#include <string>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+class AotProduct
+{
+    //  Entry points
+    using EvalFunc = void(*)(const void*, double*);
+    using SizeFunc = size_t(*)();
+
+    void*       myLibrary = nullptr;
+    EvalFunc    myEvaluate = nullptr;
+    size_t      myNumEvents = 0;
+    size_t      myNumVariables = 0;
+
+    void* symbol(const string& sym) const
+    {
+#ifdef _WIN32
+        return reinterpret_cast<void*>(GetProcAddress(static_cast<HMODULE>(myLibrary), sym.c_str()));
+#else
+        return dlsym(myLibrary, sym.c_str());
+#endif
+    }
+
+    void release()
+    {
+        if (myLibrary)
+        {
+#ifdef _WIN32
+            FreeLibrary(static_cast<HMODULE>(myLibrary));
+#else
+            dlclose(myLibrary);
+#endif
+        }
+        myLibrary = nullptr;
+        myEvaluate = nullptr;
+    }
+
+public:
+
+    //  Load a library compiled from the code generated with the same name
+    AotProduct(const string& path, const string& name = "script")
+    {
+#ifdef _WIN32
+        myLibrary = LoadLibraryA(path.c_str());
+#else
+        myLibrary = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+        if (!myLibrary) throw runtime_error("Could not load compiled product " + path);
+
+        myEvaluate = reinterpret_cast<EvalFunc>(symbol(name + "_evaluate"));
+        SizeFunc numEvents = reinterpret_cast<SizeFunc>(symbol(name + "_numEvents"));
+        SizeFunc numVariables = reinterpret_cast<SizeFunc>(symbol(name + "_numVariables"));
+
+        if (!myEvaluate || !numEvents || !numVariables)
+        {
+            release();
+            throw runtime_error("Compiled product " + name + " not found in " + path);
+        }
+
+        myNumEvents = numEvents();
+        myNumVariables = numVariables();
+    }
+
+    //  Move only
+    AotProduct(const AotProduct&) = delete;
+    AotProduct& operator=(const AotProduct&) = delete;
+
+    AotProduct(AotProduct&& rhs) :
+        myLibrary(rhs.myLibrary), myEvaluate(rhs.myEvaluate), myNumEvents(rhs.myNumEvents), myNumVariables(rhs.myNumVariables)
+    {
+        rhs.myLibrary = nullptr;
+        rhs.myEvaluate = nullptr;
+    }
+    AotProduct& operator=(AotProduct&& rhs)
+    {
+        if (this != &rhs)
+        {
+            release();
+            myLibrary = rhs.myLibrary;
+            myEvaluate = rhs.myEvaluate;
+            myNumEvents = rhs.myNumEvents;
+            myNumVariables = rhs.myNumVariables;
+            rhs.myLibrary = nullptr;
+            rhs.myEvaluate = nullptr;
+        }
+        return *this;
+    }
+
+    ~AotProduct()
+    {
+        release();
+    }
+
+    //  Accessors, to check against the product
+
+    size_t numEvents() const
+    {
+        return myNumEvents;
+    }
+
+    size_t numVariables() const
+    {
+        return myNumVariables;
+    }
+
+    //  Evaluate all events
+    //  The scenario has one SimulData per event and the state one variable per product variable
+    //  Throws when they do not match the compiled product, which would otherwise write out of bounds
+    void evaluate(
+        const Scenario<double>& scen,
+        EvalState<double>& state) const
+    {
+        if (scen.size() != myNumEvents) throw runtime_error("Scenario does not match the events of the compiled product");
+        if (state.variables.size() != myNumVariables) throw runtime_error("State does not match the variables of the compiled product");
+
+        //	Initialize state
+        state.init();
+
+        myEvaluate(scen.data(), state.variables.data());
+    }
+};
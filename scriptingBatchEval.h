@@ -0,0 +1,757 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Batch evaluation of compiled streams
+//  Every instruction of the node stream is executed over a block of paths at once, one path per lane,
+//      so the interpretation overhead is paid once per block instead of once per path
+//  Lanes are fixed size arrays and all lane operations are simple loops of known length,
+//      which compilers turn into packed SIMD instructions (AVX, AVX-512) or unroll with SSE2
+//  If and IfElse are executed with masks of active lanes:
+//      instructions run on all lanes, but variables are only written on active lanes,
+//      and blocks are skipped altogether when no lane is active
+
+#include "scriptingCompiler.h"
+
+//  Number of paths per block, may be set on the command line
+//  Defaults to the width of the available SIMD registers for doubles, with a portable default
+#ifndef BATCH_WIDTH
+#if defined(__AVX512F__)
+#define BATCH_WIDTH 8
+#else
+#define BATCH_WIDTH 4
+#endif
+#endif
+
+//  Capacity of the stacks of the batch evaluator, in blocks
+#ifndef BATCH_STACK_SIZE
+#define BATCH_STACK_SIZE 64
+#endif
+
+//  Number of paths per block for a number type
+//  BATCH_WIDTH is expressed in doubles, blocks of floats are twice as wide for the same SIMD registers
+template <class T>
+constexpr size_t batchWidth()
+{
+    return BATCH_WIDTH * sizeof(double) / sizeof(T) > 0 ? BATCH_WIDTH * sizeof(double) / sizeof(T) : 1;
+}
+
+//  Lanes of values, one per path in the block
+template <class T, size_t W = BATCH_WIDTH>
+struct alignas(sizeof(T) * W) Lanes
+{
+    T   v[W];
+
+    //  Broadcast, for initializations
+    Lanes& operator=(const double x)
+    {
+        for (size_t l = 0; l < W; ++l) v[l] = T(x);
+        return *this;
+    }
+
+    T& operator[](const size_t l)
+    {
+        return v[l];
+    }
+    const T& operator[](const size_t l) const
+    {
+        return v[l];
+    }
+};
+
+//  Masks of active lanes
+template <size_t W = BATCH_WIDTH>
+struct alignas(W) LaneMask
+{
+    bool    v[W];
+
+    bool& operator[](const size_t l)
+    {
+        return v[l];
+    }
+    const bool& operator[](const size_t l) const
+    {
+        return v[l];
+    }
+
+    bool any() const
+    {
+        bool res = false;
+        for (size_t l = 0; l < W; ++l) res |= v[l];
+        return res;
+    }
+
+    bool operator==(const LaneMask& rhs) const
+    {
+        bool res = true;
+        for (size_t l = 0; l < W; ++l) res &= v[l] == rhs.v[l];
+        return res;
+    }
+};
+
+//  All lanes active
+template <size_t W>
+inline LaneMask<W> allLanes()
+{
+    LaneMask<W> m;
+    for (size_t l = 0; l < W; ++l) m[l] = true;
+    return m;
+}
+
+//  Scatter one path into a lane of a batch scenario
+template <class T, size_t W>
+inline void setLane(
+    const Scenario<T>&              scen,
+    const size_t                    lane,
+    Scenario<Lanes<T, W>>&          batchScen)
+{
+    for (size_t i = 0; i < scen.size(); ++i)
+    {
+        batchScen[i].spot[lane] = scen[i].spot;
+        batchScen[i].numeraire[lane] = scen[i].numeraire;
+    }
+}
+
+//  The batch interpreter
+//  Same instructions as evalCompiled, executed lane by lane in the same order,
+//      so every lane produces the same results as evalCompiled on the corresponding path
+template <class T, size_t W>
+inline void evalBatch(
+    //  Stream to eval
+    const vector<int>&              nodeStream,
+    const vector<double>&           constStream,
+    //  Scenario
+    const SimulData<Lanes<T, W>>&   scen,
+    //  State
+    EvalState<Lanes<T, W>>&         state,
+    //  Active lanes
+    const LaneMask<W>&              active,
+    //  First (included), last (excluded)
+    const size_t                    first = 0,
+    const size_t                    last = 0)
+{
+    using L = Lanes<T, W>;
+    using M = LaneMask<W>;
+
+    const size_t n = last ? last : nodeStream.size();
+    size_t i = first;
+
+    //  Work space
+    //  Constants are applied in double, like evalCompiled applies the constants of the packed stream,
+    //      and rounded to T first only where evalCompiled loads them into a T
+    double c;
+    size_t idx;
+    M m, mf;
+
+    //  Stacks, checked against the depths of the compiled streams by Product::evaluateBatch()
+    staticStack<L, BATCH_STACK_SIZE> dStack;
+    staticStack<M, BATCH_STACK_SIZE> bStack;
+
+    //  Loop on instructions
+    while (i < n)
+    {
+        //  Big switch, lane loops inside every instruction
+        switch (nodeStream[i])
+        {
+
+        case Add:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] += y[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case AddConst:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] += c;
+
+            ++i;
+            break;
+        }
+
+        case Sub:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] -= y[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case SubConst:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] -= c;
+
+            ++i;
+            break;
+        }
+
+        case ConstSub:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] = c - x[l];
+
+            ++i;
+            break;
+        }
+
+        case Mult:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] *= y[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case MultConst:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] *= c;
+
+            ++i;
+            break;
+        }
+
+        case Div:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] /= y[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case DivConst:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] /= c;
+
+            ++i;
+            break;
+        }
+
+        case ConstDiv:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] = c / x[l];
+
+            ++i;
+            break;
+        }
+
+        case Pow:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = pow(x[l], y[l]);
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case PowConst:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] = pow(x[l], c);
+
+            ++i;
+            break;
+        }
+
+        case ConstPow:
+        {
+            L& x = dStack.top();
+            c = constStream[nodeStream[++i]];
+            for (size_t l = 0; l < W; ++l) x[l] = pow(c, x[l]);
+
+            ++i;
+            break;
+        }
+
+        case Max2:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = y[l] > x[l] ? y[l] : x[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case Max2Const:
+        {
+            L& x = dStack.top();
+            const T k = T(constStream[nodeStream[++i]]);
+            for (size_t l = 0; l < W; ++l) x[l] = k > x[l] ? k : x[l];
+
+            ++i;
+            break;
+        }
+
+        case Min2:
+        {
+            L& x = dStack[1];
+            const L& y = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = y[l] < x[l] ? y[l] : x[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case Min2Const:
+        {
+            L& x = dStack.top();
+            const T k = T(constStream[nodeStream[++i]]);
+            for (size_t l = 0; l < W; ++l) x[l] = k < x[l] ? k : x[l];
+
+            ++i;
+            break;
+        }
+
+        case Spot:
+
+            dStack.push(scen.spot);
+
+            ++i;
+            break;
+
+        case Var:
+
+            dStack.push(state.variables[nodeStream[++i]]);
+
+            ++i;
+            break;
+
+        case Const:
+        {
+            c = constStream[nodeStream[++i]];
+            dStack.push(L());
+            L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = c;
+
+            ++i;
+            break;
+        }
+
+        //  Writes are blended with the active mask
+
+        case Assign:
+        {
+            idx = nodeStream[++i];
+            L& v = state.variables[idx];
+            const L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) v[l] = active[l] ? x[l] : v[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case AssignConst:
+        {
+            const T k = T(constStream[nodeStream[++i]]);
+            idx = nodeStream[++i];
+            L& v = state.variables[idx];
+            for (size_t l = 0; l < W; ++l) v[l] = active[l] ? k : v[l];
+
+            ++i;
+            break;
+        }
+
+        case Pays:
+        {
+            idx = nodeStream[++i];
+            L& v = state.variables[idx];
+            const L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) v[l] = active[l] ? v[l] + x[l] / scen.numeraire[l] : v[l];
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case PaysConst:
+        {
+            const T k = T(constStream[nodeStream[++i]]);
+            idx = nodeStream[++i];
+            L& v = state.variables[idx];
+            for (size_t l = 0; l < W; ++l) v[l] = active[l] ? v[l] + k / scen.numeraire[l] : v[l];
+
+            ++i;
+            break;
+        }
+
+        //  Control flow with masks
+
+        case If:
+        {
+            const M& cond = bStack.top();
+            for (size_t l = 0; l < W; ++l) m[l] = active[l] && cond[l];
+            bStack.pop();
+
+            const size_t end = nodeStream[i + 1];
+
+            //  All active lanes true: carry on
+            if (m == active)
+            {
+                i += 2;
+            }
+            //  Some: evaluate the statements on these lanes only
+            else
+            {
+                if (m.any()) evalBatch(nodeStream, constStream, scen, state, m, i + 2, end);
+                i = end;
+            }
+
+            break;
+        }
+
+        case IfElse:
+        {
+            const M& cond = bStack.top();
+            for (size_t l = 0; l < W; ++l)
+            {
+                m[l] = active[l] && cond[l];
+                mf[l] = active[l] && !cond[l];
+            }
+            bStack.pop();
+
+            const size_t lastTrue = nodeStream[i + 1], lastFalse = nodeStream[i + 2];
+
+            //  The if-true statements end with a jump to lastFalse, which exits the nested call
+            if (m.any()) evalBatch(nodeStream, constStream, scen, state, m, i + 3, lastTrue);
+            if (mf.any()) evalBatch(nodeStream, constStream, scen, state, mf, lastTrue, lastFalse);
+
+            i = lastFalse;
+
+            break;
+        }
+
+        //  Short circuit when all active lanes agree, otherwise evaluate the rhs and combine with And / Or
+
+        case AndJump:
+        case OrJump:
+        {
+            const M& cond = bStack.top();
+            const bool jumpOn = nodeStream[i] == OrJump;
+            bool all = true;
+            for (size_t l = 0; l < W; ++l) if (active[l]) all = all && cond[l] == jumpOn;
+
+            if (all) i = nodeStream[i + 1];
+            else i += 2;
+
+            break;
+        }
+
+        //  Conditions
+
+        case Equal:
+        {
+            const L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) m[l] = x[l] == 0;
+            bStack.push(m);
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case Sup:
+        {
+            const L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) m[l] = x[l] > 0;
+            bStack.push(m);
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case SupEqual:
+        {
+            const L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) m[l] = x[l] >= 0;
+            bStack.push(m);
+            dStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case And:
+        {
+            M& b = bStack[1];
+            const M& a = bStack.top();
+            for (size_t l = 0; l < W; ++l) b[l] = b[l] && a[l];
+            bStack.pop();
+
+            ++i;
+            break;
+        }
+
+        case Or:
+        {
+            M& b = bStack[1];
+            const M& a = bStack.top();
+            for (size_t l = 0; l < W; ++l) b[l] = b[l] || a[l];
+            bStack.pop();
+
+            ++i;
+            break;
+        }
+
+        //  Smooth: jump when all active lanes are on the same side, otherwise evaluate both values and select per lane
+
+        case SmoothTest:
+        case SmoothTestConst:
+        {
+            const bool isConst = nodeStream[i] == SmoothTestConst;
+            const L& x = isConst ? dStack.top() : dStack[1];
+            L halfEps;
+            if (isConst) halfEps = constStream[nodeStream[i + 1]];
+            else for (size_t l = 0; l < W; ++l) halfEps[l] = 0.5 * dStack.top()[l];
+
+            bool allLeft = true, allRight = true;
+            for (size_t l = 0; l < W; ++l) if (active[l])
+            {
+                allLeft = allLeft && x[l] < -halfEps[l];
+                //  Left has priority, as in evalCompiled, when a negative epsilon puts a lane on both sides
+                allRight = allRight && x[l] > halfEps[l] && !(x[l] < -halfEps[l]);
+            }
+
+            const size_t first = isConst ? i + 2 : i + 1;
+            //	Left
+            if (allLeft)
+            {
+                dStack.pop(isConst ? 1 : 2);
+                i = nodeStream[first];
+            }
+            //	Right
+            else if (allRight)
+            {
+                dStack.pop(isConst ? 1 : 2);
+                i = nodeStream[first + 1];
+            }
+            //	Fuzzy
+            else
+            {
+                if (!isConst) dStack.top() = halfEps;
+                i = first + 2;
+            }
+
+            break;
+        }
+
+        case SmoothBlend:
+        case SmoothBlendConst:
+        {
+            //	Stack: x, eps / 2 unless const, vPos, vNeg
+            const bool isConst = nodeStream[i] == SmoothBlendConst;
+            const L& x = isConst ? dStack[2] : dStack[3];
+            const L& vPos = dStack[1];
+            const L& vNeg = dStack.top();
+            L halfEps;
+            if (isConst) halfEps = constStream[nodeStream[++i]];
+            else halfEps = dStack[2];
+
+            L res;
+            for (size_t l = 0; l < W; ++l)
+            {
+                const T h = halfEps[l];
+                //	Left
+                if (x[l] < -h) res[l] = vNeg[l];
+                //	Right
+                else if (x[l] > h) res[l] = vPos[l];
+                //	Fuzzy
+                else res[l] = vNeg[l] + 0.5 * (vPos[l] - vNeg[l]) / h * (x[l] + h);
+            }
+
+            dStack.pop(isConst ? 2 : 3);
+            dStack.top() = res;
+
+            ++i;
+            break;
+        }
+
+        case Jump:
+        {
+            i = nodeStream[i + 1];
+            break;
+        }
+
+        case Sqrt:
+        {
+            L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = sqrt(x[l]);
+
+            ++i;
+            break;
+        }
+
+        case Log:
+        {
+            L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = log(x[l]);
+
+            ++i;
+            break;
+        }
+
+        case Not:
+        {
+            M& b = bStack.top();
+            for (size_t l = 0; l < W; ++l) b[l] = !b[l];
+
+            ++i;
+            break;
+        }
+
+        case Uminus:
+        {
+            L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = -x[l];
+
+            ++i;
+            break;
+        }
+
+        case True:
+
+            for (size_t l = 0; l < W; ++l) m[l] = true;
+            bStack.push(m);
+
+            ++i;
+            break;
+
+        case False:
+
+            for (size_t l = 0; l < W; ++l) m[l] = false;
+            bStack.push(m);
+
+            ++i;
+            break;
+
+        //  Superinstructions
+
+        case SpotSubConst:
+        {
+            c = constStream[nodeStream[++i]];
+            dStack.push(L());
+            L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l) x[l] = scen.spot[l] - c;
+
+            ++i;
+            break;
+        }
+
+        case CallPayoffConst:
+        {
+            c = constStream[nodeStream[++i]];
+            const T k = T(constStream[nodeStream[++i]]);
+            dStack.push(L());
+            L& x = dStack.top();
+            for (size_t l = 0; l < W; ++l)
+            {
+                x[l] = scen.spot[l] - c;
+                x[l] = k > x[l] ? k : x[l];
+            }
+
+            ++i;
+            break;
+        }
+
+        case IncVarConst:
+        {
+            idx = nodeStream[++i];
+            c = constStream[nodeStream[++i]];
+            L& v = state.variables[idx];
+            for (size_t l = 0; l < W; ++l) v[l] = active[l] ? v[l] + c : v[l];
+
+            ++i;
+            break;
+        }
+
+        case SpotAboveConstIf:
+        {
+            c = constStream[nodeStream[i + 1]];
+            for (size_t l = 0; l < W; ++l) m[l] = active[l] && scen.spot[l] - c > 0;
+
+            const size_t end = nodeStream[i + 2];
+
+            if (m == active)
+            {
+                i += 3;
+            }
+            else
+            {
+                if (m.any()) evalBatch(nodeStream, constStream, scen, state, m, i + 3, end);
+                i = end;
+            }
+
+            break;
+        }
+
+        case VarAboveConstIf:
+        {
+            const L& v = state.variables[nodeStream[i + 1]];
+            c = constStream[nodeStream[i + 2]];
+            for (size_t l = 0; l < W; ++l) m[l] = active[l] && v[l] - c > 0;
+
+            const size_t end = nodeStream[i + 3];
+
+            if (m == active)
+            {
+                i += 4;
+            }
+            else
+            {
+                if (m.any()) evalBatch(nodeStream, constStream, scen, state, m, i + 4, end);
+                i = end;
+            }
+
+            break;
+        }
+
+        //  Fuzzy instructions are interpreted by evalCompiled only
+        default:
+
+            throw runtime_error("Instruction not supported by the batch interpreter");
+        }
+    }
+}
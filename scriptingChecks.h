@@ -0,0 +1,361 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Checks of the evaluation backends and optimization passes
+//  Every check runs a small corpus of scripts through a backend or a pass, and through the reference evaluation,
+//      on the same scenarios, and returns the largest difference between the variables, path by path
+//  Backends and passes documented as identical to their reference must return exactly 0
+
+#include "scriptingModel.h"
+
+//  Today's date of the corpus
+constexpr Date CHECK_TODAY = 43101;
+
+//  Corpus: payoffs, conditions, nested and flat IFs, functions, constants that do not round to float
+inline vector<map<Date, string>> checkCorpus()
+{
+    const Date t = CHECK_TODAY;
+    vector<map<Date, string>> corpus;
+
+    //  European call, with arithmetic on constants
+    corpus.push_back({
+        { t + 365, "opt pays max(spot() - 100, 0) x = spot() * 0.1 + 0.3 - 0.7 / spot() y = 0.1 - spot() / 3.3" } });
+
+    //  Up and out call, monitored monthly
+    map<Date, string> upOut;
+    upOut[t] = "alive = 1";
+    for (int m = 1; m < 12; ++m) upOut[t + 30 * m] = "IF spot() > 120 THEN alive = 0 ENDIF";
+    upOut[t + 365] = "IF spot() > 120 THEN alive = 0 ENDIF opt pays alive * max(spot() - 100, 0)";
+    corpus.push_back(upOut);
+
+    //  Autocallable, nested IFs, IF/ELSE
+    map<Date, string> autocall;
+    autocall[t] = "alive = 1 cpn = 0";
+    for (int q = 1; q <= 4; ++q)
+    {
+        autocall[t + 91 * q] =
+            "IF alive = 1 THEN "
+            "   IF spot() >= 100 THEN prd pays 1 + 0.05 * " + to_string(q) + " alive = 0 "
+            "   ELSE cpn = cpn + 0.01 "
+            "       IF spot() < 60 THEN prd pays spot() / 100 alive = 0 ENDIF "
+            "   ENDIF "
+            "ENDIF";
+    }
+    corpus.push_back(autocall);
+
+    //  Compound conditions
+    corpus.push_back({
+        { t + 180, "IF spot() > 90 AND spot() < 110 OR spot() < 70 THEN x = 1 ELSE x = -1 ENDIF "
+                   "IF spot() != 100 AND x > 0 OR x < 0 AND spot() >= 80 THEN y = spot() ENDIF" },
+        { t + 365, "IF x > 0 OR spot() > 100 AND spot() <= 130 THEN opt pays spot() - 100 ELSE opt pays 0.1 ENDIF" } });
+
+    //  Functions
+    corpus.push_back({
+        { t + 365, "a = log(spot()) ^ 2 b = sqrt(spot()) * min(spot(), 110) c = -spot() + max(spot(), 100.1) "
+                   "d = smooth(spot() - 100, 1, 0, 5) e = 2 ^ (spot() / 100) f = smooth(spot() - 100, smooth(spot() - 110, 3, 2, 1), 0, 2)" } });
+
+    //  Repeated subexpressions
+    corpus.push_back({
+        { t + 180, "r = spot() / 100 x = spot() / 100 * (spot() / 100) + log(spot() / 100)" },
+        { t + 365, "IF spot() / 100 > 1 THEN opt pays (spot() / 100 - 1) * (spot() / 100 - 1) ELSE opt pays spot() / 100 * r ENDIF" } });
+
+    return corpus;
+}
+
+//  numSim scenarios of the events of a pre-processed product, in Black-Scholes
+template <class T>
+inline vector<Scenario<T>> checkScenarios(const Product& prd, const size_t numSim, const unsigned seed)
+{
+    BasicRanGen random(seed);
+    SimpleBlackScholes<T> model(CHECK_TODAY, 100.0, 0.25, 0.02);
+    ScriptSimulator<T> simulator(model, random);
+    simulator.initForScripting(prd.eventDates());
+
+    vector<Scenario<T>> scens;
+    for (size_t i = 0; i < numSim; ++i)
+    {
+        unique_ptr<Scenario<T>> scen = prd.buildScenario<T>();
+        simulator.nextScenario(*scen);
+        scens.push_back(move(*scen));
+    }
+
+    return scens;
+}
+
+//  Largest difference between the first n variables of two evaluations, NaNs of both compare equal
+template <class T>
+inline double checkDiff(const vector<T>& ref, const vector<T>& test, const size_t n)
+{
+    double maxDiff = 0.0;
+    for (size_t v = 0; v < n; ++v)
+    {
+        if (ref[v] != ref[v] && test[v] != test[v]) continue;
+        const double diff = fabs(double(ref[v]) - double(test[v]));
+        maxDiff = diff == diff ? max(maxDiff, diff) : numeric_limits<double>::infinity();
+    }
+    return maxDiff;
+}
+
+//  Run a check on every script of the corpus, parsed and pre-processed, with and without domains in sharp mode
+//  check(prd, scenarios) returns the largest difference on one product
+template <class T = double, class Check>
+inline double runCheck(const size_t numSim, const unsigned seed, const bool fuzzy, Check check)
+{
+    double maxDiff = 0.0;
+    for (const auto& events : checkCorpus())
+    {
+        for (const bool skipDoms : { false, true })
+        {
+            if (fuzzy && skipDoms) continue;
+
+            Product prd;
+            prd.parseEvents(events.begin(), events.end());
+            prd.preProcess(fuzzy, skipDoms);
+
+            maxDiff = max(maxDiff, check(prd, checkScenarios<T>(prd, numSim, seed)));
+        }
+    }
+    return maxDiff;
+}
+
+//  Threaded interpreter against evalCompiled
+inline double checkThreaded(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    return runCheck(numSim, seed, false, [](Product& prd, const vector<Scenario<double>>& scens)
+    {
+        prd.compile();
+        EvalState<double> ref = prd.buildCompiledState<double>(), test = prd.buildCompiledState<double>();
+
+        double maxDiff = 0.0;
+        for (const auto& scen : scens)
+        {
+            prd.evaluateCompiled(scen, ref);
+            prd.evaluateThreaded(scen, test);
+            maxDiff = max(maxDiff, checkDiff(ref.variables, test.variables, prd.varNames().size()));
+        }
+        return maxDiff;
+    });
+}
+
+//  Register VM against the Evaluator
+inline double checkRegisters(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    return runCheck(numSim, seed, false, [](Product& prd, const vector<Scenario<double>>& scens)
+    {
+        prd.compileRegisters();
+        Evaluator<double> ref = prd.buildEvaluator<double>();
+        EvalState<double> test = prd.buildRegisterState<double>();
+
+        double maxDiff = 0.0;
+        for (const auto& scen : scens)
+        {
+            prd.evaluate(scen, ref);
+            prd.evaluateRegisters(scen, test);
+            maxDiff = max(maxDiff, checkDiff(ref.varVals(), test.variables, prd.varNames().size()));
+        }
+        return maxDiff;
+    });
+}
+
+//  Native code against evalCompiled
+//  Returns 0 trivially where native code is not available and evaluateJit() falls back to evalCompiled
+inline double checkJit(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    return runCheck(numSim, seed, false, [](Product& prd, const vector<Scenario<double>>& scens)
+    {
+        prd.compile();
+        prd.jit();
+        EvalState<double> ref = prd.buildCompiledState<double>(), test = prd.buildCompiledState<double>();
+
+        double maxDiff = 0.0;
+        for (const auto& scen : scens)
+        {
+            prd.evaluateCompiled(scen, ref);
+            prd.evaluateJit(scen, test);
+            maxDiff = max(maxDiff, checkDiff(ref.variables, test.variables, prd.varNames().size()));
+        }
+        return maxDiff;
+    });
+}
+
+//  Packed streams, with and without superinstructions, against the Evaluator
+inline double checkPacked(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    return runCheck(numSim, seed, false, [](Product& prd, const vector<Scenario<double>>& scens)
+    {
+        Evaluator<double> ref = prd.buildEvaluator<double>();
+
+        double maxDiff = 0.0;
+        for (const bool fuse : { false, true })
+        {
+            prd.compile(fuse);
+            EvalState<double> test = prd.buildCompiledState<double>();
+
+            for (const auto& scen : scens)
+            {
+                prd.evaluate(scen, ref);
+                prd.evaluateCompiled(scen, test);
+                maxDiff = max(maxDiff, checkDiff(ref.varVals(), test.variables, prd.varNames().size()));
+            }
+        }
+        return maxDiff;
+    });
+}
+
+//  Short-circuit conditions and flat IFs of the compiled code against the Evaluator
+//  In evalCompiled, the threaded interpreter, and every lane of the batch interpreter
+inline double checkShortCircuit(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    return runCheck(numSim, seed, false, [](Product& prd, const vector<Scenario<double>>& scens)
+    {
+        prd.compile();
+        Evaluator<double> ref = prd.buildEvaluator<double>();
+        EvalState<double> comp = prd.buildCompiledState<double>(), thr = prd.buildCompiledState<double>();
+
+        constexpr size_t W = batchWidth<double>();
+        Scenario<Lanes<double, W>> batchScen(prd.eventDates().size());
+        EvalState<Lanes<double, W>> batchState(prd.varNames().size());
+
+        const size_t n = prd.varNames().size();
+        vector<double> lane(n);
+
+        double maxDiff = 0.0;
+        for (size_t i = 0; i < scens.size(); i += W)
+        {
+            //  The last block is padded with copies of its last scenario
+            for (size_t l = 0; l < W; ++l) setLane(scens[min(i + l, scens.size() - 1)], l, batchScen);
+            prd.evaluateBatch(batchScen, batchState);
+
+            for (size_t l = 0; l < W && i + l < scens.size(); ++l)
+            {
+                const Scenario<double>& scen = scens[i + l];
+                prd.evaluate(scen, ref);
+                prd.evaluateCompiled(scen, comp);
+                prd.evaluateThreaded(scen, thr);
+                for (size_t v = 0; v < n; ++v) lane[v] = batchState.variables[v][l];
+
+                maxDiff = max(maxDiff, checkDiff(ref.varVals(), comp.variables, n));
+                maxDiff = max(maxDiff, checkDiff(ref.varVals(), thr.variables, n));
+                maxDiff = max(maxDiff, checkDiff(ref.varVals(), lane, n));
+            }
+        }
+        return maxDiff;
+    });
+}
+
+//  Common subexpression elimination, results with and without, sharp and fuzzy, in the Evaluator and evalCompiled
+//  Compares the variables of the script, temporaries are indexed after them
+inline double checkCse(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    constexpr double defEps = 1.0;
+
+    double maxDiff = 0.0;
+    for (const bool fuzzy : { false, true })
+    {
+        maxDiff = max(maxDiff, runCheck(numSim, seed, fuzzy, [fuzzy](Product& prd, const vector<Scenario<double>>& scens)
+        {
+            const size_t n = prd.varNames().size();
+
+            //  Results of the Evaluator and evalCompiled, path by path
+            auto run = [&]()
+            {
+                if (fuzzy) prd.compileFuzzy(defEps);
+                else prd.compile();
+                Evaluator<double> eval = prd.buildEvaluator<double>();
+                FuzzyEvaluator<double> fuzzyEval = prd.buildFuzzyEvaluator<double>(prd.maxNestedIfs(), defEps);
+                EvalState<double> state = prd.buildCompiledState<double>();
+
+                vector<vector<double>> res;
+                for (const auto& scen : scens)
+                {
+                    if (fuzzy)
+                    {
+                        prd.evaluate(scen, fuzzyEval);
+                        res.emplace_back(fuzzyEval.varVals().begin(), fuzzyEval.varVals().begin() + n);
+                    }
+                    else
+                    {
+                        prd.evaluate(scen, eval);
+                        res.emplace_back(eval.varVals().begin(), eval.varVals().begin() + n);
+                    }
+
+                    prd.evaluateCompiled(scen, state);
+                    res.emplace_back(state.variables.begin(), state.variables.begin() + n);
+                }
+                return res;
+            };
+
+            const vector<vector<double>> ref = run();
+            prd.cseProcess();
+            const vector<vector<double>> test = run();
+
+            double diff = 0.0;
+            for (size_t i = 0; i < ref.size(); ++i) diff = max(diff, checkDiff(ref[i], test[i], n));
+            return diff;
+        }));
+    }
+    return maxDiff;
+}
+
+//  Batched inverse Gaussian against invNormalCdf, number by number
+//  Over a grid of uniforms, with the tails, the switch between the approximations, and a last partial chunk
+inline double checkInvNormalCdf(const size_t n = 100001)
+{
+    vector<double> u;
+    for (size_t i = 0; i <= n; ++i) u.push_back(double(i) / n);
+    for (const double p : { 1.0e-300, 1.0e-16, 1.0e-15, 1.0e-10, 1.0e-5, 0.08, 0.5 })
+    {
+        for (const double x : { p, nextafter(p, 0.0), nextafter(p, 1.0) })
+        {
+            u.push_back(x);
+            u.push_back(1.0 - x);
+        }
+    }
+
+    vector<double> g(u.size());
+    invNormalCdfBatch(u.data(), g.data(), u.size());
+
+    vector<double> ref(u.size());
+    for (size_t i = 0; i < u.size(); ++i) ref[i] = invNormalCdf(u[i]);
+
+    return checkDiff(ref, g, u.size());
+}
+
+//  Float against double valuations, see simpleBsPrecisionCheck()
+//  Over the corpus, in every compile mode, sharp and fuzzy
+//  Not exactly 0: returns the largest relative difference, 8.5e-8 with 100,000 paths and the default seed,
+//      of the order of 1.0e-7 with other numbers of paths and seeds
+inline double checkPrecision(const size_t numSim = 1000, const unsigned seed = 1234)
+{
+    constexpr double defEps = 1.0;
+
+    double maxDiff = 0.0;
+    for (const auto& events : checkCorpus())
+    {
+        for (const CompileMode compile : { noCompile, stackVM, threadedVM, batchVM, registerVM, nativeJit })
+        {
+            for (const bool fuzzy : { false, true })
+            {
+                vector<string> varNames;
+                vector<double> doubleVals, floatVals;
+                maxDiff = max(maxDiff, simpleBsPrecisionCheck(CHECK_TODAY, 100.0, 0.25, 0.02, false, events, unsigned(numSim), seed,
+                    fuzzy, defEps, false, compile, vector<string>(), varNames, doubleVals, floatVals));
+            }
+        }
+    }
+    return maxDiff;
+}
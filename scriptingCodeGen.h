@@ -0,0 +1,288 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  C++ code generator
+//  Writes the statements of an event as C++ code that evaluates the preprocessed tree directly,
+//      with the semantics of the Evaluator:
+//      expressions become C++ expressions, conditions C++ conditions, IFs C++ ifs,
+//      constants identified by the constant processor are written as literals
+//  The generated code is templated on the number type, like the hand-written payoffs of scriptingModel.h,
+//      so the C++ compiler inlines and optimizes the whole payoff
+//  See Product::generateCpp() for the generated file and scriptingAot.h to load it at run time
+
+#include "scriptingNodes.h"
+
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <cfloat>
+#include <cmath>
+
+class CppGenerator : public constVisitor<CppGenerator>
+{
+    //  Generated code
+    string          myCode;
+
+    //  Current indentation
+    string          myIndent;
+
+    //  Result of the last expression or condition visited
+    string          myExpr;
+
+    //  Visit an expression, return its code
+    string expr(const unique_ptr<Node>& node)
+    {
+        const exprNode* ex = downcast<exprNode>(node);
+        if (ex->isConst) return literal(ex->constVal);
+
+        node->accept(*this);
+        return myExpr;
+    }
+
+    //  Visit a condition, return its code
+    string cond(const unique_ptr<Node>& node)
+    {
+        node->accept(*this);
+        return myExpr;
+    }
+
+    //  Write a line of code
+    void line(const string& code)
+    {
+        myCode += myIndent + code + '\n';
+    }
+
+public:
+
+    using constVisitor<CppGenerator>::visit;
+
+    CppGenerator(const string& indent = "    ") : myIndent(indent) {}
+
+    //  Access the generated code
+    const string& code() const
+    {
+        return myCode;
+    }
+
+    //  Constants as exact decimal literals
+    static string literal(const double val)
+    {
+        if (val != val) return "T(std::numeric_limits<double>::quiet_NaN())";
+        if (val > DBL_MAX) return "T(std::numeric_limits<double>::infinity())";
+        if (val < -DBL_MAX) return "T(-std::numeric_limits<double>::infinity())";
+        //  Negative zero, which would print as -0, an integer literal equal to +0
+        if (val == 0.0 && signbit(val)) return "T(-0.0)";
+
+        ostringstream ost;
+        ost << setprecision(17) << val;
+        return "T(" + ost.str() + ")";
+    }
+
+    //	Expressions
+
+    //  Binaries
+
+    void visitBinary(const exprNode& node, const string& op)
+    {
+        myExpr = "(" + expr(node.arguments[0]) + " " + op + " " + expr(node.arguments[1]) + ")";
+    }
+
+    void visit(const NodeAdd& node)
+    {
+        visitBinary(node, "+");
+    }
+    void visit(const NodeSub& node)
+    {
+        visitBinary(node, "-");
+    }
+    void visit(const NodeMult& node)
+    {
+        visitBinary(node, "*");
+    }
+    void visit(const NodeDiv& node)
+    {
+        visitBinary(node, "/");
+    }
+
+    //  Functions, helpers are written in the generated file
+    void visitFunction(const exprNode& node, const string& func, const size_t nArgs)
+    {
+        string code = func + "(";
+        for (size_t i = 0; i < nArgs; ++i)
+        {
+            if (i) code += ", ";
+            code += expr(node.arguments[i]);
+        }
+        myExpr = code + ")";
+    }
+
+    void visit(const NodePow& node)
+    {
+        visitFunction(node, "pow", 2);
+    }
+    void visit(const NodeMax& node)
+    {
+        visitFunction(node, "scriptMax", 2);
+    }
+    void visit(const NodeMin& node)
+    {
+        visitFunction(node, "scriptMin", 2);
+    }
+    void visit(const NodeLog& node)
+    {
+        visitFunction(node, "log", 1);
+    }
+    void visit(const NodeSqrt& node)
+    {
+        visitFunction(node, "sqrt", 1);
+    }
+
+    //  Unaries
+
+    void visit(const NodeUplus& node)
+    {
+        myExpr = expr(node.arguments[0]);
+    }
+    void visit(const NodeUminus& node)
+    {
+        myExpr = "(-" + expr(node.arguments[0]) + ")";
+    }
+
+    //  Multies
+
+    //  Only the branches needed are evaluated, as in the Evaluator
+    void visit(const NodeSmooth& node)
+    {
+        const string x = expr(node.arguments[0]);
+        const string vPos = expr(node.arguments[1]);
+        const string vNeg = expr(node.arguments[2]);
+        const string eps = expr(node.arguments[3]);
+
+        //  The values are written once each, in lambdas called where needed,
+        //      so the code of nested SMOOTHs grows linearly with the nesting
+        myExpr = "[&]() -> T { "
+            "const T x = " + x + "; "
+            "const T halfEps = 0.5 * " + eps + "; "
+            "const auto vPos = [&]() -> T { return " + vPos + "; }; "
+            "const auto vNeg = [&]() -> T { return " + vNeg + "; }; "
+            "if (x < -halfEps) return vNeg(); "
+            "else if (x > halfEps) return vPos(); "
+            "else { const T p = vPos(), n = vNeg(); "
+            "return n + 0.5 * (p - n) / halfEps * (x + halfEps); } }()";
+    }
+
+    //	Conditions
+
+    void visitCondition(const boolNode& node, const string& op)
+    {
+        myExpr = "(" + expr(node.arguments[0]) + " " + op + " 0)";
+    }
+
+    void visit(const NodeEqual& node)
+    {
+        visitCondition(node, "==");
+    }
+    void visit(const NodeSup& node)
+    {
+        visitCondition(node, ">");
+    }
+    void visit(const NodeSupEqual& node)
+    {
+        visitCondition(node, ">=");
+    }
+
+    void visit(const NodeAnd& node)
+    {
+        myExpr = "(" + cond(node.arguments[0]) + " && " + cond(node.arguments[1]) + ")";
+    }
+    void visit(const NodeOr& node)
+    {
+        myExpr = "(" + cond(node.arguments[0]) + " || " + cond(node.arguments[1]) + ")";
+    }
+    void visit(const NodeNot& node)
+    {
+        myExpr = "(!" + cond(node.arguments[0]) + ")";
+    }
+
+    void visit(const NodeTrue& node)
+    {
+        myExpr = "true";
+    }
+    void visit(const NodeFalse& node)
+    {
+        myExpr = "false";
+    }
+
+    //  Leaves
+
+    void visit(const NodeVar& node)
+    {
+        myExpr = "v[" + to_string(node.index) + "]";
+    }
+
+    void visit(const NodeConst& node)
+    {
+        myExpr = literal(node.constVal);
+    }
+
+    void visit(const NodeSpot& node)
+    {
+        myExpr = "scen.spot";
+    }
+
+    //	Instructions
+
+    void visit(const NodeAssign& node)
+    {
+        const size_t var = downcast<NodeVar>(node.arguments[0])->index;
+        line("v[" + to_string(var) + "] = " + expr(node.arguments[1]) + ";");
+    }
+
+    void visit(const NodePays& node)
+    {
+        const size_t var = downcast<NodeVar>(node.arguments[0])->index;
+        line("v[" + to_string(var) + "] += " + expr(node.arguments[1]) + " / scen.numeraire;");
+    }
+
+    void visit(const NodeIf& node)
+    {
+        line("if " + cond(node.arguments[0]));
+        line("{");
+
+        const size_t lastTrue = node.firstElse == -1 ? node.arguments.size() - 1 : node.firstElse - 1;
+        myIndent += "    ";
+        for (size_t i = 1; i <= lastTrue; ++i)
+        {
+            node.arguments[i]->accept(*this);
+        }
+        myIndent.resize(myIndent.size() - 4);
+        line("}");
+
+        if (node.firstElse != -1)
+        {
+            line("else");
+            line("{");
+            myIndent += "    ";
+            for (size_t i = node.firstElse; i < node.arguments.size(); ++i)
+            {
+                node.arguments[i]->accept(*this);
+            }
+            myIndent.resize(myIndent.size() - 4);
+            line("}");
+        }
+    }
+};
@@ -28,6 +28,35 @@ As long as this comment is preserved at the top of the file
 
 #include <functional>
 #include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <chrono>
+
+//  Time stamp counter, for profiling
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PROFILE_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_RDTSC
+#endif
+
+//  Maximum depths of the stacks of the virtual machine, see stackDepths()
+struct StackDepths
+{
+    size_t values = 0;
+    size_t bools = 0;
+    size_t fuzzy = 0;
+
+    //  Extend to cover the requirements of another stream
+    void cover(const StackDepths& rhs)
+    {
+        values = max(values, rhs.values);
+        bools = max(bools, rhs.bools);
+        fuzzy = max(fuzzy, rhs.fuzzy);
+    }
+};
 
 template <class T>
 struct EvalState
@@ -35,14 +64,43 @@ struct EvalState
     //	State
     vector<T> variables;
 
+    //  Work space for the fuzzy evaluation of IFs, see FuzzyIf
+    vector<T> store;
+
+    //  Stacks of the virtual machine, allocated once with the depths computed at compile time,
+    //      and reused across events and paths
+    vector<T> valueStack;
+    vector<char> boolStack;
+    vector<T> fuzzyStack;
+
     //  Constructor
-    EvalState(const size_t nVar) : variables(nVar) {}
+    EvalState(const size_t nVar, const size_t nStore = 0, const StackDepths& depths = StackDepths()) : 
+        variables(nVar), store(nStore), valueStack(depths.values), boolStack(depths.bools), fuzzyStack(depths.fuzzy) 
+    {}
+
+    //  Are the stacks deep enough
+    bool fits(const StackDepths& depths) const
+    {
+        return valueStack.size() >= depths.values && boolStack.size() >= depths.bools && fuzzyStack.size() >= depths.fuzzy;
+    }
 
     //  Initializer
     void init()
     {
         for (auto& var : variables) var = 0.0;
     }
+
+    //  Same, only the variables in resetVars, as found by the init processor
+    void init(const vector<size_t>& resetVars)
+    {
+        for (auto idx : resetVars) variables[idx] = 0.0;
+    }
+
+    //  Same, the first numVars only, the variables of a register state, the constants that follow are left untouched
+    void init(const size_t numVars)
+    {
+        fill(variables.begin(), variables.begin() + numVars, 0.0);
+    }
 };
 
 enum NodeType
@@ -71,35 +129,395 @@ enum NodeType
     AssignConst,
     Pays,
     PaysConst,
-    If,
-    IfElse,
+    If,                     //  Jump to end if false
+    IfElse,                 //  Jump to the if-false statements if false, the if-true statements end with a Jump
+    Jump,
+    AndJump,                //  Jump if false, the condition stays on the stack
+    OrJump,                 //  Jump if true, the condition stays on the stack
     Equal,
     Sup,
     SupEqual,
     And,
     Or,
-    Smooth,
+    //  Smooth: test x against the epsilon, jump to the left or right value or fall through to the fuzzy blend
+    SmoothTest,             //  x, eps
+    SmoothTestConst,        //  x, const eps
+    SmoothBlend,            //  x, eps / 2, vPos, vNeg
+    SmoothBlendConst,       //  x, vPos, vNeg, const eps
     Sqrt,
     Log,
     Not,
     Uminus,
     True,
-    False
+    False,
+    //  Fuzzy, produced by the Compiler in fuzzy mode, conditions are degrees of truth
+    FuzzyEqual,             //  Butterfly (-eps/2, eps/2), operand eps/2
+    FuzzyEqualDiscrete,     //  Butterfly (lb, 0, rb), operands lb, rb
+    FuzzySup,               //  Call spread (-eps/2, eps/2), operands eps, eps/2
+    FuzzySupDiscrete,       //  Call spread (lb, rb), operands lb, rb, rb - lb
+    FuzzyAnd,
+    FuzzyOr,
+    FuzzyNot,
+    FuzzyTrue,
+    FuzzyFalse,
+    FuzzyIf,                //  Followed by one AffectedVar per variable affected by the IF
+    AffectedVar,            //  Operand of the preceding FuzzyIf, not executed
+    //  Superinstructions, produced by fuseStream()
+    SpotSubConst,           //  Spot, SubConst
+    CallPayoffConst,        //  Spot, SubConst, Max2Const
+    IncVarConst,            //  Var v, AddConst, Assign v
+    SpotAboveConstIf,       //  Spot, SubConst, Sup, If
+    VarAboveConstIf,        //  Var, SubConst, Sup, If
+    //  Number of opcodes, not an opcode
+    NumNodeTypes
 };
 
+//  Number of operands following each opcode in the node stream
+inline size_t numOperands(const int nodeType)
+{
+    switch (nodeType)
+    {
+    case AddConst:
+    case SubConst:
+    case ConstSub:
+    case MultConst:
+    case DivConst:
+    case ConstDiv:
+    case PowConst:
+    case ConstPow:
+    case Max2Const:
+    case Min2Const:
+    case Var:
+    case Const:
+    case Assign:
+    case Pays:
+    case If:
+    case Jump:
+    case AndJump:
+    case OrJump:
+    case SmoothBlendConst:
+        return 1;
+
+    case SpotSubConst:
+        return 1;
+
+    case FuzzyEqual:
+    case AffectedVar:
+        return 1;
+
+    case FuzzyEqualDiscrete:
+    case FuzzySup:
+        return 2;
+
+    case FuzzySupDiscrete:
+        return 3;
+
+    case FuzzyIf:
+        return 4;
+
+    case AssignConst:
+    case PaysConst:
+    case IfElse:
+    case SmoothTest:
+        return 2;
+
+    case SmoothTestConst:
+        return 3;
+
+    case CallPayoffConst:
+    case IncVarConst:
+    case SpotAboveConstIf:
+        return 2;
+
+    case VarAboveConstIf:
+        return 3;
+
+    default:
+        return 0;
+    }
+}
+
+//  Whether the operand k (from 1) of an opcode is the index of a constant in the const stream
+//  Other operands are indices of variables, jump targets, offsets or counts
+inline bool isConstOperand(const int nodeType, const size_t k)
+{
+    switch (nodeType)
+    {
+    case AddConst:
+    case SubConst:
+    case ConstSub:
+    case MultConst:
+    case DivConst:
+    case ConstDiv:
+    case PowConst:
+    case ConstPow:
+    case Max2Const:
+    case Min2Const:
+    case Const:
+    case AssignConst:
+    case PaysConst:
+    case SmoothTestConst:
+    case SmoothBlendConst:
+    case SpotSubConst:
+    case SpotAboveConstIf:
+        return k == 1;
+
+    case IncVarConst:
+    case VarAboveConstIf:
+        return k == 2;
+
+    case FuzzyEqual:
+    case FuzzyEqualDiscrete:
+    case FuzzySup:
+    case FuzzySupDiscrete:
+    case CallPayoffConst:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+//  Stack depth analysis
+//  Walks the node stream in order, tracking the depths of the value, boolean and fuzzy stacks,
+//      depths are recorded at the targets of jumps, all forward, and restored there,
+//      since the code that follows a Jump is not reached from it
+//  Returns the maximum depths, exact, and optionally the depth of the value stack at every instruction
+inline StackDepths stackDepths(const vector<int>& nodeStream, vector<int>* valueDepths = nullptr)
+{
+    const size_t n = nodeStream.size();
+    StackDepths res;
+    int d = 0, b = 0, f = 0;
+
+    //  Depths at jump targets, -1 where not a target
+    vector<int> dAt(n + 1, -1), bAt(n + 1, -1), fAt(n + 1, -1);
+    auto mark = [&](const int target, const int dt)
+    {
+        dAt[target] = dt;
+        bAt[target] = b;
+        fAt[target] = f;
+    };
+
+    if (valueDepths) valueDepths->assign(n + 1, -1);
+
+    for (size_t i = 0; i < n; i += 1 + numOperands(nodeStream[i]))
+    {
+        if (dAt[i] >= 0)
+        {
+            d = dAt[i];
+            b = bAt[i];
+            f = fAt[i];
+        }
+        if (valueDepths) (*valueDepths)[i] = d;
+
+        const int* op = &nodeStream[i];
+        switch (op[0])
+        {
+        case Add: case Sub: case Mult: case Div: case Pow: case Max2: case Min2:
+        case Assign: case Pays:
+            --d;
+            break;
+        case Spot: case Var: case Const: case SpotSubConst: case CallPayoffConst:
+            ++d;
+            break;
+        case Equal: case Sup: case SupEqual:
+            --d;
+            ++b;
+            break;
+        case And: case Or:
+            --b;
+            break;
+        case True: case False:
+            ++b;
+            break;
+        case If:
+            --b;
+            mark(op[1], d);
+            break;
+        case IfElse:
+            --b;
+            mark(op[1], d);
+            mark(op[2], d);
+            break;
+        case Jump: case AndJump: case OrJump:
+            mark(op[1], d);
+            break;
+        case SmoothTest:
+            mark(op[1], d - 2);
+            mark(op[2], d - 2);
+            break;
+        case SmoothTestConst:
+            mark(op[2], d - 1);
+            mark(op[3], d - 1);
+            break;
+        case SmoothBlend:
+            d -= 3;
+            break;
+        case SmoothBlendConst:
+            d -= 2;
+            break;
+        case FuzzyEqual: case FuzzyEqualDiscrete: case FuzzySup: case FuzzySupDiscrete:
+            --d;
+            ++f;
+            break;
+        case FuzzyAnd: case FuzzyOr:
+            --f;
+            break;
+        case FuzzyTrue: case FuzzyFalse:
+            ++f;
+            break;
+        case FuzzyIf:
+            --f;
+            mark(op[1], d);
+            mark(op[2], d);
+            break;
+        case SpotAboveConstIf:
+            mark(op[2], d);
+            break;
+        case VarAboveConstIf:
+            mark(op[3], d);
+            break;
+        }
+
+        res.values = max(res.values, size_t(d));
+        res.bools = max(res.bools, size_t(b));
+        res.fuzzy = max(res.fuzzy, size_t(f));
+    }
+
+    return res;
+}
+
+//  Opcode names, for reports
+inline const char* opcodeName(const int nodeType)
+{
+    static const char* names[] =
+    {
+        "Add",
+        "AddConst",
+        "Sub",
+        "SubConst",
+        "ConstSub",
+        "Mult",
+        "MultConst",
+        "Div",
+        "DivConst",
+        "ConstDiv",
+        "Pow",
+        "PowConst",
+        "ConstPow",
+        "Max2",
+        "Max2Const",
+        "Min2",
+        "Min2Const",
+        "Spot",
+        "Var",
+        "Const",
+        "Assign",
+        "AssignConst",
+        "Pays",
+        "PaysConst",
+        "If",
+        "IfElse",
+        "Jump",
+        "AndJump",
+        "OrJump",
+        "Equal",
+        "Sup",
+        "SupEqual",
+        "And",
+        "Or",
+        "SmoothTest",
+        "SmoothTestConst",
+        "SmoothBlend",
+        "SmoothBlendConst",
+        "Sqrt",
+        "Log",
+        "Not",
+        "Uminus",
+        "True",
+        "False",
+        "FuzzyEqual",
+        "FuzzyEqualDiscrete",
+        "FuzzySup",
+        "FuzzySupDiscrete",
+        "FuzzyAnd",
+        "FuzzyOr",
+        "FuzzyNot",
+        "FuzzyTrue",
+        "FuzzyFalse",
+        "FuzzyIf",
+        "AffectedVar",
+        "SpotSubConst",
+        "CallPayoffConst",
+        "IncVarConst",
+        "SpotAboveConstIf",
+        "VarAboveConstIf"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == NumNodeTypes, "Opcode names out of sync with NodeType");
+
+    return nodeType >= 0 && nodeType < NumNodeTypes ? names[nodeType] : "?";
+}
+
 #define EPS 1.0e-12
+#define ONEMINUSEPS 0.999999999999
+
+//  Statement of a compiled stream, for profiling
+//  Statements are numbered by position within their block: 3.2 is the second statement under the third one of the event
+//  Instructions in [begin, end) belong to the statement, or to statements nested in it
+struct CompiledStatement
+{
+    string  path;
+    string  label;
+    size_t  begin;
+    size_t  end;
+};
 
 class Compiler : public constVisitor<Compiler>
 {
     //	State
     vector<int> myNodeStream;
     vector<double> myConstStream;
-    vector<const void*> myDataStream;
+
+    //  Fuzzy mode: conditions are compiled into degrees of truth and IFs blend their affected variables,
+    //      same as the FuzzyEvaluator, the product must be pre-processed for fuzzy evaluation
+    const bool myFuzzy;
+    //  Default smoothing factor for conditions that don't override it
+    const double myDefEps;
+    //  Size of the work space of fuzzy IFs
+    size_t myStoreSize = 0;
+
+    //  Statements with their ranges of instructions, and numbering of the current blocks
+    vector<CompiledStatement> myStatements;
+    vector<size_t> myNumbering = vector<size_t>(1, 0);
+
+    //  Open a statement at the current position, returns its index
+    size_t beginStatement(const string& label)
+    {
+        ++myNumbering.back();
+        string path;
+        for (size_t k = 0; k < myNumbering.size(); ++k)
+        {
+            path += (k ? "." : "") + to_string(myNumbering[k]);
+        }
+        myStatements.push_back({ path, label, myNodeStream.size(), myNodeStream.size() });
+        myNumbering.push_back(0);
+
+        return myStatements.size() - 1;
+    }
+
+    //  Close it at the current position
+    void endStatement(const size_t s)
+    {
+        myNumbering.pop_back();
+        myStatements[s].end = myNodeStream.size();
+    }
 
 public:
 
     using constVisitor<Compiler>::visit;
 
+    Compiler(const bool fuzzy = false, const double defEps = 0.0) : myFuzzy(fuzzy), myDefEps(defEps) {}
+
     //	Accessors
 
     //	Access the streams after traversal
@@ -111,9 +529,15 @@ public:
     {
         return myConstStream;
     }
-    const vector<const void*>& dataStream() const
+    //  Size of the work space, in the store of the EvalState, for fuzzy IFs
+    size_t storeSize() const
     {
-        return myDataStream;
+        return myStoreSize;
+    }
+    //  Statements, in the order of the stream, nested statements after their parent
+    const vector<CompiledStatement>& statements() const
+    {
+        return myStatements;
     }
 
     //	Visitors
@@ -236,11 +660,65 @@ public:
             myNodeStream.push_back(int(myConstStream.size()));
             myConstStream.push_back(node.constVal);
         }
+        //  Only the branches needed are evaluated, as in the Evaluator:
+        //      x, eps, SmoothTest(Const) toLeft toRight
+        //      vPos, vNeg, SmoothBlend(Const), Jump end
+        //      left: vNeg, Jump end
+        //      right: vPos
+        //      end:
         else
         {
-            //  Must come back to optimize that one
-            visitArguments(node);
-            myNodeStream.push_back(Smooth);
+            const exprNode* eps = downcast<exprNode>(node.arguments[3]);
+
+            //  Test
+            node.arguments[0]->accept(*this);
+            int halfEps = -1;
+            if (eps->isConst)
+            {
+                halfEps = int(myConstStream.size());
+                myConstStream.push_back(0.5 * eps->constVal);
+                myNodeStream.push_back(SmoothTestConst);
+                myNodeStream.push_back(halfEps);
+            }
+            else
+            {
+                node.arguments[3]->accept(*this);
+                myNodeStream.push_back(SmoothTest);
+            }
+            const size_t test = myNodeStream.size();
+            myNodeStream.push_back(0);
+            myNodeStream.push_back(0);
+
+            //  Fuzzy
+            node.arguments[1]->accept(*this);
+            node.arguments[2]->accept(*this);
+            if (eps->isConst)
+            {
+                myNodeStream.push_back(SmoothBlendConst);
+                myNodeStream.push_back(halfEps);
+            }
+            else
+            {
+                myNodeStream.push_back(SmoothBlend);
+            }
+            myNodeStream.push_back(Jump);
+            const size_t jumpFuzzy = myNodeStream.size();
+            myNodeStream.push_back(0);
+
+            //  Left
+            myNodeStream[test] = int(myNodeStream.size());
+            node.arguments[2]->accept(*this);
+            myNodeStream.push_back(Jump);
+            const size_t jumpLeft = myNodeStream.size();
+            myNodeStream.push_back(0);
+
+            //  Right
+            myNodeStream[test + 1] = int(myNodeStream.size());
+            node.arguments[1]->accept(*this);
+
+            //  End
+            myNodeStream[jumpFuzzy] = int(myNodeStream.size());
+            myNodeStream[jumpLeft] = int(myNodeStream.size());
         }
     }
 
@@ -251,7 +729,11 @@ public:
     {
         const exprNode* arg = downcast<exprNode>(node.arguments[0]);
 
-        if (arg->isConst)
+        if (myFuzzy)
+        {
+            visitFuzzyCondition(static_cast<const compNode&>(node), NT == Equal);
+        }
+        else if (arg->isConst)
         {
             myNodeStream.push_back(op(arg->constVal) ? True : False);
 
@@ -263,6 +745,37 @@ public:
         }
     }
 
+    //  Fuzzy conditions: butterfly for equalities, call spread for inequalities
+    //  Smoothing is resolved at compile time, into constant operands:
+    //      discrete: bounds lb and rb, and rb - lb for inequalities
+    //      continuous: eps / 2, preceded by epsilon, default unless overwritten on the node, for inequalities
+    void visitFuzzyCondition(const compNode& node, const bool equal)
+    {
+        node.arguments[0]->accept(*this);
+
+        if (node.discrete)
+        {
+            myNodeStream.push_back(equal ? FuzzyEqualDiscrete : FuzzySupDiscrete);
+            pushConst(node.lb);
+            pushConst(node.rb);
+            if (!equal) pushConst(node.rb - node.lb);
+        }
+        else
+        {
+            const double eps = node.eps < 0 ? myDefEps : node.eps;
+            myNodeStream.push_back(equal ? FuzzyEqual : FuzzySup);
+            if (!equal) pushConst(eps);
+            pushConst(0.5 * eps);
+        }
+    }
+
+    //  Add a constant to the const stream and its index to the node stream
+    void pushConst(const double val)
+    {
+        myNodeStream.push_back(int(myConstStream.size()));
+        myConstStream.push_back(val);
+    }
+
     void visit(const NodeEqual& node)
     {
         visitCondition<Equal>(node, [](const double x) {return x == 0.0; });
@@ -279,24 +792,53 @@ public:
 
     //  And/Or/Not
 
-    void visit(const NodeAnd& node)
+    //  Sharp: short circuit, lhs AndJump(end) rhs And end:
+    //      the rhs is skipped when the lhs is false, And combines otherwise
+    //      And is kept so that the batch evaluator can combine lanes that disagree
+    template <NodeType JumpOp, NodeType Op>
+    void visitShortCircuit(const boolNode& node)
     {
         node.arguments[0]->accept(*this);
+        myNodeStream.push_back(JumpOp);
+        const size_t jump = myNodeStream.size();
+        myNodeStream.push_back(0);
         node.arguments[1]->accept(*this);
-        myNodeStream.push_back(And);
+        myNodeStream.push_back(Op);
+        myNodeStream[jump] = int(myNodeStream.size());
+    }
+
+    void visit(const NodeAnd& node)
+    {
+        if (myFuzzy)
+        {
+            node.arguments[0]->accept(*this);
+            node.arguments[1]->accept(*this);
+            myNodeStream.push_back(FuzzyAnd);
+        }
+        else
+        {
+            visitShortCircuit<AndJump, And>(node);
+        }
     }
 
     void visit(const NodeOr& node)
     {
-        node.arguments[0]->accept(*this);
-        node.arguments[1]->accept(*this);
-        myNodeStream.push_back(Or);
+        if (myFuzzy)
+        {
+            node.arguments[0]->accept(*this);
+            node.arguments[1]->accept(*this);
+            myNodeStream.push_back(FuzzyOr);
+        }
+        else
+        {
+            visitShortCircuit<OrJump, Or>(node);
+        }
     }
 
     void visit(const NodeNot& node)
     {
         node.arguments[0]->accept(*this);
-        myNodeStream.push_back(Not);
+        myNodeStream.push_back(myFuzzy ? FuzzyNot : Not);
     }
 
     //  Assign, pays
@@ -305,6 +847,7 @@ public:
     {
         const NodeVar* var = downcast<NodeVar>(node.arguments[0]);
         const exprNode* rhs = downcast<exprNode>(node.arguments[1]);
+        const size_t stat = beginStatement(var->name + " =");
 
         if (rhs->isConst)
         {
@@ -318,12 +861,15 @@ public:
             myNodeStream.push_back(Assign);
         }
         myNodeStream.push_back(int(var->index));
+
+        endStatement(stat);
     }
 
     void visit(const NodePays& node)
     {
         const NodeVar* var = downcast<NodeVar>(node.arguments[0]);
         const exprNode* rhs = downcast<exprNode>(node.arguments[1]);
+        const size_t stat = beginStatement(var->name + " PAYS");
 
         if (rhs->isConst)
         {
@@ -337,6 +883,8 @@ public:
             myNodeStream.push_back(Pays);
         }
         myNodeStream.push_back(int(var->index));
+
+        endStatement(stat);
     }
 
     //  Leaves
@@ -356,12 +904,12 @@ public:
 
     void visit(const NodeTrue& node)
     {
-        myNodeStream.push_back(True);
+        myNodeStream.push_back(myFuzzy ? FuzzyTrue : True);
     }
 
     void visit(const NodeFalse& node)
     {
-        myNodeStream.push_back(False);
+        myNodeStream.push_back(myFuzzy ? FuzzyFalse : False);
     }
 
     //	Scenario related
@@ -373,6 +921,15 @@ public:
     //	Instructions
     void visit(const NodeIf& node)
     {
+        const size_t stat = beginStatement("IF");
+
+        if (myFuzzy)
+        {
+            visitFuzzyIf(node);
+            endStatement(stat);
+            return;
+        }
+
         //  Visit condition
         node.arguments[0]->accept(*this);
 
@@ -390,6 +947,14 @@ public:
         {
             node.arguments[i]->accept(*this);
         }
+        //  Jump over the if-false statements
+        size_t jumpEnd = 0;
+        if (node.firstElse != -1)
+        {
+            myNodeStream.push_back(Jump);
+            jumpEnd = myNodeStream.size();
+            myNodeStream.push_back(0);
+        }
         //  Record last if-true space
         myNodeStream[thisSpace + 1] = int(myNodeStream.size());
 
@@ -405,112 +970,515 @@ public:
             }
             //  Record last if-false space
             myNodeStream[thisSpace + 2] = int(myNodeStream.size());
+            myNodeStream[jumpEnd] = int(myNodeStream.size());
         }
+
+        endStatement(stat);
     }
-};
 
-template <class T>
-inline void evalCompiled(
-    //  Stream to eval
-    const vector<int>&          nodeStream,
-    const vector<double>&       constStream,
-    const vector<const void*>&  dataStream,
-    //  Scenario
-    const SimulData<T>&         scen,
-    //  State
-    EvalState<T>&               state,
-    //  First (included), last (excluded)
-    const size_t                first = 0,
-    const size_t                last = 0)
-{
-    const size_t n = last ? last : nodeStream.size();
-    size_t i = first;
+    //  Fuzzy if: [FuzzyIf, lastTrue, lastFalse, store, nAffected] [AffectedVar, var] ... if-true ... if-false
+    //      lastFalse = lastTrue without if-false statements
+    //      store is the offset of the work space in the state, 2 x nAffected values
+    void visitFuzzyIf(const NodeIf& node)
+    {
+        //  Visit condition
+        node.arguments[0]->accept(*this);
 
-    //  Work space
-    T x, y, z, t;
-    size_t idx;
+        //  Mark instruction
+        myNodeStream.push_back(FuzzyIf);
+        const size_t thisSpace = myNodeStream.size() - 1;
+        myNodeStream.push_back(0);
+        myNodeStream.push_back(0);
+        myNodeStream.push_back(int(myStoreSize));
+        myNodeStream.push_back(int(node.affectedVars.size()));
+        myStoreSize += 2 * node.affectedVars.size();
 
-    //  Stacks
-    staticStack<T> dStack;
-    staticStack<char> bStack;
+        //  Affected variables
+        for (auto idx : node.affectedVars)
+        {
+            myNodeStream.push_back(AffectedVar);
+            myNodeStream.push_back(int(idx));
+        }
 
-    //  Loop on instructions
-    while (i < n)
-    {
-        //  Big switch
-        switch (nodeStream[i])
+        //  Visit if-true statements
+        const auto lastTrue = node.firstElse == -1 ? node.arguments.size() - 1 : node.firstElse - 1;
+        for (size_t i = 1; i <= lastTrue; ++i)
         {
+            node.arguments[i]->accept(*this);
+        }
+        //  Record last if-true space
+        myNodeStream[thisSpace + 1] = int(myNodeStream.size());
 
-        case Add:
+        //  Visit if-false statements
+        if (node.firstElse != -1)
+        {
+            for (size_t i = node.firstElse; i < node.arguments.size(); ++i)
+            {
+                node.arguments[i]->accept(*this);
+            }
+        }
+        //  Record last if-false space
+        myNodeStream[thisSpace + 2] = int(myNodeStream.size());
+    }
+};
 
-            dStack[1] += dStack.top();
-            dStack.pop();
+//  Opcode statistics of a compiled node stream, accumulated across streams
+//  Counts of single opcodes, and of sequences of 2 and 3 consecutive instructions
+//  within straight line code, so that superinstructions are chosen from measured frequencies
+struct OpcodeStats
+{
+    map<int, size_t>            singles;
+    map<vector<int>, size_t>    sequences;
 
-            ++i;
-            break;
+    void add(const vector<int>& nodeStream)
+    {
+        //  Jump targets break sequences
+        vector<char> target(nodeStream.size() + 1, false);
+        vector<size_t> starts;
+        for (size_t i = 0; i < nodeStream.size(); i += 1 + numOperands(nodeStream[i]))
+        {
+            starts.push_back(i);
+            markTargets(nodeStream, i, target);
+        }
 
-        case AddConst:
+        for (size_t k = 0; k < starts.size(); ++k)
+        {
+            ++singles[nodeStream[starts[k]]];
 
-            dStack.top() += constStream[nodeStream[++i]];
+            vector<int> seq(1, nodeStream[starts[k]]);
+            for (size_t m = 1; m < 3 && k + m < starts.size() && !target[starts[k + m]]; ++m)
+            {
+                seq.push_back(nodeStream[starts[k + m]]);
+                ++sequences[seq];
+            }
+        }
+    }
 
-            ++i;
+    //  Mark the jump targets of the instruction at i
+    static void markTargets(const vector<int>& nodeStream, const size_t i, vector<char>& target)
+    {
+        switch (nodeStream[i])
+        {
+        case If:
+            target[nodeStream[i + 1]] = true;
             break;
-
-        case Sub:
-
-            dStack[1] -= dStack.top();
-            dStack.pop();
-
-            ++i;
+        case IfElse:
+            target[nodeStream[i + 1]] = true;
+            target[nodeStream[i + 2]] = true;
             break;
-
-        case SubConst:
-
-            dStack.top() -= constStream[nodeStream[++i]];
-
-            ++i;
+        case SpotAboveConstIf:
+            target[nodeStream[i + 2]] = true;
             break;
-
-        case ConstSub:
-
-            dStack.top() = constStream[nodeStream[++i]] - dStack.top();
-
-            ++i;
+        case VarAboveConstIf:
+            target[nodeStream[i + 3]] = true;
             break;
-
-        case Mult:
-
-            dStack[1] *= dStack.top();
-            dStack.pop();
-
-            ++i;
+        case Jump:
+        case AndJump:
+        case OrJump:
+            target[nodeStream[i + 1]] = true;
             break;
-
-        case MultConst:
-
-            dStack.top() *= constStream[nodeStream[++i]];
-
-            ++i;
+        case SmoothTest:
+            target[nodeStream[i + 1]] = true;
+            target[nodeStream[i + 2]] = true;
+            break;
+        case SmoothTestConst:
+            target[nodeStream[i + 2]] = true;
+            target[nodeStream[i + 3]] = true;
             break;
+        }
+    }
+};
 
-        case Div:
+//  Superinstructions
+//  Peephole pass over a compiled node stream 
+//      that fuses frequent sequences of instructions into single instructions
+//  Sequences are never fused across a jump target, and jump targets are remapped
+//  The const stream is unchanged
+//  The map of old positions to new ones is optionally returned in indexMap, 
+//      defined (not -1) at instruction starts outside fused sequences and at the end of the stream
+inline vector<int> fuseStream(const vector<int>& nodeStream, vector<int>* indexMap = nullptr)
+{
+    //  Instruction starts and jump targets
+    vector<size_t> starts;
+    vector<char> target(nodeStream.size() + 1, false);
+    for (size_t i = 0; i < nodeStream.size(); i += 1 + numOperands(nodeStream[i]))
+    {
+        starts.push_back(i);
+        OpcodeStats::markTargets(nodeStream, i, target);
+    }
 
-            dStack[1] /= dStack.top();
-            dStack.pop();
+    //  Opcode of the k-th instruction, -1 past the end
+    auto op = [&](const size_t k)
+    {
+        return k < starts.size() ? nodeStream[starts[k]] : -1;
+    };
+    //  First operand of the k-th instruction
+    auto operand = [&](const size_t k)
+    {
+        return nodeStream[starts[k] + 1];
+    };
+    //  Can the len instructions starting at k be fused: no jump target inside
+    auto fusable = [&](const size_t k, const size_t len)
+    {
+        for (size_t m = 1; m < len; ++m)
+        {
+            if (k + m >= starts.size() || target[starts[k + m]]) return false;
+        }
+        return true;
+    };
 
-            ++i;
-            break;
+    vector<int> fused;
+    fused.reserve(nodeStream.size());
+    //  Old index -> new index, for instruction starts and the end of the stream
+    vector<int> newIndex(nodeStream.size() + 1, -1);
 
-        case DivConst:
+    size_t k = 0;
+    while (k < starts.size())
+    {
+        newIndex[starts[k]] = int(fused.size());
 
-            dStack.top() /= constStream[nodeStream[++i]];
+        //  Barrier: Spot, SubConst, Sup, If
+        if (op(k) == Spot && op(k + 1) == SubConst && op(k + 2) == Sup && op(k + 3) == If && fusable(k, 4))
+        {
+            fused.push_back(SpotAboveConstIf);
+            fused.push_back(operand(k + 1));
+            fused.push_back(operand(k + 3));
+            k += 4;
+        }
+        //  Var v, SubConst, Sup, If
+        else if (op(k) == Var && op(k + 1) == SubConst && op(k + 2) == Sup && op(k + 3) == If && fusable(k, 4))
+        {
+            fused.push_back(VarAboveConstIf);
+            fused.push_back(operand(k));
+            fused.push_back(operand(k + 1));
+            fused.push_back(operand(k + 3));
+            k += 4;
+        }
+        //  Call payoff: Spot, SubConst, Max2Const
+        else if (op(k) == Spot && op(k + 1) == SubConst && op(k + 2) == Max2Const && fusable(k, 3))
+        {
+            fused.push_back(CallPayoffConst);
+            fused.push_back(operand(k + 1));
+            fused.push_back(operand(k + 2));
+            k += 3;
+        }
+        //  Spot, SubConst
+        else if (op(k) == Spot && op(k + 1) == SubConst && fusable(k, 2))
+        {
+            fused.push_back(SpotSubConst);
+            fused.push_back(operand(k + 1));
+            k += 2;
+        }
+        //  Counter: Var v, AddConst, Assign v
+        else if (op(k) == Var && op(k + 1) == AddConst && op(k + 2) == Assign && fusable(k, 3) 
+            && operand(k) == operand(k + 2))
+        {
+            fused.push_back(IncVarConst);
+            fused.push_back(operand(k));
+            fused.push_back(operand(k + 1));
+            k += 3;
+        }
+        //  No match: copy
+        else
+        {
+            const size_t i = starts[k];
+            fused.insert(fused.end(), nodeStream.begin() + i, nodeStream.begin() + i + 1 + numOperands(nodeStream[i]));
+            ++k;
+        }
+    }
+    newIndex[nodeStream.size()] = int(fused.size());
+
+    //  Remap jump targets
+    for (size_t i = 0; i < fused.size(); i += 1 + numOperands(fused[i]))
+    {
+        switch (fused[i])
+        {
+        case If:
+            fused[i + 1] = newIndex[fused[i + 1]];
+            break;
+        case IfElse:
+            fused[i + 1] = newIndex[fused[i + 1]];
+            fused[i + 2] = newIndex[fused[i + 2]];
+            break;
+        case SpotAboveConstIf:
+            fused[i + 2] = newIndex[fused[i + 2]];
+            break;
+        case VarAboveConstIf:
+            fused[i + 3] = newIndex[fused[i + 3]];
+            break;
+        case Jump:
+        case AndJump:
+        case OrJump:
+            fused[i + 1] = newIndex[fused[i + 1]];
+            break;
+        case SmoothTest:
+            fused[i + 1] = newIndex[fused[i + 1]];
+            fused[i + 2] = newIndex[fused[i + 2]];
+            break;
+        case SmoothTestConst:
+            fused[i + 2] = newIndex[fused[i + 2]];
+            fused[i + 3] = newIndex[fused[i + 3]];
+            break;
+        }
+    }
+
+    if (indexMap) *indexMap = move(newIndex);
+
+    return fused;
+}
+
+//  Remap the ranges of compiled statements through the index map of fuseStream()
+//  Statements start and end at instruction starts, a position inside a fused sequence maps to the start of the sequence
+inline void remapStatements(vector<CompiledStatement>& statements, const vector<int>& indexMap)
+{
+    auto remap = [&](size_t i)
+    {
+        while (i > 0 && indexMap[i] < 0) --i;
+        return size_t(indexMap[i]);
+    };
+
+    for (auto& stat : statements)
+    {
+        stat.begin = remap(stat.begin);
+        stat.end = remap(stat.end);
+    }
+}
+
+//  Packed streams
+//  The node stream and its constants, packed for execution into a single stream of 8 byte words:
+//      opcodes, indices of variables, jump targets and other integer operands are inlined as integers,
+//      constants are inlined as doubles, in place of their index in the const stream
+//  Every instruction is read from consecutive words, without indirection through the const stream
+//  Packing is one to one, word for word, so positions and jump targets are those of the node stream
+//  The threaded stream is the same, with opcodes replaced by handler addresses
+
+union PackedWord
+{
+    int64_t         i;
+    double          c;
+    const void*     h;
+};
+static_assert(sizeof(PackedWord) == 8, "Packed words must be 8 bytes");
+
+using PackedStream = vector<PackedWord>;
+
+inline PackedStream packStream(const vector<int>& nodeStream, const vector<double>& constStream)
+{
+    PackedStream packed(nodeStream.size());
+
+    for (size_t i = 0; i < nodeStream.size(); i += 1 + numOperands(nodeStream[i]))
+    {
+        const int op = nodeStream[i];
+        packed[i].i = op;
+
+        for (size_t k = 1; k <= numOperands(op); ++k)
+        {
+            if (isConstOperand(op, k)) packed[i + k].c = constStream[nodeStream[i + k]];
+            else packed[i + k].i = nodeStream[i + k];
+        }
+    }
+
+    return packed;
+}
+
+//  Profiling
+//  evalCompiled<T, true> times every instruction it executes, 
+//      and accumulates counts and ticks per opcode and per position in the packed stream of every event
+//  The instrumented interpreter is a separate instantiation, production evaluation is unaffected
+//  Ticks are cycles of the time stamp counter where available, steady clock ticks elsewhere,
+//      and include the overhead of measurement, estimated on construction
+
+inline unsigned long long profileTicks()
+{
+#ifdef PROFILE_RDTSC
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct OpcodeProfile
+{
+    //  Per opcode, over all events
+    vector<unsigned long long>          opCount;
+    vector<unsigned long long>          opTicks;
+    //  Per event, per position in the packed stream
+    vector<vector<unsigned long long>>  count;
+    vector<vector<unsigned long long>>  ticks;
+    //  Number of profiled evaluations
+    size_t                              paths = 0;
+    //  Estimated overhead of one measurement, in ticks
+    double                              overhead = 0.0;
+
+    //  Event being evaluated
+    size_t                              event = 0;
+
+    //  Instruction being timed
+    bool                                timing = false;
+    size_t                              current = 0;
+    int                                 currentOp = 0;
+    unsigned long long                  started = 0;
+
+    //  Sized for the packed streams of all events
+    OpcodeProfile(const vector<size_t>& streamSizes) : opCount(NumNodeTypes, 0), opTicks(NumNodeTypes, 0)
+    {
+        for (auto size : streamSizes)
+        {
+            count.push_back(vector<unsigned long long>(size, 0));
+            ticks.push_back(vector<unsigned long long>(size, 0));
+        }
+
+        //  Calibrate
+        const size_t n = 1000;
+        const unsigned long long t0 = profileTicks();
+        for (size_t k = 0; k < n; ++k) profileTicks();
+        overhead = double(profileTicks() - t0) / n;
+    }
+
+    //  Start timing the instruction at position i, charge the previous one
+    //  Not counted when timing resumes after a nested evaluation
+    void start(const size_t i, const int op, const bool counted = true)
+    {
+        const unsigned long long now = profileTicks();
+        charge(now);
+
+        timing = true;
+        current = i;
+        currentOp = op;
+        started = now;
+        if (counted)
+        {
+            ++opCount[op];
+            ++count[event][i];
+        }
+    }
+
+    //  Stop timing, charge the current instruction
+    void stop()
+    {
+        charge(profileTicks());
+    }
+
+private:
+
+    void charge(const unsigned long long now)
+    {
+        if (!timing) return;
+        opTicks[currentOp] += now - started;
+        ticks[event][current] += now - started;
+        timing = false;
+    }
+};
+
+template <class T, bool PROFILE = false>
+inline void evalCompiled(
+    //  Packed stream to eval
+    const PackedStream&         stream,
+    //  Scenario
+    const SimulData<T>&         scen,
+    //  State
+    EvalState<T>&               state,
+    //  First (included), last (excluded)
+    const size_t                first = 0,
+    const size_t                last = 0,
+    //  Profile, PROFILE only
+    OpcodeProfile*              profile = nullptr)
+{
+    const size_t n = last ? last : stream.size();
+    size_t i = first;
+
+    //  Work space
+    T x, y, z, t;
+    size_t idx;
+
+    //  Stacks, over the memory of the state, sized at compile time
+    //  Nested calls (fuzzy IFs) are statements, so they start with empty stacks and reuse the same memory
+    //  States too small for the stream are rejected by Product::checkState(), 
+    //      and caught on overflow by an assertion of the stacks in debug builds when evalCompiled is called directly
+    stackView<T> dStack(state.valueStack.data(), state.valueStack.size());
+    stackView<char> bStack(state.boolStack.data(), state.boolStack.size());
+    //  Degrees of truth, fuzzy mode
+    stackView<T> fStack(state.fuzzyStack.data(), state.fuzzyStack.size());
+
+    //  Loop on instructions
+    while (i < n)
+    {
+        if (PROFILE) profile->start(i, int(stream[i].i));
+
+        //  Big switch
+        switch (stream[i].i)
+        {
+
+        case Add:
+
+            dStack[1] += dStack.top();
+            dStack.pop();
+
+            ++i;
+            break;
+
+        case AddConst:
+
+            dStack.top() += stream[++i].c;
+
+            ++i;
+            break;
+
+        case Sub:
+
+            dStack[1] -= dStack.top();
+            dStack.pop();
+
+            ++i;
+            break;
+
+        case SubConst:
+
+            dStack.top() -= stream[++i].c;
+
+            ++i;
+            break;
+
+        case ConstSub:
+
+            dStack.top() = stream[++i].c - dStack.top();
+
+            ++i;
+            break;
+
+        case Mult:
+
+            dStack[1] *= dStack.top();
+            dStack.pop();
+
+            ++i;
+            break;
+
+        case MultConst:
+
+            dStack.top() *= stream[++i].c;
+
+            ++i;
+            break;
+
+        case Div:
+
+            dStack[1] /= dStack.top();
+            dStack.pop();
+
+            ++i;
+            break;
+
+        case DivConst:
+
+            dStack.top() /= stream[++i].c;
 
             ++i;
             break;
 
         case ConstDiv:
 
-            dStack.top() = constStream[nodeStream[++i]] / dStack.top();
+            dStack.top() = stream[++i].c / dStack.top();
 
             ++i;
             break;
@@ -525,14 +1493,14 @@ inline void evalCompiled(
 
         case PowConst:
 
-            dStack.top() = pow(dStack.top(), constStream[nodeStream[++i]]);
+            dStack.top() = pow(dStack.top(), stream[++i].c);
 
             ++i;
             break;
 
         case ConstPow:
 
-            dStack.top() = pow(constStream[nodeStream[++i]], dStack.top());
+            dStack.top() = pow(stream[++i].c, dStack.top());
 
             ++i;
             break;
@@ -549,7 +1517,7 @@ inline void evalCompiled(
 
         case Max2Const:
 
-            y = constStream[nodeStream[++i]];
+            y = stream[++i].c;
             if (y > dStack.top()) dStack.top() = y;
 
             ++i;
@@ -567,7 +1535,7 @@ inline void evalCompiled(
 
         case Min2Const:
 
-            y = constStream[nodeStream[++i]];
+            y = stream[++i].c;
             if (y < dStack.top()) dStack.top() = y;
 
             ++i;
@@ -582,21 +1550,21 @@ inline void evalCompiled(
 
         case Var:
 
-            dStack.push(state.variables[nodeStream[++i]]);
+            dStack.push(state.variables[stream[++i].i]);
 
             ++i;
             break;
 
         case Const:
 
-            dStack.push(constStream[nodeStream[++i]]);
+            dStack.push(stream[++i].c);
 
             ++i;
             break;
 
         case Assign:
 
-            idx = nodeStream[++i];
+            idx = stream[++i].i;
             state.variables[idx] = dStack.top();
             dStack.pop();
 
@@ -605,8 +1573,8 @@ inline void evalCompiled(
 
         case AssignConst:
 
-            x = constStream[nodeStream[++i]];
-            idx = nodeStream[++i];
+            x = stream[++i].c;
+            idx = stream[++i].i;
             state.variables[idx] = x;
 
             ++i;
@@ -615,7 +1583,7 @@ inline void evalCompiled(
         case Pays:
 
             ++i;
-            idx = nodeStream[i];
+            idx = stream[i].i;
             state.variables[idx] += dStack.top() / scen.numeraire;
             dStack.pop();
 
@@ -624,8 +1592,8 @@ inline void evalCompiled(
 
         case PaysConst:
 
-            x = constStream[nodeStream[++i]];
-            idx = nodeStream[++i];
+            x = stream[++i].c;
+            idx = stream[++i].i;
             state.variables[idx] += x / scen.numeraire;
 
             ++i;
@@ -639,30 +1607,58 @@ inline void evalCompiled(
             }
             else
             {
-                i = nodeStream[++i];
+                i = stream[++i].i;
             }
 
             bStack.pop();
 
             break;
 
+        //  The if-true statements end with a jump over the if-false statements, no nested call
+
         case IfElse:
 
-            if (!bStack.top())
+            if (bStack.top())
             {
-                i = nodeStream[++i];
+                i += 3;
             }
             else
             {
-                //  Cannot avoid nested call here
-                evalCompiled(nodeStream, constStream, dataStream, scen, state, i + 3, nodeStream[i + 1]);
-                i = nodeStream[i + 2];
+                i = stream[++i].i;
             }
 
             bStack.pop();
 
             break;
 
+        //  Short circuit, the condition is left on the stack when jumping
+
+        case AndJump:
+
+            if (bStack.top())
+            {
+                i += 2;
+            }
+            else
+            {
+                i = stream[++i].i;
+            }
+
+            break;
+
+        case OrJump:
+
+            if (bStack.top())
+            {
+                i = stream[++i].i;
+            }
+            else
+            {
+                i += 2;
+            }
+
+            break;
+
         case Equal:
 
             bStack.push(dStack.top() == 0);
@@ -709,31 +1705,89 @@ inline void evalCompiled(
             ++i;
             break;
 
-        case Smooth:
+        case SmoothTest:
 
-            //	Eval the condition
-            x = dStack[3];
+            x = dStack[1];
             y = 0.5*dStack.top();
-            z = dStack[2];
-            t = dStack[1];
-
-            dStack.pop(3);
 
             //	Left
-            if (x < -y) dStack.top() = t;
-
+            if (x < -y)
+            {
+                dStack.pop(2);
+                i = stream[i + 1].i;
+            }
             //	Right
-            if (x < -y) dStack.top() = z;
+            else if (x > y)
+            {
+                dStack.pop(2);
+                i = stream[i + 2].i;
+            }
+            //	Fuzzy, keep x and eps / 2
+            else
+            {
+                dStack.top() = y;
+                i += 3;
+            }
 
-            //	Fuzzy
+            break;
+
+        case SmoothTestConst:
+
+            x = dStack.top();
+            y = stream[i + 1].c;
+
+            //	Left
+            if (x < -y)
+            {
+                dStack.pop();
+                i = stream[i + 2].i;
+            }
+            //	Right
+            else if (x > y)
+            {
+                dStack.pop();
+                i = stream[i + 3].i;
+            }
+            //	Fuzzy, keep x
             else
             {
-                dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+                i += 4;
             }
 
+            break;
+
+        case SmoothBlend:
+
+            x = dStack[3];
+            y = dStack[2];
+            z = dStack[1];
+            t = dStack.top();
+
+            dStack.pop(3);
+            dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+
+            ++i;
+            break;
+
+        case SmoothBlendConst:
+
+            x = dStack[2];
+            y = stream[++i].c;
+            z = dStack[1];
+            t = dStack.top();
+
+            dStack.pop(2);
+            dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+
             ++i;
             break;
 
+        case Jump:
+
+            i = stream[i + 1].i;
+
+            break;
+
         case Sqrt:
 
             dStack.top() = sqrt(dStack.top());
@@ -773,8 +1827,875 @@ inline void evalCompiled(
 
             bStack.push(false);
 
+            ++i;
+            break;
+
+        //  Fuzzy, same calculations as the FuzzyEvaluator
+
+        case FuzzyEqual:
+        {
+            x = dStack.top();
+            dStack.pop();
+            const double halfEps = stream[++i].c;
+
+            //  Butterfly
+            if (x < -halfEps || x > halfEps) fStack.push(0.0);
+            else fStack.push((halfEps - fabs(x)) / halfEps);
+
             ++i;
             break;
         }
-    }
-}
\ No newline at end of file
+
+        case FuzzyEqualDiscrete:
+        {
+            x = dStack.top();
+            dStack.pop();
+            const double lb = stream[++i].c, rb = stream[++i].c;
+
+            //  Butterfly
+            if (x < lb || x > rb) fStack.push(0.0);
+            else if (x < 0.0) fStack.push(1.0 - x / lb);
+            else fStack.push(1.0 - x / rb);
+
+            ++i;
+            break;
+        }
+
+        case FuzzySup:
+        {
+            x = dStack.top();
+            dStack.pop();
+            const double eps = stream[++i].c, halfEps = stream[++i].c;
+
+            //  Call spread
+            if (x < -halfEps) fStack.push(0.0);
+            else if (x > halfEps) fStack.push(1.0);
+            else fStack.push((x + halfEps) / eps);
+
+            ++i;
+            break;
+        }
+
+        case FuzzySupDiscrete:
+        {
+            x = dStack.top();
+            dStack.pop();
+            const double lb = stream[++i].c, rb = stream[++i].c, width = stream[++i].c;
+
+            //  Call spread
+            if (x < lb) fStack.push(0.0);
+            else if (x > rb) fStack.push(1.0);
+            else fStack.push((x - lb) / width);
+
+            ++i;
+            break;
+        }
+
+        //  Hard coded proba style and->dt(lhs)*dt(rhs), or->dt(lhs)+dt(rhs)-dt(lhs)*dt(rhs)
+
+        case FuzzyAnd:
+
+            x = fStack.top();
+            fStack.pop();
+            fStack.top() = x * fStack.top();
+
+            ++i;
+            break;
+
+        case FuzzyOr:
+
+            x = fStack.top();
+            fStack.pop();
+            y = fStack.top();
+            fStack.top() = x + y - x * y;
+
+            ++i;
+            break;
+
+        case FuzzyNot:
+
+            fStack.top() = 1.0 - fStack.top();
+
+            ++i;
+            break;
+
+        case FuzzyTrue:
+
+            fStack.push(1.0);
+
+            ++i;
+            break;
+
+        case FuzzyFalse:
+
+            fStack.push(0.0);
+
+            ++i;
+            break;
+
+        case FuzzyIf:
+        {
+            //  Degree of truth
+            x = fStack.top();
+            fStack.pop();
+
+            const size_t lastTrue = stream[i + 1].i, lastFalse = stream[i + 2].i;
+            const size_t nAff = stream[i + 4].i;
+            //  Affected variables, every other word
+            const PackedWord* aff = &stream[i + 6];
+            const size_t firstTrue = i + 5 + 2 * nAff;
+
+            //	Absolutely true
+            if (x > ONEMINUSEPS)
+            {
+                evalCompiled<T, PROFILE>(stream, scen, state, firstTrue, lastTrue, profile);
+                i = lastFalse;
+            }
+            //	Absolutely false
+            else if (x < EPS)
+            {
+                i = lastTrue;
+            }
+            //	Fuzzy
+            else
+            {
+                T* store0 = state.store.data() + stream[i + 3].i;
+                T* store1 = store0 + nAff;
+
+                //	Record values of variables to be changed
+                for (size_t k = 0; k < nAff; ++k) store0[k] = state.variables[aff[2 * k].i];
+
+                //	Eval "if true" statements
+                evalCompiled<T, PROFILE>(stream, scen, state, firstTrue, lastTrue, profile);
+                if (PROFILE) profile->start(i, FuzzyIf, false);
+
+                //	Record and reset values of variables to be changed
+                for (size_t k = 0; k < nAff; ++k)
+                {
+                    idx = aff[2 * k].i;
+                    store1[k] = state.variables[idx];
+                    state.variables[idx] = store0[k];
+                }
+
+                //	Eval "if false" statements if any
+                if (lastFalse > lastTrue)
+                {
+                    evalCompiled<T, PROFILE>(stream, scen, state, lastTrue, lastFalse, profile);
+                    if (PROFILE) profile->start(i, FuzzyIf, false);
+                }
+
+                //	Set values of variables to fuzzy values
+                for (size_t k = 0; k < nAff; ++k)
+                {
+                    idx = aff[2 * k].i;
+                    state.variables[idx] = x * store1[k] + (1.0 - x) * state.variables[idx];
+                }
+
+                i = lastFalse;
+            }
+
+            break;
+        }
+
+        //  Superinstructions
+
+        case SpotSubConst:
+
+            dStack.push(scen.spot - stream[++i].c);
+
+            ++i;
+            break;
+
+        case CallPayoffConst:
+
+            x = scen.spot - stream[++i].c;
+            y = stream[++i].c;
+            dStack.push(y > x ? y : x);
+
+            ++i;
+            break;
+
+        case IncVarConst:
+
+            idx = stream[++i].i;
+            state.variables[idx] += stream[++i].c;
+
+            ++i;
+            break;
+
+        case SpotAboveConstIf:
+
+            if (scen.spot - stream[i + 1].c > 0)
+            {
+                i += 3;
+            }
+            else
+            {
+                i = stream[i + 2].i;
+            }
+
+            break;
+
+        case VarAboveConstIf:
+
+            if (state.variables[stream[i + 1].i] - stream[i + 2].c > 0)
+            {
+                i += 4;
+            }
+            else
+            {
+                i = stream[i + 3].i;
+            }
+
+            break;
+        }
+    }
+}
+
+//  Direct threaded interpreter
+
+//  Where the compiler supports labels as values (GCC, Clang), 
+//      the opcodes in a node stream are resolved once and for all, after compilation,
+//      into the addresses of their handlers in the threaded interpreter,
+//      and every handler jumps directly to the next one, 
+//      bypassing the bounds checked jump table and the shared indirect branch of the big switch
+//  Elsewhere (MSVC), threaded evaluation falls back to evalCompiled
+
+#if defined(__GNUC__) || defined(__clang__)
+#define THREADED_DISPATCH
+#endif
+
+//  Threaded stream: the packed stream where opcodes are replaced by handler addresses
+//      operands (inlined constants, variables, jump targets) are unchanged
+using ThreadedStream = PackedStream;
+
+#ifdef THREADED_DISPATCH
+
+//  The threaded interpreter
+//  Same instructions, same order of operations as evalCompiled, hence same results, bit for bit
+//  When handlers is not null, the interpreter does not evaluate anything,
+//      it only returns the addresses of its handlers, indexed by NodeType
+template <class T>
+inline void threadedInterpreter(
+    //  Stream to eval
+    const PackedWord*           stream,
+    //  Scenario
+    const SimulData<T>*         scen,
+    //  State
+    T*                          variables,
+    //  Memory of the stacks and their sizes
+    T*                          values,
+    char*                       bools,
+    const size_t                numValues,
+    const size_t                numBools,
+    //  First (included), last (excluded)
+    const size_t                first,
+    const size_t                last,
+    //  Handler table, for resolution only
+    const void* const**         handlers = nullptr)
+{
+    //  Handlers, in the order of NodeType
+    static const void* const labels[] =
+    {
+        &&lAdd,
+        &&lAddConst,
+        &&lSub,
+        &&lSubConst,
+        &&lConstSub,
+        &&lMult,
+        &&lMultConst,
+        &&lDiv,
+        &&lDivConst,
+        &&lConstDiv,
+        &&lPow,
+        &&lPowConst,
+        &&lConstPow,
+        &&lMax2,
+        &&lMax2Const,
+        &&lMin2,
+        &&lMin2Const,
+        &&lSpot,
+        &&lVar,
+        &&lConst,
+        &&lAssign,
+        &&lAssignConst,
+        &&lPays,
+        &&lPaysConst,
+        &&lIf,
+        &&lIfElse,
+        &&lJump,
+        &&lAndJump,
+        &&lOrJump,
+        &&lEqual,
+        &&lSup,
+        &&lSupEqual,
+        &&lAnd,
+        &&lOr,
+        &&lSmoothTest,
+        &&lSmoothTestConst,
+        &&lSmoothBlend,
+        &&lSmoothBlendConst,
+        &&lSqrt,
+        &&lLog,
+        &&lNot,
+        &&lUminus,
+        &&lTrue,
+        &&lFalse,
+        //  Fuzzy instructions are interpreted by evalCompiled only
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lUnsupported,
+        &&lSpotSubConst,
+        &&lCallPayoffConst,
+        &&lIncVarConst,
+        &&lSpotAboveConstIf,
+        &&lVarAboveConstIf
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == NumNodeTypes, "Threaded handlers out of sync with NodeType");
+
+    if (handlers)
+    {
+        *handlers = labels;
+        return;
+    }
+
+    const size_t n = last;
+    size_t i = first;
+
+    //  Work space
+    T x, y, z, t;
+    size_t idx;
+
+    //  Stacks
+    stackView<T> dStack(values, numValues);
+    stackView<char> bStack(bools, numBools);
+
+    //  Jump to the handler of the next instruction, if any
+#define DISPATCH if (i >= n) return; goto *stream[i].h
+
+    DISPATCH;
+
+lAdd:
+
+    dStack[1] += dStack.top();
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lAddConst:
+
+    dStack.top() += stream[++i].c;
+
+    ++i;
+    DISPATCH;
+
+lSub:
+
+    dStack[1] -= dStack.top();
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lSubConst:
+
+    dStack.top() -= stream[++i].c;
+
+    ++i;
+    DISPATCH;
+
+lConstSub:
+
+    dStack.top() = stream[++i].c - dStack.top();
+
+    ++i;
+    DISPATCH;
+
+lMult:
+
+    dStack[1] *= dStack.top();
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lMultConst:
+
+    dStack.top() *= stream[++i].c;
+
+    ++i;
+    DISPATCH;
+
+lDiv:
+
+    dStack[1] /= dStack.top();
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lDivConst:
+
+    dStack.top() /= stream[++i].c;
+
+    ++i;
+    DISPATCH;
+
+lConstDiv:
+
+    dStack.top() = stream[++i].c / dStack.top();
+
+    ++i;
+    DISPATCH;
+
+lPow:
+
+    dStack[1] = pow(dStack[1], dStack.top());
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lPowConst:
+
+    dStack.top() = pow(dStack.top(), stream[++i].c);
+
+    ++i;
+    DISPATCH;
+
+lConstPow:
+
+    dStack.top() = pow(stream[++i].c, dStack.top());
+
+    ++i;
+    DISPATCH;
+
+lMax2:
+
+    y = dStack.top();
+
+    if (y > dStack[1]) dStack[1] = y;
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lMax2Const:
+
+    y = stream[++i].c;
+    if (y > dStack.top()) dStack.top() = y;
+
+    ++i;
+    DISPATCH;
+
+lMin2:
+
+    y = dStack.top();
+
+    if (y < dStack[1]) dStack[1] = y;
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lMin2Const:
+
+    y = stream[++i].c;
+    if (y < dStack.top()) dStack.top() = y;
+
+    ++i;
+    DISPATCH;
+
+lSpot:
+
+    dStack.push(scen->spot);
+
+    ++i;
+    DISPATCH;
+
+lVar:
+
+    dStack.push(variables[stream[++i].i]);
+
+    ++i;
+    DISPATCH;
+
+lConst:
+
+    dStack.push(stream[++i].c);
+
+    ++i;
+    DISPATCH;
+
+lAssign:
+
+    idx = stream[++i].i;
+    variables[idx] = dStack.top();
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lAssignConst:
+
+    x = stream[++i].c;
+    idx = stream[++i].i;
+    variables[idx] = x;
+
+    ++i;
+    DISPATCH;
+
+lPays:
+
+    ++i;
+    idx = stream[i].i;
+    variables[idx] += dStack.top() / scen->numeraire;
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lPaysConst:
+
+    x = stream[++i].c;
+    idx = stream[++i].i;
+    variables[idx] += x / scen->numeraire;
+
+    ++i;
+    DISPATCH;
+
+lIf:
+
+    if (bStack.top())
+    {
+        i += 2;
+    }
+    else
+    {
+        i = stream[++i].i;
+    }
+
+    bStack.pop();
+
+    DISPATCH;
+
+lIfElse:
+
+    if (bStack.top())
+    {
+        i += 3;
+    }
+    else
+    {
+        i = stream[++i].i;
+    }
+
+    bStack.pop();
+
+    DISPATCH;
+
+lAndJump:
+
+    if (bStack.top())
+    {
+        i += 2;
+    }
+    else
+    {
+        i = stream[++i].i;
+    }
+
+    DISPATCH;
+
+lOrJump:
+
+    if (bStack.top())
+    {
+        i = stream[++i].i;
+    }
+    else
+    {
+        i += 2;
+    }
+
+    DISPATCH;
+
+lJump:
+
+    i = stream[i + 1].i;
+    DISPATCH;
+
+lEqual:
+
+    bStack.push(dStack.top() == 0);
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lSup:
+
+    bStack.push(dStack.top() > 0);
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lSupEqual:
+
+    bStack.push(dStack.top() >= 0);
+    dStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lAnd:
+
+    if (bStack[1])
+    {
+        bStack[1] = bStack.top();
+    }
+    bStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lOr:
+
+    if (!bStack[1])
+    {
+        bStack[1] = bStack.top();
+    }
+    bStack.pop();
+
+    ++i;
+    DISPATCH;
+
+lSmoothTest:
+
+    x = dStack[1];
+    y = 0.5*dStack.top();
+
+    //	Left
+    if (x < -y)
+    {
+        dStack.pop(2);
+        i = stream[i + 1].i;
+    }
+    //	Right
+    else if (x > y)
+    {
+        dStack.pop(2);
+        i = stream[i + 2].i;
+    }
+    //	Fuzzy, keep x and eps / 2
+    else
+    {
+        dStack.top() = y;
+        i += 3;
+    }
+
+    DISPATCH;
+
+lSmoothTestConst:
+
+    x = dStack.top();
+    y = stream[i + 1].c;
+
+    //	Left
+    if (x < -y)
+    {
+        dStack.pop();
+        i = stream[i + 2].i;
+    }
+    //	Right
+    else if (x > y)
+    {
+        dStack.pop();
+        i = stream[i + 3].i;
+    }
+    //	Fuzzy, keep x
+    else
+    {
+        i += 4;
+    }
+
+    DISPATCH;
+
+lSmoothBlend:
+
+    x = dStack[3];
+    y = dStack[2];
+    z = dStack[1];
+    t = dStack.top();
+
+    dStack.pop(3);
+    dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+
+    ++i;
+    DISPATCH;
+
+lSmoothBlendConst:
+
+    x = dStack[2];
+    y = stream[++i].c;
+    z = dStack[1];
+    t = dStack.top();
+
+    dStack.pop(2);
+    dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+
+    ++i;
+    DISPATCH;
+
+lSqrt:
+
+    dStack.top() = sqrt(dStack.top());
+
+    ++i;
+    DISPATCH;
+
+lLog:
+
+    dStack.top() = log(dStack.top());
+
+    ++i;
+    DISPATCH;
+
+lNot:
+
+    bStack.top() = !bStack.top();
+
+    ++i;
+    DISPATCH;
+
+lUminus:
+
+    dStack.top() = -dStack.top();
+
+    ++i;
+    DISPATCH;
+
+lTrue:
+
+    bStack.push(true);
+
+    ++i;
+    DISPATCH;
+
+lFalse:
+
+    bStack.push(false);
+
+    ++i;
+    DISPATCH;
+
+lUnsupported:
+
+    throw runtime_error("Instruction not supported by the threaded interpreter");
+
+    //  Superinstructions
+
+lSpotSubConst:
+
+    dStack.push(scen->spot - stream[++i].c);
+
+    ++i;
+    DISPATCH;
+
+lCallPayoffConst:
+
+    x = scen->spot - stream[++i].c;
+    y = stream[++i].c;
+    dStack.push(y > x ? y : x);
+
+    ++i;
+    DISPATCH;
+
+lIncVarConst:
+
+    idx = stream[++i].i;
+    variables[idx] += stream[++i].c;
+
+    ++i;
+    DISPATCH;
+
+lSpotAboveConstIf:
+
+    if (scen->spot - stream[i + 1].c > 0)
+    {
+        i += 3;
+    }
+    else
+    {
+        i = stream[i + 2].i;
+    }
+
+    DISPATCH;
+
+lVarAboveConstIf:
+
+    if (variables[stream[i + 1].i] - stream[i + 2].c > 0)
+    {
+        i += 4;
+    }
+    else
+    {
+        i = stream[i + 3].i;
+    }
+
+    DISPATCH;
+
+#undef DISPATCH
+}
+
+//  Resolve the opcodes of a packed stream into the addresses of the handlers 
+//      of the threaded interpreter for type T
+template <class T>
+inline ThreadedStream threadStream(const PackedStream& packed)
+{
+    const void* const* handlers;
+    threadedInterpreter<T>(nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, 0, 0, &handlers);
+
+    ThreadedStream threaded(packed);
+
+    for (size_t i = 0; i < packed.size(); i += 1 + numOperands(int(packed[i].i)))
+    {
+        threaded[i].h = handlers[packed[i].i];
+    }
+
+    return threaded;
+}
+
+//  Evaluate a threaded stream
+template <class T>
+inline void evalThreaded(
+    //  Stream to eval
+    const ThreadedStream&       threadedStream,
+    //  Scenario
+    const SimulData<T>&         scen,
+    //  State
+    EvalState<T>&               state)
+{
+    threadedInterpreter<T>(
+        threadedStream.data(), 
+        &scen, 
+        state.variables.data(), 
+        state.valueStack.data(), 
+        state.boolStack.data(), 
+        state.valueStack.size(), 
+        state.boolStack.size(), 
+        0, 
+        threadedStream.size());
+}
+
+#endif
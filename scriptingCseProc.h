@@ -0,0 +1,397 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//	Common subexpression elimination
+//	Identifies structurally identical expression subtrees within an event
+//		and evaluates them once into a temporary variable
+//	Expressions are hash-consed: two subtrees share an id when they apply the same operation 
+//		to arguments that share ids, so identical expressions are found in a single bottom-up pass
+//	An expression remains available from its first evaluation until a variable it reads is assigned
+//	It is shared with the following statements of its block (the event, or the if true 
+//		or if false statements of an if) and the blocks nested in them, so the assignment 
+//		of the temporary, inserted before the statement of its first occurrence, precedes all of them
+//	Constant subtrees are left alone: the var indexer and the const processor must have been run first
+//	Temporaries are new variables, indexed after the existing ones
+
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+
+#include "scriptingNodes.h"
+
+class CseProcessor : public Visitor<CseProcessor>
+{
+	//	Hash-consing
+
+	//	What we know of an expression node
+	struct ExprInfo
+	{
+		//	Same id = same expression
+		size_t				id;
+		//	Indices of the variables read, sorted
+		vector<size_t>		vars;
+		//	Worth sharing: neither a leaf nor a constant
+		bool				candidate;
+	};
+
+	//	Ids of structures, and info on the expression nodes of the event being processed
+	map<string, size_t>						myIds;
+	unordered_map<const Node*, ExprInfo>	myInfo;
+
+	//	Available expressions
+
+	struct Entry
+	{
+		size_t				id;
+		vector<size_t>		vars;
+		//	Slots holding the occurrences, the first one is evaluated into the temporary
+		vector<ExprTree*>	occurrences;
+		//	Statement before which the temporary is assigned
+		vector<ExprTree>*	block;
+		size_t				position;
+	};
+
+	//	All expressions met in the event, in order of registration, 
+	//		so arguments come before the expressions that use them
+	vector<Entry>							myEntries;
+	//	Expressions available from the current statement: id to entry, one map per nested block
+	vector<map<size_t, size_t>>				myScopes;
+
+	//	Statement being processed, and the if nodes holding the blocks
+	vector<ExprTree>*						myBlock;
+	size_t									myPosition;
+	map<vector<ExprTree>*, NodeIf*>			myIfs;
+
+	//	Variable names, temporaries appended
+	vector<string>							myVarNames;
+	set<string>								myNameSet;
+
+	//	Nodes removed so far
+	size_t									myNodesRemoved;
+
+	//	Helpers
+
+	//	Hash-cons an expression node out of its operation and arguments
+	void hashCons(exprNode& node, const string& op)
+	{
+		visitArguments(node);
+
+		ExprInfo info;
+		string key = op;
+		for (const auto& arg : node.arguments)
+		{
+			const ExprInfo& argInfo = myInfo.at(arg.get());
+			key += ',' + to_string(argInfo.id);
+			vector<size_t> vars;
+			set_union(info.vars.begin(), info.vars.end(), argInfo.vars.begin(), argInfo.vars.end(), back_inserter(vars));
+			info.vars = move(vars);
+		}
+
+		//	Constants are identified by value, to the bit
+		if (node.isConst) key = constKey(node.constVal);
+
+		info.candidate = !node.isConst && !node.arguments.empty();
+		info.id = id(key);
+		myInfo[&node] = move(info);
+	}
+
+	static string constKey(const double val)
+	{
+		unsigned long long bits;
+		memcpy(&bits, &val, sizeof(bits));
+		return "CONST," + to_string(bits);
+	}
+
+	size_t id(const string& key)
+	{
+		auto it = myIds.find(key);
+		if (it != myIds.end()) return it->second;
+		const size_t newId = myIds.size();
+		myIds[key] = newId;
+		return newId;
+	}
+
+	//	Visit the statements first to last of a block, in a scope of its own
+	void processBlock(vector<ExprTree>& block, const size_t first, const size_t last)
+	{
+		vector<ExprTree>* outerBlock = myBlock;
+		const size_t outerPosition = myPosition;
+		myScopes.emplace_back();
+
+		myBlock = &block;
+		for (myPosition = first; myPosition < last; ++myPosition)
+		{
+			block[myPosition]->accept(*this);
+		}
+
+		myScopes.pop_back();
+		myBlock = outerBlock;
+		myPosition = outerPosition;
+	}
+
+	//	Match the expressions evaluated in a hash-consed tree against the available ones, top down
+	//	A match is recorded as an occurrence of the available expression, otherwise the expression 
+	//		becomes available after its arguments
+	void share(ExprTree& slot)
+	{
+		auto it = myInfo.find(slot.get());
+
+		//	Not an expression (condition): look inside
+		if (it == myInfo.end())
+		{
+			for (auto& arg : slot->arguments) share(arg);
+			return;
+		}
+
+		//	Leaves and constants: nothing to share
+		const ExprInfo& info = it->second;
+		if (!info.candidate) return;
+
+		//	Available?
+		for (auto scope = myScopes.rbegin(); scope != myScopes.rend(); ++scope)
+		{
+			auto entry = scope->find(info.id);
+			if (entry != scope->end())
+			{
+				//	Arguments are shared too, in case this occurrence is not replaced
+				myEntries[entry->second].occurrences.push_back(&slot);
+				for (auto& arg : slot->arguments) share(arg);
+				return;
+			}
+		}
+
+		//	Not available: arguments first, then make it available
+		for (auto& arg : slot->arguments) share(arg);
+		myScopes.back()[info.id] = myEntries.size();
+		myEntries.push_back(Entry{ info.id, info.vars, { &slot }, myBlock, myPosition });
+	}
+
+	//	Hash-cons and share
+	void hashConsAndShare(ExprTree& slot)
+	{
+		slot->accept(*this);
+		share(slot);
+	}
+
+	//	Variable assigned: expressions that read it are no longer available
+	void assigned(const ExprTree& var)
+	{
+		const size_t idx = downcast<NodeVar>(var)->index;
+		for (auto& scope : myScopes)
+		{
+			for (auto it = scope.begin(); it != scope.end();)
+			{
+				const auto& vars = myEntries[it->second].vars;
+				if (binary_search(vars.begin(), vars.end(), idx)) it = scope.erase(it);
+				else ++it;
+			}
+		}
+	}
+
+	//	Slots inside a tree about to be destroyed
+	static void markDead(const Node& node, set<const ExprTree*>& dead)
+	{
+		for (const auto& arg : node.arguments)
+		{
+			dead.insert(&arg);
+			markDead(*arg, dead);
+		}
+	}
+
+	//	Make a new temporary and return its index
+	size_t newTemp()
+	{
+		string name;
+		size_t i = 0;
+		do name = "_CSE" + to_string(++i); while (myNameSet.count(name));
+		myNameSet.insert(name);
+		myVarNames.push_back(name);
+		return myVarNames.size() - 1;
+	}
+
+	ExprTree makeVar(const size_t idx) const
+	{
+		auto var = make_node<NodeVar>(myVarNames[idx]);
+		var->index = idx;
+		var->isConst = false;
+		return var;
+	}
+
+	//	Evaluate the expressions with multiple occurrences into temporaries, 
+	//		when that saves nodes net of the assignment and the references to the temporary
+	void materialize()
+	{
+		//	Assignments to insert per block, by position of the statement they precede, then order of registration
+		map<vector<ExprTree>*, map<pair<size_t, size_t>, ExprTree>> assignments;
+
+		//	Occurrences inside replaced occurrences of larger expressions
+		set<const ExprTree*> dead;
+
+		//	Larger expressions first: they are registered after their arguments
+		for (size_t e = myEntries.size(); e-- > 0;)
+		{
+			Entry& entry = myEntries[e];
+
+			vector<ExprTree*> occurrences;
+			copy_if(entry.occurrences.begin(), entry.occurrences.end(), back_inserter(occurrences), 
+				[&dead](ExprTree* occ) { return !dead.count(occ); });
+			const size_t k = occurrences.size();
+			if (k < 2) continue;
+
+			size_t removed = 0;
+			for (auto occ : occurrences) removed += countNodes(**occ);
+			const size_t added = countNodes(**occurrences.front()) + 2 + k;
+			if (removed <= added) continue;
+			myNodesRemoved += removed - added;
+
+			//	The first occurrence is evaluated into the temporary,
+			//		the value is the same from the statement where the expression became available
+			const size_t idx = newTemp();
+			auto assign = make_base_node<NodeAssign>();
+			assign->arguments.resize(2);
+			assign->arguments[0] = makeVar(idx);
+			assign->arguments[1] = move(*occurrences.front());
+			for (size_t i = 1; i < k; ++i) markDead(**occurrences[i], dead);
+			for (auto occ : occurrences) *occ = makeVar(idx);
+
+			assignments[entry.block][make_pair(entry.position, e)] = move(assign);
+		}
+
+		//	Insert
+		for (auto& blockAssigns : assignments)
+		{
+			vector<ExprTree>& block = *blockAssigns.first;
+			auto& assigns = blockAssigns.second;
+
+			//	If false statements move down by the number of assignments inserted before them
+			auto ifIt = myIfs.find(&block);
+			if (ifIt != myIfs.end() && ifIt->second->firstElse != -1)
+			{
+				const size_t firstElse = ifIt->second->firstElse;
+				ifIt->second->firstElse += int(distance(assigns.begin(), assigns.lower_bound(make_pair(firstElse, size_t(0)))));
+			}
+
+			vector<ExprTree> newBlock;
+			newBlock.reserve(block.size() + assigns.size());
+			auto assignIt = assigns.begin();
+			for (size_t i = 0; i < block.size(); ++i)
+			{
+				while (assignIt != assigns.end() && assignIt->first.first == i) newBlock.push_back(move((assignIt++)->second));
+				newBlock.push_back(move(block[i]));
+			}
+			block = move(newBlock);
+		}
+	}
+
+public:
+
+	using Visitor<CseProcessor>::visit;
+
+	//	Constructor, with the variable names from Product after indexation
+	CseProcessor(const vector<string>& varNames) : 
+		myBlock(nullptr),
+		myPosition(0),
+		myVarNames(varNames), 
+		myNameSet(varNames.begin(), varNames.end()),
+		myNodesRemoved(0)
+	{}
+
+	//	This processor modifies the structure of the trees, hence it must be called only 
+	//		with this method, on every event
+	void processEvent(Event& evt)
+	{
+		processBlock(evt, 0, evt.size());
+		materialize();
+
+		myEntries.clear();
+		myInfo.clear();
+		myIfs.clear();
+	}
+
+	//	Access results after all events are processed
+
+	//	Variable names, including temporaries
+	const vector<string>& varNames() const
+	{
+		return myVarNames;
+	}
+
+	//	Number of nodes removed from the trees, net of the assignments and references to the temporaries
+	size_t nodesRemoved() const
+	{
+		return myNodesRemoved;
+	}
+
+	//	Statements
+
+	void visit(NodeAssign& node)
+	{
+		hashConsAndShare(node.arguments[1]);
+		assigned(node.arguments[0]);
+	}
+
+	void visit(NodePays& node)
+	{
+		hashConsAndShare(node.arguments[1]);
+		assigned(node.arguments[0]);
+	}
+
+	void visit(NodeIf& node)
+	{
+		//	The condition is evaluated with the if statement
+		hashConsAndShare(node.arguments[0]);
+
+		//	The nested blocks
+		myIfs[&node.arguments] = &node;
+		const size_t lastTrue = node.firstElse == -1 ? node.arguments.size() : node.firstElse;
+		processBlock(node.arguments, 1, lastTrue);
+		if (node.firstElse != -1) processBlock(node.arguments, node.firstElse, node.arguments.size());
+	}
+
+	void visit(NodeCollect& node)
+	{
+		processBlock(node.arguments, 0, node.arguments.size());
+	}
+
+	//	Expressions
+
+	void visit(NodeAdd& node) { hashCons(node, "ADD"); }
+	void visit(NodeSub& node) { hashCons(node, "SUB"); }
+	void visit(NodeMult& node) { hashCons(node, "MULT"); }
+	void visit(NodeDiv& node) { hashCons(node, "DIV"); }
+	void visit(NodePow& node) { hashCons(node, "POW"); }
+	void visit(NodeMax& node) { hashCons(node, "MAX"); }
+	void visit(NodeMin& node) { hashCons(node, "MIN"); }
+	void visit(NodeUplus& node) { hashCons(node, "UPLUS"); }
+	void visit(NodeUminus& node) { hashCons(node, "UMINUS"); }
+	void visit(NodeLog& node) { hashCons(node, "LOG"); }
+	void visit(NodeSqrt& node) { hashCons(node, "SQRT"); }
+	void visit(NodeSmooth& node) { hashCons(node, "SMOOTH"); }
+	void visit(NodeSpot& node) { hashCons(node, "SPOT"); }
+	void visit(NodeConst& node) { hashCons(node, "CONST"); }
+
+	void visit(NodeVar& node)
+	{
+		hashCons(node, "VAR," + to_string(node.index));
+		myInfo[&node].vars.push_back(node.index);
+	}
+
+	//	Conditions are not shared, but the expressions in them are
+};
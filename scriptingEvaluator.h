@@ -77,6 +77,14 @@ public:
 		myBstack.reset();
 	}
 
+	//	Same, only the variables in resetVars, as found by the init processor
+	void init(const vector<size_t>& resetVars)
+	{
+		for (auto idx : resetVars) myVariables[idx] = 0.0;
+		myDstack.reset();
+		myBstack.reset();
+	}
+
 	//	Accessors
 
 	//	Access to variable values after evaluation
@@ -0,0 +1,469 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Flat storage of the trees of a product
+
+//  Nodes are stored in one contiguous arena, children before their parent, that is in evaluation order,
+//      and refer to their children with 32 bit positions in the arena, rather than pointers to separate allocations
+//  Data specific to some kinds of nodes lives in side arrays: 
+//      constants, fuzzy data of comparisons, data of IFs and their affected variables
+//  The Flattener builds the arena from the trees, and toTree() rebuilds trees from the arena,
+//      so all the existing visitors and pre-processors still run on the flat form, through visit() and transform()
+
+#include "scriptingNodes.h"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+//  Kinds of nodes, one per concrete node
+enum FlatKind : uint8_t
+{
+    FlatAdd,
+    FlatSub,
+    FlatMult,
+    FlatDiv,
+    FlatPow,
+    FlatMax,
+    FlatMin,
+    FlatUplus,
+    FlatUminus,
+    FlatLog,
+    FlatSqrt,
+    FlatSmooth,
+    FlatEqual,
+    FlatSup,
+    FlatSupEqual,
+    FlatAnd,
+    FlatOr,
+    FlatNot,
+    FlatSpot,
+    FlatConst,
+    FlatTrue,
+    FlatFalse,
+    FlatVar,
+    FlatAssign,
+    FlatPays,
+    FlatIf,
+    FlatCollect,
+    //  Number of kinds, not a kind
+    NumFlatKinds
+};
+
+//  Flags
+enum FlatFlag : uint8_t
+{
+    FlatIsConst = 1,            //  Expressions: constant, value in the constant array
+    FlatAlwaysTrue = 2,         //  Conditions and IFs, as per domain processor
+    FlatAlwaysFalse = 4
+};
+
+struct FlatNode
+{
+    uint8_t     kind;
+    uint8_t     flags;
+    uint16_t    numArgs;
+    //  Position of the first child in the argument array
+    uint32_t    firstArg;
+    //  Var, Assign, Pays: index of the variable, Const: position in the constant array
+    //  Comparisons: position in the comparison array, If: position in the if array
+    uint32_t    payload;
+    //  Constant expressions: position of the value in the constant array
+    uint32_t    constant;
+};
+static_assert(sizeof(FlatNode) == 16, "Flat nodes must be 16 bytes");
+
+//  Fuzzy data of comparisons
+struct FlatCompData
+{
+    bool        discrete;
+    double      eps;
+    double      lb;
+    double      rb;
+};
+
+//  Data of IFs
+struct FlatIfData
+{
+    int32_t     firstElse;
+    //  Affected variables, in the affected array
+    uint32_t    firstAffected;
+    uint32_t    numAffected;
+};
+
+struct FlatAst
+{
+    //  Arena
+    vector<FlatNode>            nodes;
+    //  Positions of children in the arena, every node refers to numArgs consecutive entries
+    vector<uint32_t>            args;
+    //  Position of the first node of the subtree of every node, 
+    //      the subtree is stored contiguously in [firsts[n], n]
+    vector<uint32_t>            firsts;
+
+    //  Side arrays
+    vector<double>              constants;
+    vector<FlatCompData>        comps;
+    vector<FlatIfData>          ifs;
+    vector<uint32_t>            affected;
+    //  Names of the variables, by index
+    vector<string>              varNames;
+
+    //  Positions of the top statements, by event
+    vector<vector<uint32_t>>    events;
+
+    //  Analyses of the trees, set by Product::flatten(), dropped by transform() which changes the flat form
+    //  Variables reset before each path, all of them when not analyzed
+    vector<size_t>              resetVars;
+    bool                        initAnalyzed = false;
+    //  Termination guard, see Product::guardProcess(), no guard when guardFrom is -1
+    size_t                      guardFrom = size_t(-1);
+    size_t                      guardVar = 0;
+    double                      guardConst = 0.0;
+
+    //  Access
+
+    const uint32_t* argsOf(const FlatNode& node) const
+    {
+        return args.data() + node.firstArg;
+    }
+
+    size_t size() const
+    {
+        return nodes.size();
+    }
+
+    //  Bytes used by the arena and side arrays, names excluded
+    size_t bytes() const
+    {
+        size_t n = nodes.size() * sizeof(FlatNode) + args.size() * sizeof(uint32_t) + firsts.size() * sizeof(uint32_t)
+            + constants.size() * sizeof(double) + comps.size() * sizeof(FlatCompData)
+            + ifs.size() * sizeof(FlatIfData) + affected.size() * sizeof(uint32_t);
+        for (const auto& evt : events) n += evt.size() * sizeof(uint32_t);
+        return n;
+    }
+
+    //  Drop the analyses of the trees
+    void invalidateAnalyses()
+    {
+        resetVars.clear();
+        initAnalyzed = false;
+        guardFrom = size_t(-1);
+    }
+
+    //  Is the path dead at the start of event evt, as per the termination guard
+    //  Sharp evaluation only
+    template <class T>
+    bool dead(const size_t evt, const vector<T>& variables) const
+    {
+        return evt >= guardFrom && variables[guardVar] != T(guardConst);
+    }
+
+    //  Build from the trees, variables must be indexed, without analyses
+    //  Implemented after the Flattener
+    void build(const vector<Event>& trees, const vector<string>& names);
+
+    //  Adapter
+
+    //  Rebuild the tree of the node at position n
+    ExprTree toTree(const uint32_t n) const
+    {
+        const FlatNode& node = nodes[n];
+        ExprTree tree;
+
+        switch (node.kind)
+        {
+        case FlatAdd: tree = make_base_node<NodeAdd>(); break;
+        case FlatSub: tree = make_base_node<NodeSub>(); break;
+        case FlatMult: tree = make_base_node<NodeMult>(); break;
+        case FlatDiv: tree = make_base_node<NodeDiv>(); break;
+        case FlatPow: tree = make_base_node<NodePow>(); break;
+        case FlatMax: tree = make_base_node<NodeMax>(); break;
+        case FlatMin: tree = make_base_node<NodeMin>(); break;
+        case FlatUplus: tree = make_base_node<NodeUplus>(); break;
+        case FlatUminus: tree = make_base_node<NodeUminus>(); break;
+        case FlatLog: tree = make_base_node<NodeLog>(); break;
+        case FlatSqrt: tree = make_base_node<NodeSqrt>(); break;
+        case FlatSmooth: tree = make_base_node<NodeSmooth>(); break;
+        case FlatEqual: tree = make_base_node<NodeEqual>(); break;
+        case FlatSup: tree = make_base_node<NodeSup>(); break;
+        case FlatSupEqual: tree = make_base_node<NodeSupEqual>(); break;
+        case FlatAnd: tree = make_base_node<NodeAnd>(); break;
+        case FlatOr: tree = make_base_node<NodeOr>(); break;
+        case FlatNot: tree = make_base_node<NodeNot>(); break;
+        case FlatSpot: tree = make_base_node<NodeSpot>(); break;
+        case FlatConst: tree = make_base_node<NodeConst>(constants[node.payload]); break;
+        case FlatTrue: tree = make_base_node<NodeTrue>(); break;
+        case FlatFalse: tree = make_base_node<NodeFalse>(); break;
+        case FlatVar: 
+        {
+            auto var = make_node<NodeVar>(varNames[node.payload]);
+            var->index = node.payload;
+            tree = move(var);
+            break;
+        }
+        case FlatAssign: tree = make_base_node<NodeAssign>(); break;
+        case FlatPays: tree = make_base_node<NodePays>(); break;
+        case FlatIf:
+        {
+            auto nIf = make_node<NodeIf>();
+            const FlatIfData& data = ifs[node.payload];
+            nIf->firstElse = data.firstElse;
+            nIf->affectedVars.assign(affected.begin() + data.firstAffected, affected.begin() + data.firstAffected + data.numAffected);
+            nIf->alwaysTrue = (node.flags & FlatAlwaysTrue) != 0;
+            nIf->alwaysFalse = (node.flags & FlatAlwaysFalse) != 0;
+            tree = move(nIf);
+            break;
+        }
+        case FlatCollect: tree = make_base_node<NodeCollect>(); break;
+        default: throw runtime_error("Unknown kind of flat node");
+        }
+
+        //  Data of the base nodes
+        if (node.kind <= FlatSmooth || node.kind == FlatSpot || node.kind == FlatConst || node.kind == FlatVar)
+        {
+            exprNode* expr = static_cast<exprNode*>(tree.get());
+            expr->isConst = (node.flags & FlatIsConst) != 0;
+            if (expr->isConst) expr->constVal = constants[node.constant];
+        }
+        else if (node.kind <= FlatNot || node.kind == FlatTrue || node.kind == FlatFalse)
+        {
+            boolNode* cond = static_cast<boolNode*>(tree.get());
+            cond->alwaysTrue = (node.flags & FlatAlwaysTrue) != 0;
+            cond->alwaysFalse = (node.flags & FlatAlwaysFalse) != 0;
+            if (node.kind >= FlatEqual && node.kind <= FlatSupEqual)
+            {
+                compNode* comp = static_cast<compNode*>(tree.get());
+                const FlatCompData& data = comps[node.payload];
+                comp->discrete = data.discrete;
+                comp->eps = data.eps;
+                comp->lb = data.lb;
+                comp->rb = data.rb;
+            }
+        }
+
+        //  Children
+        tree->arguments.resize(node.numArgs);
+        const uint32_t* a = argsOf(node);
+        for (size_t k = 0; k < node.numArgs; ++k) tree->arguments[k] = toTree(a[k]);
+
+        return tree;
+    }
+
+    //  Rebuild all the trees
+    vector<Event> toTrees() const
+    {
+        vector<Event> trees(events.size());
+        for (size_t e = 0; e < events.size(); ++e)
+        {
+            trees[e].reserve(events[e].size());
+            for (auto stat : events[e]) trees[e].push_back(toTree(stat));
+        }
+        return trees;
+    }
+
+    //  Run f on rebuilt trees and flatten the result again
+    //  f takes a vector<Event>& and may modify the trees, for instance run processors with their own entry points
+    //  Variables may be renamed or re-indexed in the process, the new names are returned by f
+    //  The analyses of the trees no longer hold and are dropped
+    template <class F>
+    void transform(F f)
+    {
+        vector<Event> trees = toTrees();
+        const vector<string> names = f(trees);
+        build(trees, names);
+    }
+
+    //	Sequentially visit all statements in all events, on rebuilt trees, and store the modified trees
+    template<class V>
+    void visit(Visitor<V>& v)
+    {
+        transform([&](vector<Event>& trees)
+        {
+            for (auto& evt : trees)
+            {
+                for (auto& stat : evt) stat->accept(static_cast<V&>(v));
+            }
+            return varNames;
+        });
+    }
+
+    //  Same for const visitors
+    template<class V>
+    void visit(constVisitor<V>& v) const
+    {
+        const vector<Event> trees = toTrees();
+        for (const auto& evt : trees)
+        {
+            for (const auto& stat : evt) stat->accept(static_cast<V&>(v));
+        }
+    }
+};
+
+//  The visitor that builds the flat form, post-order
+class Flattener : public constVisitor<Flattener>
+{
+    FlatAst& myAst;
+
+    //  Push a node after its children, returns its position
+    uint32_t add(const Node& node, const FlatKind kind, uint8_t flags = 0, const uint32_t payload = 0)
+    {
+        if (node.arguments.size() > UINT16_MAX) throw runtime_error("Too many arguments for a flat node");
+
+        //  Children first
+        vector<uint32_t> children;
+        children.reserve(node.arguments.size());
+        for (const auto& arg : node.arguments)
+        {
+            arg->accept(*this);
+            children.push_back(uint32_t(myAst.nodes.size() - 1));
+        }
+
+        FlatNode flat;
+        flat.kind = kind;
+        flat.flags = flags;
+        flat.numArgs = uint16_t(children.size());
+        flat.firstArg = uint32_t(myAst.args.size());
+        flat.payload = payload;
+        flat.constant = 0;
+        myAst.args.insert(myAst.args.end(), children.begin(), children.end());
+
+        myAst.nodes.push_back(flat);
+        return uint32_t(myAst.nodes.size() - 1);
+    }
+
+    uint32_t addConstant(const double val)
+    {
+        myAst.constants.push_back(val);
+        return uint32_t(myAst.constants.size() - 1);
+    }
+
+    //  Expressions, with their constant value if any
+    void addExpr(const exprNode& node, const FlatKind kind, const uint32_t payload = 0)
+    {
+        const uint32_t n = add(node, kind, node.isConst ? FlatIsConst : 0, payload);
+        if (node.isConst) myAst.nodes[n].constant = addConstant(node.constVal);
+    }
+
+    static uint8_t condFlags(const bool alwaysTrue, const bool alwaysFalse)
+    {
+        return (alwaysTrue ? FlatAlwaysTrue : 0) | (alwaysFalse ? FlatAlwaysFalse : 0);
+    }
+
+    //  Comparisons, with their fuzzy data
+    void addComp(const compNode& node, const FlatKind kind)
+    {
+        myAst.comps.push_back({ node.discrete, node.eps, node.lb, node.rb });
+        add(node, kind, condFlags(node.alwaysTrue, node.alwaysFalse), uint32_t(myAst.comps.size() - 1));
+    }
+
+    void addCond(const boolNode& node, const FlatKind kind)
+    {
+        add(node, kind, condFlags(node.alwaysTrue, node.alwaysFalse));
+    }
+
+public:
+
+    using constVisitor<Flattener>::visit;
+
+    Flattener(FlatAst& ast) : myAst(ast) {}
+
+    void visit(const NodeAdd& node) { addExpr(node, FlatAdd); }
+    void visit(const NodeSub& node) { addExpr(node, FlatSub); }
+    void visit(const NodeMult& node) { addExpr(node, FlatMult); }
+    void visit(const NodeDiv& node) { addExpr(node, FlatDiv); }
+    void visit(const NodePow& node) { addExpr(node, FlatPow); }
+    void visit(const NodeMax& node) { addExpr(node, FlatMax); }
+    void visit(const NodeMin& node) { addExpr(node, FlatMin); }
+    void visit(const NodeUplus& node) { addExpr(node, FlatUplus); }
+    void visit(const NodeUminus& node) { addExpr(node, FlatUminus); }
+    void visit(const NodeLog& node) { addExpr(node, FlatLog); }
+    void visit(const NodeSqrt& node) { addExpr(node, FlatSqrt); }
+    void visit(const NodeSmooth& node) { addExpr(node, FlatSmooth); }
+    void visit(const NodeSpot& node) { addExpr(node, FlatSpot); }
+
+    void visit(const NodeConst& node) 
+    { 
+        addExpr(node, FlatConst, addConstant(node.constVal)); 
+    }
+
+    void visit(const NodeVar& node)
+    {
+        if (node.index >= myAst.varNames.size()) throw runtime_error("Variables must be indexed before flattening");
+        addExpr(node, FlatVar, uint32_t(node.index));
+    }
+
+    void visit(const NodeEqual& node) { addComp(node, FlatEqual); }
+    void visit(const NodeSup& node) { addComp(node, FlatSup); }
+    void visit(const NodeSupEqual& node) { addComp(node, FlatSupEqual); }
+
+    void visit(const NodeAnd& node) { addCond(node, FlatAnd); }
+    void visit(const NodeOr& node) { addCond(node, FlatOr); }
+    void visit(const NodeNot& node) { addCond(node, FlatNot); }
+    void visit(const NodeTrue& node) { addCond(node, FlatTrue); }
+    void visit(const NodeFalse& node) { addCond(node, FlatFalse); }
+
+    void visit(const NodeAssign& node) { add(node, FlatAssign, 0, uint32_t(downcast<NodeVar>(node.arguments[0])->index)); }
+    void visit(const NodePays& node) { add(node, FlatPays, 0, uint32_t(downcast<NodeVar>(node.arguments[0])->index)); }
+    void visit(const NodeCollect& node) { add(node, FlatCollect); }
+
+    void visit(const NodeIf& node)
+    {
+        FlatIfData data;
+        data.firstElse = node.firstElse;
+        data.firstAffected = uint32_t(myAst.affected.size());
+        data.numAffected = uint32_t(node.affectedVars.size());
+        for (auto idx : node.affectedVars) myAst.affected.push_back(uint32_t(idx));
+        myAst.ifs.push_back(data);
+
+        add(node, FlatIf, condFlags(node.alwaysTrue, node.alwaysFalse), uint32_t(myAst.ifs.size() - 1));
+    }
+};
+
+inline void FlatAst::build(const vector<Event>& trees, const vector<string>& names)
+{
+    nodes.clear();
+    args.clear();
+    firsts.clear();
+    constants.clear();
+    comps.clear();
+    ifs.clear();
+    affected.clear();
+    events.clear();
+    varNames = names;
+    invalidateAnalyses();
+
+    Flattener flattener(*this);
+
+    events.resize(trees.size());
+    for (size_t e = 0; e < trees.size(); ++e)
+    {
+        for (const auto& stat : trees[e])
+        {
+            stat->accept(flattener);
+            events[e].push_back(uint32_t(nodes.size() - 1));
+        }
+    }
+
+    //  Children before parents, the subtree starts with that of the first child
+    firsts.resize(nodes.size());
+    for (uint32_t n = 0; n < nodes.size(); ++n)
+    {
+        firsts[n] = nodes[n].numArgs ? firsts[args[nodes[n].firstArg]] : n;
+    }
+}
@@ -0,0 +1,434 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Evaluation of the flat form of a product, see scriptingFlatAst.h
+
+//  No virtual call and no recursion: nodes are dispatched by a switch on their kind, 
+//      statements are scheduled on an explicit work stack,
+//      and expressions and conditions are evaluated by one linear scan of their subtree, stored contiguously in evaluation order
+//  Sharp mode produces the same results as the Evaluator, fuzzy mode as the FuzzyEvaluator, bit for bit
+//  Unlike the tree walk, both sides of an AND, an OR or a SMOOTH are always evaluated, with the same result
+//  Templated on the number type, so it also evaluates the cases the compiler does not cover
+
+#include "scriptingFlatAst.h"
+#include "scriptingScenarios.h"
+#include "scriptingFuzzyEval.h"
+
+#include <vector>
+
+template <class T>
+class FlatEvaluator
+{
+    //  Fuzzy or sharp
+    const bool                  myFuzzy;
+    //	Default smoothing factor for conditions that don't override it
+    const double                myDefEps;
+
+    //	State
+    vector<T>                   myVariables;
+
+    //	Stacks of values, bools and degrees of truth, 
+    //      sized to the number of nodes in the arena, an expression never pushes more than the nodes of its subtree
+    vector<T>                   myValues;
+    vector<char>                myBools;
+    vector<T>                   myDts;
+
+    //  Work stack of blocks of statements: 
+    //      the positions of the statements in the arena, the next and end statements of the block,
+    //      the parent IF or collection, and the kind of the block, which determines what to do on exhaustion
+    enum BlockKind : uint32_t
+    {
+        PlainBlock,
+        FuzzyTrueBlock,
+        FuzzyFalseBlock
+    };
+    struct Frame
+    {
+        const uint32_t*     stats;
+        uint32_t            next;
+        uint32_t            end;
+        uint32_t            parent;
+        BlockKind           kind;
+    };
+    vector<Frame>               myWork;
+
+    //  Fuzzy IFs being evaluated: degrees of truth, and stored values of affected variables
+    vector<T>                   myIfDts;
+    vector<T>                   myStore;
+
+    //	Reference to current scenario
+    const Scenario<T>*          myScenario;
+
+    //	Index of current event
+    size_t                      myCurEvt;
+
+    //  Exhausted block on top of the work stack: pop it, or move on to the if-false statements of a fuzzy IF
+    void endBlock(const FlatAst& ast)
+    {
+        Frame& frame = myWork.back();
+        if (frame.kind == PlainBlock)
+        {
+            myWork.pop_back();
+            return;
+        }
+
+        const FlatNode& node = ast.nodes[frame.parent];
+        const FlatIfData& data = ast.ifs[node.payload];
+        const uint32_t* aff = ast.affected.data() + data.firstAffected;
+        T* store = myStore.data() + myStore.size() - data.numAffected;
+
+        //  After the if-true statements: record and reset values of affected variables,
+        //      then evaluate the if-false statements, if any
+        if (frame.kind == FuzzyTrueBlock)
+        {
+            for (size_t k = 0; k < data.numAffected; ++k)
+            {
+                const T val = myVariables[aff[k]];
+                myVariables[aff[k]] = store[k];
+                store[k] = val;
+            }
+
+            if (data.firstElse != -1)
+            {
+                frame.next = data.firstElse;
+                frame.end = node.numArgs;
+                frame.kind = FuzzyFalseBlock;
+                return;
+            }
+        }
+
+        //  After the if-false statements: set values of variables to fuzzy values
+        const T dt = myIfDts.back();
+        myIfDts.pop_back();
+        for (size_t k = 0; k < data.numAffected; ++k)
+        {
+            myVariables[aff[k]] = dt * store[k] + (1.0 - dt) * myVariables[aff[k]];
+        }
+        myStore.resize(myStore.size() - data.numAffected);
+
+        myWork.pop_back();
+    }
+
+    //  Evaluate the top statements of an event, with their nested statements
+    template <bool FUZZY>
+    void evalEvent(const FlatAst& ast, const vector<uint32_t>& stats)
+    {
+        if (myValues.size() < ast.size())
+        {
+            myValues.resize(ast.size());
+            myBools.resize(ast.size());
+            myDts.resize(ast.size());
+        }
+
+        size_t top = 0;
+
+        for (;;)
+        {
+            //  Next statement: from the innermost block on the work stack, or the next top statement
+            uint32_t n;
+            if (!myWork.empty())
+            {
+                Frame& frame = myWork.back();
+                if (frame.next == frame.end)
+                {
+                    endBlock(ast);
+                    continue;
+                }
+                n = frame.stats[frame.next++];
+            }
+            else if (top < stats.size())
+            {
+                n = stats[top++];
+            }
+            else break;
+
+            const FlatNode& node = ast.nodes[n];
+            const uint32_t* a = ast.argsOf(node);
+
+            //  Collections only schedule their statements
+            if (node.kind == FlatCollect)
+            {
+                myWork.push_back({ a, 0, node.numArgs, n, PlainBlock });
+                continue;
+            }
+
+            //  Evaluate the condition of an IF, or the expression of an assignment or payment: 
+            //      the variable is the first node of the subtree, followed by the expression, which ends just before the statement
+            const bool isIf = node.kind == FlatIf;
+            const uint32_t first = isIf ? ast.firsts[n] : ast.firsts[n] + 1, last = isIf ? a[0] : n - 1;
+
+            //  Linear scan of the subtree, stored in [first, last]
+            //  The result is left at the bottom of the value stack, the bool stack in sharp mode or the stack of degrees of truth
+            //  Tops of the stacks
+            T* d = myValues.data() - 1;
+            char* b = myBools.data() - 1;
+            T* f = myDts.data() - 1;
+
+            const FlatNode* nodes = ast.nodes.data();
+
+            for (uint32_t i = first; i <= last; ++i)
+            {
+                const FlatNode& node = nodes[i];
+
+                switch (node.kind)
+                {
+                case FlatAdd:
+                    d[-1] += d[0];
+                    --d;
+                    break;
+                case FlatSub:
+                    d[-1] -= d[0];
+                    --d;
+                    break;
+                case FlatMult:
+                    d[-1] *= d[0];
+                    --d;
+                    break;
+                case FlatDiv:
+                    d[-1] /= d[0];
+                    --d;
+                    break;
+                case FlatPow:
+                    d[-1] = pow(d[-1], d[0]);
+                    --d;
+                    break;
+                //  MAX and MIN take the first two arguments only, as in the Evaluator, the others are discarded
+                case FlatMax:
+                    d -= node.numArgs - 2;
+                    if (d[-1] < d[0]) d[-1] = d[0];
+                    --d;
+                    break;
+                case FlatMin:
+                    d -= node.numArgs - 2;
+                    if (d[-1] > d[0]) d[-1] = d[0];
+                    --d;
+                    break;
+                case FlatUplus:
+                    break;
+                case FlatUminus:
+                    d[0] = -d[0];
+                    break;
+                case FlatLog:
+                    d[0] = log(d[0]);
+                    break;
+                case FlatSqrt:
+                    d[0] = sqrt(d[0]);
+                    break;
+
+                //  Stack: x, vPos, vNeg, eps
+                case FlatSmooth:
+                {
+                    const T halfEps = 0.5 * d[0];
+                    const T vNeg = d[-1], vPos = d[-2], x = d[-3];
+                    d -= 3;
+
+                    if (x < -halfEps) d[0] = vNeg;
+                    else if (x > halfEps) d[0] = vPos;
+                    else d[0] = vNeg + 0.5 * (vPos - vNeg) / halfEps * (x + halfEps);
+                    break;
+                }
+
+                case FlatEqual:
+                case FlatSup:
+                case FlatSupEqual:
+                {
+                    const T x = *d--;
+
+                    if (FUZZY)
+                    {
+                        const FlatCompData& comp = ast.comps[node.payload];
+                        const double eps = comp.eps < 0 ? myDefEps : comp.eps;
+                        if (node.kind == FlatEqual)
+                        {
+                            *++f = comp.discrete 
+                                ? FuzzyEvaluator<T>::bFly(x, comp.lb, comp.rb) 
+                                : FuzzyEvaluator<T>::bFly(x, eps);
+                        }
+                        else
+                        {
+                            *++f = comp.discrete
+                                ? FuzzyEvaluator<T>::cSpr(x, comp.lb, comp.rb)
+                                : FuzzyEvaluator<T>::cSpr(x, eps);
+                        }
+                    }
+                    else
+                    {
+                        *++b = node.kind == FlatEqual ? x == 0 : node.kind == FlatSup ? x > 0 : x >= 0;
+                    }
+                    break;
+                }
+
+                //  Fuzzy: same operations, in the same order, as the FuzzyEvaluator
+                case FlatAnd:
+                    if (FUZZY)
+                    {
+                        f[-1] = f[0] * f[-1];
+                        --f;
+                    }
+                    else
+                    {
+                        b[-1] = b[-1] && b[0];
+                        --b;
+                    }
+                    break;
+                case FlatOr:
+                    if (FUZZY)
+                    {
+                        f[-1] = f[0] + f[-1] - f[0] * f[-1];
+                        --f;
+                    }
+                    else
+                    {
+                        b[-1] = b[-1] || b[0];
+                        --b;
+                    }
+                    break;
+                case FlatNot:
+                    if (FUZZY) f[0] = 1.0 - f[0];
+                    else b[0] = !b[0];
+                    break;
+
+                case FlatSpot:
+                    *++d = (*myScenario)[myCurEvt].spot;
+                    break;
+                case FlatConst:
+                    *++d = ast.constants[node.payload];
+                    break;
+                case FlatVar:
+                    *++d = myVariables[node.payload];
+                    break;
+                case FlatTrue:
+                    if (FUZZY) *++f = 1.0;
+                    else *++b = true;
+                    break;
+                case FlatFalse:
+                    if (FUZZY) *++f = 0.0;
+                    else *++b = false;
+                    break;
+
+                default:
+                    throw runtime_error("Statement found in an expression");
+                }
+            }
+
+
+            switch (node.kind)
+            {
+            case FlatAssign:
+                myVariables[node.payload] = myValues[0];
+                break;
+
+            case FlatPays:
+                myVariables[node.payload] += myValues[0] / (*myScenario)[myCurEvt].numeraire;
+                break;
+
+            case FlatIf:
+            {
+                const FlatIfData& data = ast.ifs[node.payload];
+                const uint32_t lastTrue = data.firstElse == -1 ? node.numArgs : data.firstElse;
+
+                if (!FUZZY)
+                {
+                    if (myBools[0]) myWork.push_back({ a, 1, lastTrue, n, PlainBlock });
+                    else if (data.firstElse != -1) myWork.push_back({ a, uint32_t(data.firstElse), node.numArgs, n, PlainBlock });
+                }
+                else
+                {
+                    const T dt = myDts[0];
+
+                    //	Absolutely true
+                    if (dt > ONEMINUSEPS)
+                    {
+                        myWork.push_back({ a, 1, lastTrue, n, PlainBlock });
+                    }
+                    //	Absolutely false
+                    else if (dt < EPS)
+                    {
+                        if (data.firstElse != -1) myWork.push_back({ a, uint32_t(data.firstElse), node.numArgs, n, PlainBlock });
+                    }
+                    //	Fuzzy: record values of affected variables and evaluate the if-true statements
+                    else
+                    {
+                        myIfDts.push_back(dt);
+                        const uint32_t* aff = ast.affected.data() + data.firstAffected;
+                        for (size_t k = 0; k < data.numAffected; ++k) myStore.push_back(myVariables[aff[k]]);
+
+                        myWork.push_back({ a, 1, lastTrue, n, FuzzyTrueBlock });
+                    }
+                }
+                break;
+            }
+
+            default:
+                throw runtime_error("Expression found in place of a statement");
+            }
+        }
+    }
+
+public:
+
+    FlatEvaluator(const size_t nVar, const bool fuzzy = false, const double defEps = 0.0)
+        : myFuzzy(fuzzy), myDefEps(defEps), myVariables(nVar) {}
+
+    //	(Re-)initialize before evaluation in each scenario
+    void init()
+    {
+        for (auto& var : myVariables) var = 0.0;
+        myWork.clear();
+        myIfDts.clear();
+        myStore.clear();
+    }
+
+    //	Same, only the variables in resetVars, as found by the init processor
+    void init(const vector<size_t>& resetVars)
+    {
+        for (auto idx : resetVars) myVariables[idx] = 0.0;
+        myWork.clear();
+        myIfDts.clear();
+        myStore.clear();
+    }
+
+    //	Access to variable values after evaluation
+    const vector<T>& varVals() const
+    {
+        return myVariables;
+    }
+
+    bool fuzzy() const
+    {
+        return myFuzzy;
+    }
+
+    //	Set reference to current scenario
+    void setScenario(const Scenario<T>* scen)
+    {
+        myScenario = scen;
+    }
+
+    //	Set index of current event
+    void setCurEvt(const size_t curEvt)
+    {
+        myCurEvt = curEvt;
+    }
+
+    //  Evaluate all the statements of the current event, with all their nested statements
+    void evalEvent(const FlatAst& ast)
+    {
+        if (myFuzzy) evalEvent<true>(ast, ast.events[myCurEvt]);
+        else evalEvent<false>(ast, ast.events[myCurEvt]);
+    }
+};
@@ -51,6 +51,10 @@ class FuzzyEvaluator : public EvaluatorBase<T, FuzzyEvaluator>
 		return res;
 	}
 
+public:
+
+	//	Fuzzy payoffs, also used by the flat evaluator
+
 	//	Call Spread (-eps/2,+eps/2)
 	static T cSpr( const T x, const double eps)
 	{
@@ -86,8 +90,6 @@ class FuzzyEvaluator : public EvaluatorBase<T, FuzzyEvaluator>
 		else return 1.0 - x / rb;
 	}
 
-public:
-
     using Base = EvaluatorBase<T, ::FuzzyEvaluator>;
 
     using Base::visit;
@@ -277,7 +279,7 @@ public:
 	}
 	
 	//	Negation
-	void visitNot(const NodeNot& node)
+	void visit(const NodeNot& node)
 	{
         visitNode(*node.arguments[0]);
         myFuzzyStack.top() = 1.0 - myFuzzyStack.top();
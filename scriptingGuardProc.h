@@ -0,0 +1,158 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//	Guard processor
+//	Finds the termination guard of a product, a variable G and a constant c such that 
+//		every statement of the last events is an IF G = c THEN ... ENDIF without ELSE,
+//		like the ALIVE flag of autocallables and TARNs
+//	When G differs from c at the start of one of these events, no statement is executed
+//		in this event or any later one, G is never written again and the path is dead
+//	This holds for sharp evaluation only, fuzzy IFs may still blend their branches on dead paths
+//	The var indexer must have been run first
+
+#include "scriptingNodes.h"
+
+class GuardProcessor : public constVisitor<GuardProcessor>
+{
+	//	What the node just visited is, as far as guards are concerned
+	enum Kind
+	{
+		otherKind,
+		varKind,
+		constKind,
+		varMinusConstKind,
+		condKind,
+		guardKind
+	};
+
+	Kind			myKind;
+	size_t			myVar;
+	double			myConst;
+
+	//	The guard, once found
+	bool			myFound;
+	size_t			myGuardVar;
+	double			myGuardConst;
+
+public:
+
+	GuardProcessor() : myKind(otherKind), myVar(0), myConst(0.0), myFound(false), myGuardVar(0), myGuardConst(0.0) {}
+
+	//	Visit the statements of an event, called on the events last to first, 
+	//		as long as it returns true
+	//	Returns true if all the statements are guarded by the same guard as those of the later events
+	bool processEvent(const Event& evt)
+	{
+		for (const auto& stat : evt)
+		{
+			stat->accept(*this);
+			if (myKind != guardKind) return false;
+
+			if (!myFound)
+			{
+				myFound = true;
+				myGuardVar = myVar;
+				myGuardConst = myConst;
+			}
+			else if (myVar != myGuardVar || myConst != myGuardConst) return false;
+		}
+
+		return true;
+	}
+
+	//	Accessors
+
+	bool found() const
+	{
+		return myFound;
+	}
+
+	size_t guardVar() const
+	{
+		return myGuardVar;
+	}
+
+	double guardConst() const
+	{
+		return myGuardConst;
+	}
+
+	//	Visitors
+
+	//	Any other node is neither a guard nor part of one
+	template <class NODE>
+	void visit(const NODE&)
+	{
+		myKind = otherKind;
+	}
+
+	void visit(const NodeVar& node)
+	{
+		myKind = varKind;
+		myVar = node.index;
+		myConst = 0.0;
+	}
+
+	void visit(const NodeConst& node)
+	{
+		myKind = constKind;
+		myConst = node.constVal;
+	}
+
+	//	G - c or c - G
+	void visit(const NodeSub& node)
+	{
+		node.arguments[0]->accept(*this);
+		const Kind kind0 = myKind;
+		const size_t var0 = myVar;
+		const double const0 = myConst;
+
+		node.arguments[1]->accept(*this);
+
+		if (kind0 == varKind && myKind == constKind)
+		{
+			myKind = varMinusConstKind;
+			myVar = var0;
+		}
+		else if (kind0 == constKind && myKind == varKind)
+		{
+			myKind = varMinusConstKind;
+			myConst = const0;
+		}
+		else myKind = otherKind;
+	}
+
+	//	G = c, simplified into G = 0 when c is 0
+	void visit(const NodeEqual& node)
+	{
+		node.arguments[0]->accept(*this);
+		myKind = myKind == varKind || myKind == varMinusConstKind ? condKind : otherKind;
+	}
+
+	//	IF G = c THEN ... ENDIF, the statements are not visited
+	void visit(const NodeIf& node)
+	{
+		if (node.firstElse != -1)
+		{
+			myKind = otherKind;
+			return;
+		}
+
+		node.arguments[0]->accept(*this);
+		myKind = myKind == condKind ? guardKind : otherKind;
+	}
+};
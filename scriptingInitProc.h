@@ -0,0 +1,99 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//	Init processor
+//	Finds the variables that must be reset to 0 before the evaluation of each path:
+//		those possibly read before they are written, including by an accumulating payment, 
+//		and the outputs not written on every path
+//	All other variables are definitely assigned before they are used, 
+//		their value from the previous path is never seen
+//	A variable is definitely assigned after an if when it is assigned before, or on both branches,
+//		which is also correct for fuzzy ifs that blend the values of their branches
+//	The var indexer must have been run first
+
+#include "scriptingNodes.h"
+
+class InitProcessor : public constVisitor<InitProcessor>
+{
+	//	Definitely assigned status of variables, at the current point
+	vector<char>	myAssigned;
+
+	//	Possibly read before assigned
+	vector<char>	myRead;
+
+public:
+
+	using constVisitor<InitProcessor>::visit;
+
+	//	Constructor, nVar = number of variables
+	InitProcessor(const size_t nVar) : myAssigned(nVar, false), myRead(nVar, false) {}
+
+	//	Indices of the variables to reset, after all events are visited, 
+	//		outputs = indices of the output variables
+	vector<size_t> resetVars(const vector<size_t>& outputs) const
+	{
+		vector<char> reset = myRead;
+		for (auto idx : outputs) if (!myAssigned[idx]) reset[idx] = true;
+
+		vector<size_t> res;
+		for (size_t i = 0; i < reset.size(); ++i) if (reset[i]) res.push_back(i);
+		return res;
+	}
+
+	//	Visitors
+
+	//	Variable read
+	void visit(const NodeVar& node)
+	{
+		if (!myAssigned[node.index]) myRead[node.index] = true;
+	}
+
+	//	Assign: the RHS is read first, then the variable is assigned
+	void visit(const NodeAssign& node)
+	{
+		node.arguments[1]->accept(*this);
+		myAssigned[downcast<NodeVar>(node.arguments[0])->index] = true;
+	}
+
+	//	Pays: the variable is incremented, hence read, then assigned
+	void visit(const NodePays& node)
+	{
+		node.arguments[1]->accept(*this);
+		node.arguments[0]->accept(*this);
+		myAssigned[downcast<NodeVar>(node.arguments[0])->index] = true;
+	}
+
+	void visit(const NodeIf& node)
+	{
+		//	Condition
+		node.arguments[0]->accept(*this);
+
+		const vector<char> assignedBefore = myAssigned;
+
+		//	If true statements
+		const size_t lastTrue = node.firstElse == -1 ? node.arguments.size() : node.firstElse;
+		for (size_t i = 1; i < lastTrue; ++i) node.arguments[i]->accept(*this);
+		const vector<char> assignedTrue = move(myAssigned);
+
+		//	If false statements, if any
+		myAssigned = assignedBefore;
+		for (size_t i = lastTrue; i < node.arguments.size(); ++i) node.arguments[i]->accept(*this);
+
+		//	Assigned on both branches
+		for (size_t i = 0; i < myAssigned.size(); ++i) myAssigned[i] &= assignedTrue[i];
+	}
+};
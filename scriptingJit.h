@@ -0,0 +1,874 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Native x86-64 code generation for compiled node streams
+//  Every instruction of a node stream is translated, once, into SSE2 machine code in executable memory:
+//      constants are baked in as immediates,
+//      the value stack is allocated at compile time,
+//          the top slots in xmm registers, deeper slots in the machine stack frame,
+//      booleans live in bytes of the frame,
+//      control flow is translated into native jumps
+//  The generated code executes the same operations in the same order as evalCompiled,
+//      hence produces the same results, bit for bit
+//  No external compiler or library is involved
+//  Where native code is not available (other architectures, executable memory refused by the system),
+//      JitFunction::valid() is false and the caller falls back to the interpreter
+
+#include "scriptingCompiler.h"
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64
+#endif
+
+#ifdef JIT_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#endif
+
+//  Functions called from generated code for instructions that have no SSE2 equivalent
+//  Same code as evalCompiled, hence same results
+
+inline double jitPow(const double x, const double y)
+{
+    return pow(x, y);
+}
+
+inline double jitLog(const double x)
+{
+    return log(x);
+}
+
+//  Natively compiled event, owns its executable memory
+class JitFunction
+{
+    //  Generated code: void f(const SimulData<double>* scen, double* variables)
+    using Code = void(*)(const SimulData<double>*, double*);
+
+    void*       myMemory = nullptr;
+    size_t      mySize = 0;
+    Code        myCode = nullptr;
+
+    void release()
+    {
+#ifdef JIT_X64
+        if (myMemory)
+        {
+#ifdef _WIN32
+            VirtualFree(myMemory, 0, MEM_RELEASE);
+#else
+            munmap(myMemory, mySize);
+#endif
+        }
+#endif
+        myMemory = nullptr;
+        mySize = 0;
+        myCode = nullptr;
+    }
+
+public:
+
+    JitFunction() {}
+
+    //  Copy machine code into executable memory
+    //  The function remains invalid if the system refuses executable memory
+    JitFunction(const vector<unsigned char>& code)
+    {
+#ifdef JIT_X64
+        if (code.empty()) return;
+
+#ifdef _WIN32
+        void* mem = VirtualAlloc(nullptr, code.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (!mem) return;
+        memcpy(mem, code.data(), code.size());
+        DWORD old;
+        if (!VirtualProtect(mem, code.size(), PAGE_EXECUTE_READ, &old))
+        {
+            VirtualFree(mem, 0, MEM_RELEASE);
+            return;
+        }
+        FlushInstructionCache(GetCurrentProcess(), mem, code.size());
+        myMemory = mem;
+        mySize = code.size();
+#else
+        const size_t page = size_t(sysconf(_SC_PAGESIZE));
+        const size_t size = (code.size() + page - 1) / page * page;
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return;
+        memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC))
+        {
+            munmap(mem, size);
+            return;
+        }
+        myMemory = mem;
+        mySize = size;
+#endif
+        myCode = reinterpret_cast<Code>(myMemory);
+#endif
+    }
+
+    //  Move only
+    JitFunction(const JitFunction&) = delete;
+    JitFunction& operator=(const JitFunction&) = delete;
+
+    JitFunction(JitFunction&& rhs) : myMemory(rhs.myMemory), mySize(rhs.mySize), myCode(rhs.myCode)
+    {
+        rhs.myMemory = nullptr;
+        rhs.mySize = 0;
+        rhs.myCode = nullptr;
+    }
+    JitFunction& operator=(JitFunction&& rhs)
+    {
+        if (this != &rhs)
+        {
+            release();
+            myMemory = rhs.myMemory;
+            mySize = rhs.mySize;
+            myCode = rhs.myCode;
+            rhs.myMemory = nullptr;
+            rhs.mySize = 0;
+            rhs.myCode = nullptr;
+        }
+        return *this;
+    }
+
+    ~JitFunction()
+    {
+        release();
+    }
+
+    //  Is native code available
+    bool valid() const
+    {
+        return myCode != nullptr;
+    }
+
+    //  Execute, same inputs as evalCompiled
+    void operator()(const SimulData<double>& scen, EvalState<double>& state) const
+    {
+        myCode(&scen, state.variables.data());
+    }
+};
+
+//  x86-64 code generator for one node stream
+
+class JitCompiler
+{
+    //  General registers
+    enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+
+    //  Scenario in rbx, variables in rbp, both preserved across calls in all calling conventions
+    static const int        scenReg = RBX;
+    static const int        varReg = RBP;
+
+    //  Value stack slots in registers: xmm2 and up, xmm0 and xmm1 are scratch
+    //  Only xmm0-5 are volatile under Windows, all of them are under System V
+#ifdef _WIN32
+    static const int        numRegSlots = 4;
+#else
+    static const int        numRegSlots = 14;
+#endif
+
+    //  Frame: shadow space for calls, then homes of value slots, then booleans
+    static const int        shadowSpace = 32;
+
+    const vector<int>&      myNodeStream;
+    const vector<double>&   myConstStream;
+
+    vector<unsigned char>   myCode;
+
+    //  Frame layout
+    int                     myBoolBase;
+    int                     myFrameSize;
+
+    //  Labels, code offsets per position in the node stream
+    vector<int>             myLabels;
+
+    //  Depth of the value stack at every instruction, see stackDepths()
+    vector<int>             myDepthAt;
+
+    //  Jumps to patch: code offset of the displacement, position
+    struct Fixup
+    {
+        size_t  offset;
+        size_t  pos;
+    };
+    vector<Fixup>           myFixups;
+
+    //  Encoding
+
+    void byte(const int b)
+    {
+        myCode.push_back(static_cast<unsigned char>(b));
+    }
+
+    void imm32(const int32_t v)
+    {
+        for (int k = 0; k < 4; ++k) byte((v >> (8 * k)) & 0xFF);
+    }
+
+    void imm64(const uint64_t v)
+    {
+        for (int k = 0; k < 8; ++k) byte(int((v >> (8 * k)) & 0xFF));
+    }
+
+    //  REX prefix if needed
+    void rex(const int reg, const int rm, const bool w = false)
+    {
+        const int r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+        if (r != 0x40) byte(r);
+    }
+
+    //  ModRM, register operand
+    void modReg(const int reg, const int rm)
+    {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    //  ModRM, memory operand [base + disp32]
+    void modMem(const int reg, const int base, const int32_t disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if (base == RSP) byte(0x24);
+        imm32(disp);
+    }
+
+    //  SSE instruction xmm, xmm
+    void sse(const int prefix, const int op, const int reg, const int rm)
+    {
+        byte(prefix);
+        rex(reg, rm);
+        byte(0x0F);
+        byte(op);
+        modReg(reg, rm);
+    }
+
+    //  SSE instruction xmm, [base + disp] or [base + disp], xmm
+    void sseMem(const int prefix, const int op, const int reg, const int base, const int32_t disp)
+    {
+        byte(prefix);
+        rex(reg, base);
+        byte(0x0F);
+        byte(op);
+        modMem(reg, base, disp);
+    }
+
+    //  Scalar double instructions
+    enum { MOVSD = 0x10, MOVSD_STORE = 0x11, SQRTSD = 0x51, ADDSD = 0x58, MULSD = 0x59,
+        SUBSD = 0x5C, MINSD = 0x5D, DIVSD = 0x5E, MAXSD = 0x5F };
+
+    void sd(const int op, const int dst, const int src)
+    {
+        sse(0xF2, op, dst, src);
+    }
+
+    void sdMem(const int op, const int reg, const int base, const int32_t disp)
+    {
+        sseMem(0xF2, op, reg, base, disp);
+    }
+
+    void ucomisd(const int a, const int b)
+    {
+        sse(0x66, 0x2E, a, b);
+    }
+
+    void xorpd(const int dst, const int src)
+    {
+        sse(0x66, 0x57, dst, src);
+    }
+
+    //  rax = imm64
+    void movRaxImm(const uint64_t v)
+    {
+        byte(0x48);
+        byte(0xB8);
+        imm64(v);
+    }
+
+    //  xmm = rax
+    void movqFromRax(const int xmm)
+    {
+        byte(0x66);
+        rex(xmm, RAX, true);
+        byte(0x0F);
+        byte(0x6E);
+        modReg(xmm, RAX);
+    }
+
+    //  xmm = immediate
+    void loadConst(const int xmm, const double val)
+    {
+        uint64_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+        if (bits == 0)
+        {
+            xorpd(xmm, xmm);
+        }
+        else
+        {
+            movRaxImm(bits);
+            movqFromRax(xmm);
+        }
+    }
+
+    //  Constant of the instruction operand
+    double constant(const size_t i) const
+    {
+        return myConstStream[myNodeStream[i]];
+    }
+
+    //  Displacement of a variable
+    int32_t var(const size_t i) const
+    {
+        return int32_t(8 * myNodeStream[i]);
+    }
+
+    //  Value stack slots
+
+    bool inReg(const int slot) const
+    {
+        return slot < numRegSlots;
+    }
+
+    int slotReg(const int slot) const
+    {
+        return slot + 2;
+    }
+
+    int32_t slotHome(const int slot) const
+    {
+        return shadowSpace + 8 * slot;
+    }
+
+    //  Register holding the slot, loaded into scratch if the slot lives in memory
+    int load(const int slot, const int scratch)
+    {
+        if (inReg(slot)) return slotReg(slot);
+        sdMem(MOVSD, scratch, RSP, slotHome(slot));
+        return scratch;
+    }
+
+    //  Write a register into a slot
+    void store(const int slot, const int xmm)
+    {
+        if (!inReg(slot)) sdMem(MOVSD_STORE, xmm, RSP, slotHome(slot));
+        else if (xmm != slotReg(slot)) sd(MOVSD, slotReg(slot), xmm);
+    }
+
+    //  xmm = xmm op slot, from the register or the home of the slot
+    void sdSlot(const int op, const int xmm, const int slot)
+    {
+        if (inReg(slot)) sd(op, xmm, slotReg(slot));
+        else sdMem(op, xmm, RSP, slotHome(slot));
+    }
+
+    //  Boolean slots
+
+    int32_t boolHome(const int slot) const
+    {
+        return myBoolBase + slot;
+    }
+
+    //  setcc byte [rsp + disp]
+    void setcc(const int cc, const int32_t disp)
+    {
+        byte(0x0F);
+        byte(0x90 | cc);
+        modMem(0, RSP, disp);
+    }
+
+    //  Condition codes
+    enum { CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_AE = 0x3, CC_NP = 0xB };
+
+    //  Jumps
+
+    void jumpTo(const size_t pos, const int cc = -1)
+    {
+        if (cc < 0)
+        {
+            byte(0xE9);
+        }
+        else
+        {
+            byte(0x0F);
+            byte(0x80 | cc);
+        }
+        myFixups.push_back(Fixup{ myCode.size(), pos });
+        imm32(0);
+    }
+
+    //  Calls to C functions
+    //  Live register slots below first are saved in their homes across the call,
+    //      arguments are the slots first, first + 1, ..., result goes in slot first
+    void call(const void* fn, const int first, const int nArgs)
+    {
+        for (int s = 0; s < first && inReg(s); ++s) sdMem(MOVSD_STORE, slotReg(s), RSP, slotHome(s));
+
+        for (int a = 0; a < nArgs; ++a)
+        {
+            const int slot = first + a;
+            if (inReg(slot)) sd(MOVSD, a, slotReg(slot));
+            else sdMem(MOVSD, a, RSP, slotHome(slot));
+        }
+
+        movRaxImm(reinterpret_cast<uint64_t>(fn));
+        //  call rax
+        byte(0xFF);
+        byte(0xD0);
+
+        for (int s = 0; s < first && inReg(s); ++s) sdMem(MOVSD, slotReg(s), RSP, slotHome(s));
+
+        store(first, 0);
+    }
+
+public:
+
+    JitCompiler(const vector<int>& nodeStream, const vector<double>& constStream) :
+        myNodeStream(nodeStream), myConstStream(constStream)
+    {}
+
+    //  Generate machine code
+    vector<unsigned char> generate()
+    {
+        const vector<int>& s = myNodeStream;
+        const size_t n = s.size();
+
+        //  Frame
+        const StackDepths depths = stackDepths(myNodeStream, &myDepthAt);
+        const int maxDepth = int(depths.values), maxBools = int(depths.bools);
+        //  One more value slot for the arguments of PowConst and ConstPow
+        myBoolBase = shadowSpace + 8 * (maxDepth + 1);
+        myFrameSize = myBoolBase + maxBools;
+        //  Two pushes and the return address: frame size must be 8 mod 16 for calls to be aligned
+        myFrameSize = (myFrameSize + 15) / 16 * 16 + 8;
+
+        myLabels.assign(n + 1, -1);
+        myFixups.clear();
+        myCode.clear();
+
+        //  Prologue
+        byte(0x53);     //  push rbx
+        byte(0x55);     //  push rbp
+#ifdef _WIN32
+        byte(0x48); byte(0x89); modReg(RCX, scenReg);   //  mov rbx, rcx
+        byte(0x48); byte(0x89); modReg(RDX, varReg);    //  mov rbp, rdx
+#else
+        byte(0x48); byte(0x89); modReg(RDI, scenReg);   //  mov rbx, rdi
+        byte(0x48); byte(0x89); modReg(RSI, varReg);    //  mov rbp, rsi
+#endif
+        byte(0x48); byte(0x81); modReg(5, RSP); imm32(myFrameSize);     //  sub rsp, frame
+
+        int d = 0, b = 0;
+        int r, x;
+        size_t i = 0;
+
+        while (i < n)
+        {
+            myLabels[i] = int(myCode.size());
+            d = myDepthAt[i];
+
+            switch (s[i])
+            {
+
+            //  Binaries
+
+            case Add:
+            case Sub:
+            case Mult:
+            case Div:
+            {
+                const int op = s[i] == Add ? ADDSD : s[i] == Sub ? SUBSD : s[i] == Mult ? MULSD : DIVSD;
+                r = load(d - 2, 0);
+                x = load(d - 1, 1);
+                sd(op, r, x);
+                store(d - 2, r);
+                --d;
+                break;
+            }
+
+            case AddConst:
+            case SubConst:
+            case MultConst:
+            case DivConst:
+            {
+                const int op = s[i] == AddConst ? ADDSD : s[i] == SubConst ? SUBSD : s[i] == MultConst ? MULSD : DIVSD;
+                r = load(d - 1, 0);
+                loadConst(1, constant(i + 1));
+                sd(op, r, 1);
+                store(d - 1, r);
+                break;
+            }
+
+            case ConstSub:
+            case ConstDiv:
+            {
+                loadConst(1, constant(i + 1));
+                r = load(d - 1, 0);
+                sd(s[i] == ConstSub ? SUBSD : DIVSD, 1, r);
+                store(d - 1, 1);
+                break;
+            }
+
+            //  maxsd dst, src = dst > src ? dst : src, same as evalCompiled with dst = top
+
+            case Max2:
+            case Min2:
+                x = load(d - 1, 1);
+                r = load(d - 2, 0);
+                sd(s[i] == Max2 ? MAXSD : MINSD, x, r);
+                store(d - 2, x);
+                --d;
+                break;
+
+            case Max2Const:
+            case Min2Const:
+                loadConst(1, constant(i + 1));
+                r = load(d - 1, 0);
+                sd(s[i] == Max2Const ? MAXSD : MINSD, 1, r);
+                store(d - 1, 1);
+                break;
+
+            //  Calls
+
+            case Pow:
+                call(reinterpret_cast<const void*>(&jitPow), d - 2, 2);
+                --d;
+                break;
+
+            case PowConst:
+                loadConst(1, constant(i + 1));
+                store(d, 1);
+                call(reinterpret_cast<const void*>(&jitPow), d - 1, 2);
+                break;
+
+            case ConstPow:
+                r = load(d - 1, 0);
+                store(d, r);
+                loadConst(1, constant(i + 1));
+                store(d - 1, 1);
+                call(reinterpret_cast<const void*>(&jitPow), d - 1, 2);
+                break;
+
+            case Log:
+                call(reinterpret_cast<const void*>(&jitLog), d - 1, 1);
+                break;
+
+            //  Smooth, same comparisons and operations as evalCompiled
+            //  ucomisd a, b; ja: a > b and ordered
+
+            case SmoothTest:
+            {
+                //  eps / 2
+                r = load(d - 1, 0);
+                loadConst(1, 0.5);
+                sd(MULSD, r, 1);
+                store(d - 1, r);
+                //  Left: -eps / 2 > x
+                movRaxImm(0x8000000000000000ull);
+                movqFromRax(1);
+                r = load(d - 1, 0);
+                xorpd(1, r);
+                x = load(d - 2, 0);
+                ucomisd(1, x);
+                jumpTo(s[i + 1], CC_A);
+                //  Right: x > eps / 2
+                r = load(d - 1, 1);
+                ucomisd(x, r);
+                jumpTo(s[i + 2], CC_A);
+                break;
+            }
+
+            case SmoothTestConst:
+                loadConst(1, -constant(i + 1));
+                x = load(d - 1, 0);
+                ucomisd(1, x);
+                jumpTo(s[i + 2], CC_A);
+                loadConst(1, constant(i + 1));
+                ucomisd(x, 1);
+                jumpTo(s[i + 3], CC_A);
+                break;
+
+            //  vNeg + 0.5 * (vPos - vNeg) / (eps / 2) * (x + eps / 2)
+            case SmoothBlend:
+            case SmoothBlendConst:
+            {
+                const bool isConst = s[i] == SmoothBlendConst;
+                const int xs = isConst ? d - 3 : d - 4;
+                //  x + eps / 2 overwrites x
+                if (isConst) loadConst(1, constant(i + 1));
+                else sdSlot(MOVSD, 1, d - 3);
+                sdSlot(MOVSD, 0, xs);
+                sd(ADDSD, 0, 1);
+                store(xs, 0);
+                //  Blend
+                sdSlot(MOVSD, 0, d - 2);
+                sdSlot(SUBSD, 0, d - 1);
+                loadConst(1, 0.5);
+                sd(MULSD, 0, 1);
+                if (isConst)
+                {
+                    loadConst(1, constant(i + 1));
+                    sd(DIVSD, 0, 1);
+                }
+                else
+                {
+                    sdSlot(DIVSD, 0, d - 3);
+                }
+                sdSlot(MULSD, 0, xs);
+                sdSlot(ADDSD, 0, d - 1);
+                store(xs, 0);
+                d = xs + 1;
+                break;
+            }
+
+            case Jump:
+                jumpTo(s[i + 1]);
+                break;
+
+            //  Unaries
+
+            case Sqrt:
+                r = load(d - 1, 0);
+                sd(SQRTSD, r, r);
+                store(d - 1, r);
+                break;
+
+            case Uminus:
+                r = load(d - 1, 0);
+                movRaxImm(0x8000000000000000ull);
+                movqFromRax(1);
+                xorpd(r, 1);
+                store(d - 1, r);
+                break;
+
+            //  Leaves
+
+            case Spot:
+                r = inReg(d) ? slotReg(d) : 0;
+                sdMem(MOVSD, r, scenReg, 0);
+                store(d, r);
+                ++d;
+                break;
+
+            case Var:
+                r = inReg(d) ? slotReg(d) : 0;
+                sdMem(MOVSD, r, varReg, var(i + 1));
+                store(d, r);
+                ++d;
+                break;
+
+            case Const:
+                r = inReg(d) ? slotReg(d) : 0;
+                loadConst(r, constant(i + 1));
+                store(d, r);
+                ++d;
+                break;
+
+            //  Assign, pays
+
+            case Assign:
+                r = load(d - 1, 0);
+                sdMem(MOVSD_STORE, r, varReg, var(i + 1));
+                --d;
+                break;
+
+            case AssignConst:
+                loadConst(0, constant(i + 1));
+                sdMem(MOVSD_STORE, 0, varReg, var(i + 2));
+                break;
+
+            case Pays:
+                r = load(d - 1, 0);
+                sdMem(DIVSD, r, scenReg, 8);
+                sdMem(MOVSD, 1, varReg, var(i + 1));
+                sd(ADDSD, 1, r);
+                sdMem(MOVSD_STORE, 1, varReg, var(i + 1));
+                --d;
+                break;
+
+            case PaysConst:
+                loadConst(0, constant(i + 1));
+                sdMem(DIVSD, 0, scenReg, 8);
+                sdMem(MOVSD, 1, varReg, var(i + 2));
+                sd(ADDSD, 1, 0);
+                sdMem(MOVSD_STORE, 1, varReg, var(i + 2));
+                break;
+
+            //  Conditions
+
+            case Equal:
+            case Sup:
+            case SupEqual:
+                r = load(d - 1, 0);
+                xorpd(1, 1);
+                ucomisd(r, 1);
+                if (s[i] == Equal)
+                {
+                    //  Unordered sets ZF, so equal is ZF and not PF
+                    setcc(CC_E, boolHome(b));
+                    //  setnp al
+                    byte(0x0F); byte(0x90 | CC_NP); modReg(0, RAX);
+                    //  and [bool], al
+                    byte(0x20); modMem(RAX, RSP, boolHome(b));
+                }
+                else
+                {
+                    setcc(s[i] == Sup ? CC_A : CC_AE, boolHome(b));
+                }
+                --d;
+                ++b;
+                break;
+
+            case And:
+            case Or:
+                //  mov al, [top]
+                byte(0x8A); modMem(RAX, RSP, boolHome(b - 1));
+                //  and / or [below], al
+                byte(s[i] == And ? 0x20 : 0x08); modMem(RAX, RSP, boolHome(b - 2));
+                --b;
+                break;
+
+            case Not:
+                //  xor byte [top], 1
+                byte(0x80); modMem(6, RSP, boolHome(b - 1)); byte(1);
+                break;
+
+            case True:
+            case False:
+                //  mov byte [top], imm8
+                byte(0xC6); modMem(0, RSP, boolHome(b)); byte(s[i] == True);
+                ++b;
+                break;
+
+            //  Control flow
+
+            //  The if-true statements of IfElse end with a Jump over the if-false statements
+
+            case If:
+            case IfElse:
+                //  cmp byte [top], 0 ; je end / else
+                byte(0x80); modMem(7, RSP, boolHome(b - 1)); byte(0);
+                jumpTo(s[i + 1], CC_E);
+                --b;
+                break;
+
+            //  Short circuit, the condition stays on the stack
+
+            case AndJump:
+            case OrJump:
+                byte(0x80); modMem(7, RSP, boolHome(b - 1)); byte(0);
+                jumpTo(s[i + 1], s[i] == AndJump ? CC_E : CC_NE);
+                break;
+
+            //  Superinstructions
+
+            case SpotSubConst:
+                r = inReg(d) ? slotReg(d) : 0;
+                sdMem(MOVSD, r, scenReg, 0);
+                loadConst(1, constant(i + 1));
+                sd(SUBSD, r, 1);
+                store(d, r);
+                ++d;
+                break;
+
+            case CallPayoffConst:
+                sdMem(MOVSD, 0, scenReg, 0);
+                loadConst(1, constant(i + 1));
+                sd(SUBSD, 0, 1);
+                loadConst(1, constant(i + 2));
+                sd(MAXSD, 1, 0);
+                store(d, 1);
+                ++d;
+                break;
+
+            case IncVarConst:
+                sdMem(MOVSD, 0, varReg, var(i + 1));
+                loadConst(1, constant(i + 2));
+                sd(ADDSD, 0, 1);
+                sdMem(MOVSD_STORE, 0, varReg, var(i + 1));
+                break;
+
+            case SpotAboveConstIf:
+            case VarAboveConstIf:
+            {
+                const bool isSpot = s[i] == SpotAboveConstIf;
+                if (isSpot) sdMem(MOVSD, 0, scenReg, 0);
+                else sdMem(MOVSD, 0, varReg, var(i + 1));
+                loadConst(1, constant(i + (isSpot ? 1 : 2)));
+                sd(SUBSD, 0, 1);
+                xorpd(1, 1);
+                ucomisd(0, 1);
+                //  Not above, or unordered
+                jumpTo(s[i + (isSpot ? 2 : 3)], CC_BE);
+                break;
+            }
+
+            default:
+                throw runtime_error("Opcode not supported by the JIT");
+            }
+
+            i += 1 + numOperands(s[i]);
+        }
+
+        myLabels[n] = int(myCode.size());
+
+        //  Epilogue
+        byte(0x48); byte(0x81); modReg(0, RSP); imm32(myFrameSize);     //  add rsp, frame
+        byte(0x5D);     //  pop rbp
+        byte(0x5B);     //  pop rbx
+        byte(0xC3);     //  ret
+
+        //  Patch jumps
+        for (const auto& fix : myFixups)
+        {
+            const int target = myLabels[fix.pos];
+            const int32_t rel = int32_t(target - int(fix.offset + 4));
+            memcpy(&myCode[fix.offset], &rel, 4);
+        }
+
+        return move(myCode);
+    }
+};
+
+//  Natively compile a node stream
+//  The result is not valid where native code is not available, or for streams compiled in fuzzy mode
+inline JitFunction jitCompile(const vector<int>& nodeStream, const vector<double>& constStream)
+{
+#ifdef JIT_X64
+    JitCompiler comp(nodeStream, constStream);
+    try
+    {
+        return JitFunction(comp.generate());
+    }
+    //  Instructions not supported, for instance fuzzy
+    catch (const runtime_error&)
+    {
+        return JitFunction();
+    }
+#else
+    return JitFunction();
+#endif
+}
@@ -0,0 +1,158 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//	Live processor
+//	Removes the statements that do not contribute to the output variables
+//	Walks the events backwards and keeps track of the variables live at every point, 
+//		those whose current value may be read by a later statement, or reported as an output
+//	An assignment or payment to a variable that is not live is removed, 
+//		and so is an if left with no statements
+//	Variables live after an if are live on entry to both branches, 
+//		and variables live on entry to either branch are live before the if,
+//		which is also correct for fuzzy ifs that blend their branches
+//	The var indexer must have been run first, variables must be indexed again after this processor
+
+#include "scriptingNodes.h"
+
+class LiveProcessor : public Visitor<LiveProcessor>
+{
+	//	Live status of variables
+	vector<char>	myLive;
+
+	//	Is the statement just visited dead?
+	bool			myDead;
+
+	//	Count of removed statements
+	size_t			myRemoved;
+
+	//	Visit statements first to last-1 of a block backwards, remove the dead ones
+	//	Returns the number of statements removed
+	size_t processBlock(vector<ExprTree>& block, const size_t first, const size_t last)
+	{
+		size_t removed = 0;
+		for (size_t i = last; i > first; --i)
+		{
+			myDead = false;
+			block[i - 1]->accept(*this);
+			if (myDead)
+			{
+				block.erase(block.begin() + (i - 1));
+				++removed;
+			}
+		}
+		myRemoved += removed;
+		return removed;
+	}
+
+public:
+
+	using Visitor<LiveProcessor>::visit;
+
+	//	Constructor, nVar = number of variables, outputs = indices of the output variables
+	LiveProcessor(const size_t nVar, const vector<size_t>& outputs) : 
+		myLive(nVar, false), 
+		myDead(false),
+		myRemoved(0)
+	{
+		for (auto idx : outputs) myLive[idx] = true;
+	}
+
+	//	This processor modifies the structure of the trees, hence it must be called only
+	//		with this method, on every event, last to first
+	void processEvent(Event& evt)
+	{
+		processBlock(evt, 0, evt.size());
+	}
+
+	//	Number of statements removed
+	size_t removed() const
+	{
+		return myRemoved;
+	}
+
+	//	Visitors
+
+	//	Assign: the variable is dead before, unless read in the RHS
+	void visit(NodeAssign& node)
+	{
+		const size_t varIdx = downcast<NodeVar>(node.arguments[0])->index;
+
+		if (!myLive[varIdx])
+		{
+			myDead = true;
+			return;
+		}
+
+		myLive[varIdx] = false;
+		node.arguments[1]->accept(*this);
+	}
+
+	//	Pays: the variable is incremented, hence it remains live
+	void visit(NodePays& node)
+	{
+		const size_t varIdx = downcast<NodeVar>(node.arguments[0])->index;
+
+		if (!myLive[varIdx])
+		{
+			myDead = true;
+			return;
+		}
+
+		node.arguments[1]->accept(*this);
+	}
+
+	void visit(NodeIf& node)
+	{
+		const vector<char> liveAfter = myLive;
+
+		//	If false statements, if any
+		const size_t lastTrue = node.firstElse == -1 ? node.arguments.size() : node.firstElse;
+		processBlock(node.arguments, lastTrue, node.arguments.size());
+		vector<char> liveElse = move(myLive);
+
+		//	If true statements
+		myLive = liveAfter;
+		const size_t removedTrue = processBlock(node.arguments, 1, lastTrue);
+		for (size_t i = 0; i < myLive.size(); ++i) myLive[i] |= liveElse[i];
+
+		//	Index of the first if false statement, -1 if none left
+		if (node.firstElse != -1)
+		{
+			node.firstElse -= int(removedTrue);
+			if (node.firstElse == int(node.arguments.size())) node.firstElse = -1;
+		}
+
+		//	Nothing left: the if is dead
+		myDead = node.arguments.size() == 1;
+		if (myDead) return;
+
+		//	Variables read in the condition
+		node.arguments[0]->accept(*this);
+	}
+
+	void visit(NodeCollect& node)
+	{
+		processBlock(node.arguments, 0, node.arguments.size());
+		myDead = node.arguments.empty();
+	}
+
+	//	Variables, read only, LHS variables are not visited
+	void visit(NodeVar& node)
+	{
+		myLive[node.index] = true;
+	}
+};
@@ -20,14 +20,22 @@ As long as this comment is preserved at the top of the file
 #include "scriptingScenarios.h"
 
 #include "cpp11basicRanGen.h"
+#include "philoxRanGen.h"
+#include "sobolRanGen.h"
+#include "brownianBridge.h"
+#include "threadPool.h"
 
 #include <algorithm>
 #include <numeric>
+#include <thread>
+#include <exception>
 
 //  Base model for Monte-Carlo simulations
 template <class T>
 struct Model
 {
+    virtual ~Model() {}
+
 	//	Clone
 	virtual unique_ptr<Model> clone() const = 0;
 
@@ -43,6 +51,27 @@ struct Model
         vector<T>&              spots,          //  Populate spots for each event date
         vector<T>&              numeraires)     //  Populate numeraire for each event date
             const = 0;
+
+    //  Same for event dates first to last-1 only, called in order, from first = 0, 
+    //      so a path may be simulated as far as needed only
+    //  Models that do not support it simulate the whole path on the first call
+    virtual void applySDE(
+        const vector<double>&   G,
+        vector<T>&              spots,
+        vector<T>&              numeraires,
+        const size_t            first,
+        const size_t            /*last*/)
+            const
+    {
+        if (first == 0) applySDE(G, spots, numeraires);
+    }
+
+    //  Lengths of the time steps of the Gaussian numbers, dimension dim(), for the Brownian bridge
+    //  Models that do not provide them get a bridge on a uniform grid
+    virtual vector<double> timeSteps() const
+    {
+        return vector<double>(dim(), 1.0);
+    }
 };
 
 template <class T>
@@ -54,17 +83,17 @@ class SimpleBlackScholes : public Model<T>
     T                   myVol;
     T                   myDrift;
 
-	bool				myTime0;	//	If today is among simul dates
+	bool				myTime0 = false;	//	If today is among simul dates
 	vector<double>		myTimes;
 	vector<double>		myDt;
 	vector<double>		mySqrtDt;
 		
 private:
 
-    //	Calculate all deterministic discount factors
-    void calcDf( vector<T>& dfs) const
+    //	Calculate deterministic discount factors, for event dates first to last-1
+    void calcDf( vector<T>& dfs, const size_t first, const size_t last) const
     {
-        for (size_t i = 0; i<myTimes.size(); ++i)
+        for (size_t i = first; i<last; ++i)
             dfs[i] = exp(myRate * myTimes[i]);
     }
 
@@ -112,6 +141,12 @@ public:
 
     size_t dim() const override { return myTimes.size() - myTime0; }
 
+    //  One Gaussian number per step, the first one is skipped if today is a simulation date
+    vector<double> timeSteps() const override
+    {
+        return vector<double>(myDt.begin() + myTime0, myDt.end());
+    }
+
 	//	Simulate one path 
     //  Apply the model SDE
     void applySDE(
@@ -119,20 +154,37 @@ public:
         vector<T>&              spots,          //  Populate spots for each event date
         vector<T>&              numeraires)     //  Populate numeraire for each event date
         const override
+    {
+        applySDE( G, spots, numeraires, 0, myTimes.size());
+    }
+
+    //  Same for event dates first to last-1 only
+    void applySDE(
+        const vector<double>&   G,
+        vector<T>&              spots,
+        vector<T>&              numeraires,
+        const size_t            first,
+        const size_t            last)
+        const override
     {
         //  Compute discount factors
-        calcDf( numeraires);
+        calcDf( numeraires, first, last);
         //  Note the ineffiency: in this case, numeraires could be computed only once
 
-        //  Then apply the SDE
-        size_t step = 0;
+        //  Then apply the SDE, the Gaussian number of step i is G[i - myTime0]
+        size_t i = first;
+        size_t step = first > 0 ? first - myTime0 : 0;
 
 		//	First step
-		spots[0] = myTime0? mySpot: 
-			mySpot*exp(-myDrift*myDt[0]+myVol*mySqrtDt[0]*G[step++]);
+        if (i == 0 && i < last)
+        {
+		    spots[0] = myTime0? mySpot: 
+			    mySpot*exp(-myDrift*myDt[0]+myVol*mySqrtDt[0]*G[step++]);
+            ++i;
+        }
 
 		//	All steps
-		for(size_t i=1; i<myTimes.size(); ++i)
+		for(; i<last; ++i)
 		{
 			spots[i] = spots[i-1]
 			*exp(-myDrift*myDt[i]+myVol*mySqrtDt[i]*G[step++]);
@@ -148,17 +200,17 @@ class SimpleBachelier : public Model<T>
     T                   myRate;
     T                   myVol;
 
-    bool				myTime0;	//	If today is among simul dates
+    bool				myTime0 = false;	//	If today is among simul dates
     vector<double>		myTimes;
     vector<double>		myDt;
     vector<double>		mySqrtDt;
 
 private:
 
-    //	Calculate all deterministic discount factors
-    void calcDf(vector<T>& dfs) const
+    //	Calculate deterministic discount factors, for event dates first to last-1
+    void calcDf(vector<T>& dfs, const size_t first, const size_t last) const
     {
-        for (size_t i = 0; i<myTimes.size(); ++i)
+        for (size_t i = first; i<last; ++i)
             dfs[i] = exp(myRate * myTimes[i]);
     }
 
@@ -205,6 +257,12 @@ public:
 
     size_t dim() const override { return myTimes.size() - myTime0; }
 
+    //  One Gaussian number per step, the first one is skipped if today is a simulation date
+    vector<double> timeSteps() const override
+    {
+        return vector<double>(myDt.begin() + myTime0, myDt.end());
+    }
+
     //	Simulate one path 
     //  Apply the model SDE
     void applySDE(
@@ -212,23 +270,40 @@ public:
         vector<T>&              spots,          //  Populate spots for each event date
         vector<T>&              numeraires)     //  Populate numeraire for each event date
         const override
+    {
+        applySDE(G, spots, numeraires, 0, myTimes.size());
+    }
+
+    //  Same for event dates first to last-1 only
+    void applySDE(
+        const vector<double>&   G,
+        vector<T>&              spots,
+        vector<T>&              numeraires,
+        const size_t            first,
+        const size_t            last)
+        const override
     {
         //  Compute discount factors
-        calcDf(numeraires);
+        calcDf(numeraires, first, last);
         //  Note the ineffiency: in this case, numeraires could be computed only once
 
-        //  Then apply the SDE
-        size_t step = 0;
+        //  Then apply the SDE, the Gaussian number of step i is G[i - myTime0]
+        size_t i = first;
+        size_t step = first > 0 ? first - myTime0 : 0;
 
         //  If rate ~0 the dynamics is simpler and can be simulated more efficiently
         if (fabs(myRate) < 0.0001)
         {
             //	First step
-            spots[0] = myTime0 ? mySpot :
-                mySpot + myVol * mySqrtDt[0] * G[step++];
+            if (i == 0 && i < last)
+            {
+                spots[0] = myTime0 ? mySpot :
+                    mySpot + myVol * mySqrtDt[0] * G[step++];
+                ++i;
+            }
 
             //	All steps
-            for (size_t i = 1; i<myTimes.size(); ++i)
+            for (; i<last; ++i)
             {
                 spots[i] = spots[i - 1] + myVol * mySqrtDt[i] * G[step++];
             }
@@ -237,11 +312,15 @@ public:
         else
         {
             //	First step
-            spots[0] = myTime0 ? mySpot :
-                mySpot * exp(myRate * myDt[0]) + myVol * sqrt ((exp (2 * myRate * myDt[0]) - 1) / (2 * myRate)) * G[step++];
+            if (i == 0 && i < last)
+            {
+                spots[0] = myTime0 ? mySpot :
+                    mySpot * exp(myRate * myDt[0]) + myVol * sqrt ((exp (2 * myRate * myDt[0]) - 1) / (2 * myRate)) * G[step++];
+                ++i;
+            }
 
             //	All steps
-            for (size_t i = 1; i<myTimes.size(); ++i)
+            for (; i<last; ++i)
             {
                 spots[i] = spots[i - 1] * exp(myRate * myDt[i]) + myVol * sqrt((exp(2 * myRate * myDt[i]) - 1) / (2 * myRate)) * G[step++];
             }
@@ -249,26 +328,93 @@ public:
     }
 };
 
+//  Paths simulated at once by the drivers that generate Gaussian numbers in bulk
+constexpr size_t SIMULATION_BLOCK_SIZE = 256;
+
 template <class T>
 class MonteCarloSimulator
 {
     RandomGen&          myRandomGen;
     Model<T>&           myModel;
+
+    //  Brownian bridge: the Gaussian numbers of the generator are turned into increments
+    //      in the order of the bridge before they are applied to the model, 
+    //      so the first coordinates of a quasi-random generator drive the large scale moves of the path
+    const bool          myUseBridge;
+    BrownianBridge      myBridge;
+    vector<double>      myBridgedG;
+
+    //  Gaussian numbers of a block of paths, for simulatePaths()
+    vector<double>      myBlockG;
+    vector<double>      myPathG;
+
+    //  Draw the Gaussian numbers of the next path
+    void nextGaussians()
+    {
+        myRandomGen.genNextNormVec();
+        if (myUseBridge) myBridge.transform(myRandomGen.getNorm(), myBridgedG);
+    }
+
+    //  Gaussian numbers of the current path
+    const vector<double>& gaussians() const
+    {
+        return myUseBridge ? myBridgedG : myRandomGen.getNorm();
+    }
     
 public:
 
-    MonteCarloSimulator( Model<T>& model, RandomGen& ranGen) : myRandomGen( ranGen), myModel( model) {}
+    MonteCarloSimulator( Model<T>& model, RandomGen& ranGen, const bool bridge = false) 
+        : myRandomGen( ranGen), myModel( model), myUseBridge( bridge) {}
 
     void init( const vector<Date>& simDates)
     {
         myModel.initSimDates( simDates);
         myRandomGen.init( myModel.dim());
+
+        if (myUseBridge)
+        {
+            myBridge.init( myModel.timeSteps());
+            myBridgedG.resize( myModel.dim());
+        }
     }
 
     void simulateOnePath( vector<T>& spots, vector<T>& numeraires)
     {
-        myRandomGen.genNextNormVec();
-        myModel.applySDE(myRandomGen.getNorm(), spots, numeraires);
+        nextGaussians();
+        myModel.applySDE(gaussians(), spots, numeraires);
+    }
+
+    //  Same in parts: startPath() draws all the Gaussian numbers of the next path, 
+    //      so the following paths do not depend on how far this one is simulated,
+    //      then simulateSteps() simulates event dates first to last-1, called in order
+    void startPath()
+    {
+        nextGaussians();
+    }
+
+    void simulateSteps( vector<T>& spots, vector<T>& numeraires, const size_t first, const size_t last)
+    {
+        myModel.applySDE(gaussians(), spots, numeraires, first, last);
+    }
+
+    //  Simulate the next numPaths paths into spots[0..numPaths-1] and numeraires[0..numPaths-1], sized by the caller
+    //  The Gaussian numbers of all the paths are drawn in one call to the generator, in bulk,
+    //      paths are the same as with numPaths calls to simulateOnePath()
+    void simulatePaths( const size_t numPaths, vector<vector<T>>& spots, vector<vector<T>>& numeraires)
+    {
+        const size_t dim = myModel.dim();
+        myBlockG.resize( numPaths * dim);
+        myPathG.resize( dim);
+
+        myRandomGen.genNextNormVecs( numPaths, myBlockG.data());
+
+        for (size_t p = 0; p < numPaths; ++p)
+        {
+            const double* G = myBlockG.data() + p * dim;
+            myPathG.assign( G, G + dim);
+            if (myUseBridge) myBridge.transform( myPathG, myBridgedG);
+            myModel.applySDE( myUseBridge ? myBridgedG : myPathG, spots[p], numeraires[p]);
+        }
     }
 };
 
@@ -290,7 +436,7 @@ class ScriptSimulator : public MonteCarloSimulator<T>, public ScriptModelApi<T>
 
 public:
 
-    ScriptSimulator( Model<T>& model, RandomGen& ranGen) : MonteCarloSimulator<T>( model, ranGen) {}
+    ScriptSimulator( Model<T>& model, RandomGen& ranGen, const bool bridge = false) : MonteCarloSimulator<T>( model, ranGen, bridge) {}
 
 	void initForScripting( const vector<Date>& eventDates) override
 	{
@@ -310,8 +456,43 @@ public:
 			s[i].numeraire = myTempNumeraires[i];
 		}
 	}
+
+    //  Lazy simulation: startScenario() starts the next scenario, 
+    //      simulateEvents() fills its events first to last-1, called in order, 
+    //      typically from the simulate argument of Product::evaluate() or evaluateCompiled(),
+    //      so the events of dead paths are not simulated
+    void startScenario()
+    {
+        MonteCarloSimulator<T>::startPath();
+    }
+
+    void simulateEvents( Scenario<T>& s, const size_t first, const size_t last)
+    {
+        MonteCarloSimulator<T>::simulateSteps( myTempSpots, myTempNumeraires, first, last);
+
+        for(size_t i=first; i<last; ++i)
+		{
+			s[i].spot = myTempSpots[i];
+			s[i].numeraire = myTempNumeraires[i];
+		}
+    }
 };
 
+//  Evaluation modes
+enum CompileMode
+{
+    noCompile = 0,      //  Tree walking evaluators
+    stackVM = 1,        //  Compiled, evaluateCompiled
+    threadedVM = 2,     //  Compiled, direct threaded evaluateThreaded
+    batchVM = 3,        //  Compiled, BATCH_WIDTH paths at a time with evaluateBatch
+    registerVM = 4,     //  Compiled to registers, evaluateRegisters
+    nativeJit = 5       //  Compiled to native code, evaluateJit
+};
+
+//  Value a script in a simple model, with the number type T of the paths and evaluations, double or float
+//  Simulation and evaluation are conducted in T, results are accumulated across paths in double
+//  Threaded and native modes are available for double only, other types run the stack VM in these modes
+template <class T = double>
 inline void simpleBsScriptVal(
 	const Date&				today,
 	const double			spot,
@@ -325,11 +506,15 @@ inline void simpleBsScriptVal(
 	const bool				fuzzy,		//	Use sharp (false) or fuzzy (true) eval
 	const double			defEps,		//	Default epsilon, may be redefined by node
 	const bool				skipDoms,	//	Skip domains (unless fuzzy)
-    //  Compile?
-    const bool              compile,
+    //  Compile? See CompileMode
+    const CompileMode       compile,
+    //  Output variables, all variables if empty
+    const vector<string>&   outputs,
 	//	Results
 	vector<string>&			varNames,
-	vector<double>&			varVals)
+	vector<double>&			varVals,
+    //  Run the optimization passes, see Product::optimizationPasses()
+    const bool              optimize = false)
 {
 	if( events.begin()->first < today)
 		throw runtime_error("Events in the past are disallowed");
@@ -339,28 +524,37 @@ inline void simpleBsScriptVal(
 	prd.parseEvents( events.begin(), events.end());
 	size_t maxNestedIfs = prd.preProcess( fuzzy, skipDoms);
 
+    //  Optimize on request: remove the statements and variables that do not contribute to the outputs,
+    //      simplify and share common subexpressions
+    if (!outputs.empty()) prd.declareOutputs(outputs);
+    if (optimize) prd.optimizationPasses().run(prd);
+
+    //  Results are reported for the outputs only
+    const vector<size_t> outIdx = prd.outputIndices();
+
 	//	Build scenarios
-	unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
+	unique_ptr<Scenario<T>> scen = prd.buildScenario<T>();
 
     //  Initialize model and random generator
     BasicRanGen random(seed);
-    unique_ptr<Model<double>> model;
-    if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
-    else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
+    unique_ptr<Model<T>> model;
+    if (normal) model.reset(new SimpleBachelier<T>(today, spot, vol, rate));
+    else model.reset(new SimpleBlackScholes<T>(today, spot, vol, rate));
 
     //	Initialize simulator
-    ScriptSimulator<double> simulator(*model, random);
+    ScriptSimulator<T> simulator(*model, random);
     simulator.initForScripting(prd.eventDates());
 
-    //	Initialize results
-    varNames = prd.varNames();
-    varVals.resize(varNames.size(), 0.0);
+    //	Initialize results, accumulated in double
+    varNames.clear();
+    for (auto idx : outIdx) varNames.push_back(prd.varNames()[idx]);
+    varVals.resize(outIdx.size(), 0.0);
 
-    //  Compiled - not implemented (yet) for fuzzy
-    if (compile)
+    //  Compiled, fuzzy, with the stack VM in all compiled modes
+    if (compile && fuzzy)
     {
-        EvalState<double> state(prd.varNames().size());
-        prd.compile();
+        prd.compileFuzzy(defEps);
+        EvalState<T> state = prd.buildCompiledState<T>();
 
         //	Loop over simulations
         for (size_t i = 0; i<numSim; ++i)
@@ -374,15 +568,51 @@ inline void simpleBsScriptVal(
             const size_t n = varVals.size();
             for (size_t v = 0; v<n; ++v)
             {
-                varVals[v] += state.variables[v];
+                varVals[v] += state.variables[outIdx[v]];
             }
         }
     }
 
-    //  Fuzzy
-    else if (fuzzy)
+    //  Compiled, batch
+    else if (compile == batchVM)
     {
-        FuzzyEvaluator<double> eval = prd.buildFuzzyEvaluator<double>(maxNestedIfs, defEps);
+        constexpr size_t W = batchWidth<T>();
+        Scenario<Lanes<T, W>> batchScen(prd.eventDates().size());
+        EvalState<Lanes<T, W>> batchState(prd.varNames().size());
+        prd.compile();
+
+        //	Loop over blocks of simulations
+        for (size_t i = 0; i<numSim; i += W)
+        {
+            const size_t nLanes = min(W, numSim - i);
+
+            //	Generate next scenarios into the lanes of batchScen
+            //  The last block is padded with copies of its last scenario
+            for (size_t l = 0; l<W; ++l)
+            {
+                if (l < nLanes) simulator.nextScenario(*scen);
+                setLane(*scen, l, batchScen);
+            }
+
+            //	Evaluate product 
+            prd.evaluateBatch(batchScen, batchState);
+            //	Update results, in the order of the paths
+            const size_t n = varVals.size();
+            for (size_t l = 0; l<nLanes; ++l)
+            {
+                for (size_t v = 0; v<n; ++v)
+                {
+                    varVals[v] += batchState.variables[outIdx[v]][l];
+                }
+            }
+        }
+    }
+
+    //  Compiled, registers
+    else if (compile == registerVM)
+    {
+        prd.compileRegisters();
+        EvalState<T> state = prd.buildRegisterState<T>();
 
         //	Loop over simulations
         for (size_t i = 0; i<numSim; ++i)
@@ -391,20 +621,55 @@ inline void simpleBsScriptVal(
             simulator.nextScenario(*scen);
 
             //	Evaluate product 
-            prd.evaluate(*scen, eval);
+            prd.evaluateRegisters(*scen, state);
+            //	Update results, variables are the first registers
+            const size_t n = varVals.size();
+            for (size_t v = 0; v<n; ++v)
+            {
+                varVals[v] += state.variables[outIdx[v]];
+            }
+        }
+    }
+
+    //  Compiled, sharp
+    else if (compile)
+    {
+        prd.compile();
+        if (compile == nativeJit) prd.jit();
+        EvalState<T> state = prd.buildCompiledState<T>();
+
+        //	Loop over simulations
+        for (size_t i = 0; i<numSim; ++i)
+        {
+            //	Evaluate product 
+            if (compile == threadedVM || compile == nativeJit)
+            {
+                //	Generate next scenario into scen
+                simulator.nextScenario(*scen);
+
+                if (compile == threadedVM) prd.evaluateThreaded(*scen, state);
+                else prd.evaluateJit(*scen, state);
+            }
+            //  Simulated lazily, dead paths are not simulated further
+            else
+            {
+                simulator.startScenario();
+                prd.evaluateCompiled(*scen, state, 
+                    [&](const size_t first, const size_t last) { simulator.simulateEvents(*scen, first, last); });
+            }
             //	Update results
             const size_t n = varVals.size();
             for (size_t v = 0; v<n; ++v)
             {
-                varVals[v] += eval.varVals()[v];
+                varVals[v] += state.variables[outIdx[v]];
             }
         }
     }
 
-    //  Evaluator
-    else
+    //  Fuzzy
+    else if (fuzzy)
     {
-        Evaluator<double> eval = prd.buildEvaluator<double>();
+        FuzzyEvaluator<T> eval = prd.buildFuzzyEvaluator<T>(maxNestedIfs, defEps);
 
         //	Loop over simulations
         for (size_t i = 0; i<numSim; ++i)
@@ -418,7 +683,28 @@ inline void simpleBsScriptVal(
             const size_t n = varVals.size();
             for (size_t v = 0; v<n; ++v)
             {
-                varVals[v] += eval.varVals()[v];
+                varVals[v] += eval.varVals()[outIdx[v]];
+            }
+        }
+    }
+
+    //  Evaluator
+    else
+    {
+        Evaluator<T> eval = prd.buildEvaluator<T>();
+
+        //	Loop over simulations
+        for (size_t i = 0; i<numSim; ++i)
+        {
+            //	Evaluate product, the scenario simulated lazily, dead paths are not simulated further
+            simulator.startScenario();
+            prd.evaluate(*scen, eval, 
+                [&](const size_t first, const size_t last) { simulator.simulateEvents(*scen, first, last); });
+            //	Update results
+            const size_t n = varVals.size();
+            for (size_t v = 0; v<n; ++v)
+            {
+                varVals[v] += eval.varVals()[outIdx[v]];
             }
         }
     }
@@ -426,6 +712,436 @@ inline void simpleBsScriptVal(
     for (auto& v : varVals) v /= numSim;
 }
 
+//  Parallel valuation
+
+//  Paths are processed in batches of that many paths, whatever the number of threads
+constexpr size_t PARALLEL_BATCH_SIZE = 1024;
+//  Batches of the Sobol sequence are its streams
+static_assert(PARALLEL_BATCH_SIZE == SOBOL_STREAM_SIZE, "Parallel batches and Sobol streams must have the same size");
+//  Simulation and evaluation of paths on one thread, in the mode of the driver
+//  The product, pre-processed and compiled, is shared read-only, 
+//      the runner owns everything written during simulation and evaluation:
+//      clones of the model and the random generator, the scenario, the evaluator or the evaluation state
+template <class T>
+class ScriptPathRunner
+{
+    const Product&              myProduct;
+    const bool                  myFuzzy;
+    const CompileMode           myCompile;
+
+    unique_ptr<Model<T>>        myModel;
+    unique_ptr<RandomGen>       myRandom;
+    ScriptSimulator<T>          mySimulator;
+    unique_ptr<Scenario<T>>     myScen;
+
+    //  Only the one used in the mode is built
+    unique_ptr<Evaluator<T>>        myEval;
+    unique_ptr<FuzzyEvaluator<T>>   myFuzzyEval;
+    unique_ptr<EvalState<T>>        myState;
+
+public:
+
+    ScriptPathRunner(
+        const Product&          prd,
+        const Model<T>&         modelProto,
+        const RandomGen&        randomProto,
+        const bool              fuzzy,
+        const double            defEps,
+        const size_t            maxNestedIfs,
+        const CompileMode       compile,
+        const bool              bridge = false) :
+        myProduct(prd),
+        myFuzzy(fuzzy),
+        myCompile(compile),
+        myModel(modelProto.clone()),
+        myRandom(randomProto.clone()),
+        mySimulator(*myModel, *myRandom, bridge),
+        myScen(prd.buildScenario<T>())
+    {
+        mySimulator.initForScripting(prd.eventDates());
+
+        //  Same dispatch as nextPath(): fuzzy compiled products run the stack VM, whatever the compile mode
+        if (compile == registerVM && !fuzzy)
+        {
+            myState = make_unique<EvalState<T>>(prd.buildRegisterState<T>());
+        }
+        else if (compile)
+        {
+            myState = make_unique<EvalState<T>>(prd.buildCompiledState<T>());
+        }
+        else if (fuzzy)
+        {
+            myFuzzyEval = make_unique<FuzzyEvaluator<T>>(prd.buildFuzzyEvaluator<T>(maxNestedIfs, defEps));
+        }
+        else
+        {
+            myEval = make_unique<Evaluator<T>>(prd.buildEvaluator<T>());
+        }
+    }
+
+    //  Access the random generator, to skip ahead or set the stream
+    RandomGen& random()
+    {
+        return *myRandom;
+    }
+
+    //  Simulate and evaluate the next path, returns the variables
+    //  Compiled modes are those of simpleBsScriptVal, except the batch mode runs the stack VM, with identical results
+    const vector<T>& nextPath()
+    {
+        const auto lazy = [this](const size_t first, const size_t last) { mySimulator.simulateEvents(*myScen, first, last); };
+
+        //  Compiled, fuzzy
+        if (myCompile && myFuzzy)
+        {
+            mySimulator.nextScenario(*myScen);
+            myProduct.evaluateCompiled(*myScen, *myState);
+            return myState->variables;
+        }
+
+        //  Compiled, registers
+        else if (myCompile == registerVM)
+        {
+            mySimulator.nextScenario(*myScen);
+            myProduct.evaluateRegisters(*myScen, *myState);
+            return myState->variables;
+        }
+
+        //  Compiled, sharp
+        else if (myCompile == threadedVM || myCompile == nativeJit)
+        {
+            mySimulator.nextScenario(*myScen);
+            if (myCompile == threadedVM) myProduct.evaluateThreaded(*myScen, *myState);
+            else myProduct.evaluateJit(*myScen, *myState);
+            return myState->variables;
+        }
+        else if (myCompile)
+        {
+            mySimulator.startScenario();
+            myProduct.evaluateCompiled(*myScen, *myState, lazy);
+            return myState->variables;
+        }
+
+        //  Fuzzy
+        else if (myFuzzy)
+        {
+            mySimulator.nextScenario(*myScen);
+            myProduct.evaluate(*myScen, *myFuzzyEval);
+            return myFuzzyEval->varVals();
+        }
+
+        //  Evaluator
+        else
+        {
+            mySimulator.startScenario();
+            myProduct.evaluate(*myScen, *myEval, lazy);
+            return myEval->varVals();
+        }
+    }
+};
+
+//  Prepare a product for the parallel drivers: parse, pre-process, optimize on request and compile in the mode of the driver
+//  Returns the max number of nested ifs
+inline size_t prepareScriptProduct(
+    Product&                prd,
+	const map<Date,string>& events,
+	const bool				fuzzy,
+	const double			defEps,
+	const bool				skipDoms,
+    const CompileMode       compile,
+    const vector<string>&   outputs,
+    const bool              optimize)
+{
+	prd.parseEvents( events.begin(), events.end());
+	const size_t maxNestedIfs = prd.preProcess( fuzzy, skipDoms);
+
+    //  Optimize
+    if (!outputs.empty()) prd.declareOutputs(outputs);
+    if (optimize) prd.optimizationPasses().run(prd);
+
+    //  Compile
+    if (compile && fuzzy) prd.compileFuzzy(defEps);
+    else if (compile == registerVM) prd.compileRegisters();
+    else if (compile)
+    {
+        prd.compile();
+        if (compile == nativeJit) prd.jit();
+    }
+
+    return maxNestedIfs;
+}
+
+//  Same as simpleBsScriptVal, on a work stealing thread pool of numThreads threads, 0 for the number of hardware threads
+//  The product is pre-processed and compiled once and shared read-only across threads
+//  Paths are valued in tasks of PARALLEL_BATCH_SIZE paths, balanced across workers by stealing,
+//      since paths may have very different costs, for instance with early termination
+//  Batch b runs on stream b of the random generator, whatever the worker that executes it,
+//      outputs are summed over each batch, then over the batches in order,
+//      so results are identical for a given seed whatever the number of threads and the scheduling
+//  Each worker keeps a path runner, with clones of the model and the random generator, built on its first batch
+//  The random generator is the PhiloxRanGen with the seed unless randomProto is given, it must support streams:
+//      the PhiloxRanGen sets streams in constant time, 
+//      results differ from simpleBsScriptVal, which runs the BasicRanGen with the seed,
+//      with a BasicRanGen, streams are seeded with the seed and the stream number,
+//      with a SobolRanGen, stream b is the segment of the sequence of batch b, preferably with bridge = true,
+//          so the paths are those of a sequential run over the Sobol sequence
+template <class T = double>
+inline void parallelBsScriptVal(
+	const Date&				today,
+	const double			spot,
+	const double			vol,
+	const double			rate,
+    const bool              normal,     //  true = normal, false = lognormal
+	const map<Date,string>& events,
+	const unsigned			numSim,
+	const unsigned			seed,		//	0 = default
+	//	Fuzzy
+	const bool				fuzzy,		//	Use sharp (false) or fuzzy (true) eval
+	const double			defEps,		//	Default epsilon, may be redefined by node
+	const bool				skipDoms,	//	Skip domains (unless fuzzy)
+    //  Compile? See CompileMode
+    const CompileMode       compile,
+    //  Output variables, all variables if empty
+    const vector<string>&   outputs,
+    //  Number of threads, 0 = hardware threads
+    const size_t            numThreads,
+	//	Results
+	vector<string>&			varNames,
+	vector<double>&			varVals,
+    //  Prototype random generator, cloned by the workers, PhiloxRanGen with the seed if null, must support streams
+    const RandomGen*        randomProto = nullptr,
+    //  Brownian bridge construction of the paths
+    const bool              bridge = false,
+    //  Run the optimization passes, see Product::optimizationPasses()
+    const bool              optimize = false)
+{
+	if( events.begin()->first < today)
+		throw runtime_error("Events in the past are disallowed");
+
+	//	Initialize product, compiled once for all threads
+	Product prd;
+    const size_t maxNestedIfs = prepareScriptProduct(prd, events, fuzzy, defEps, skipDoms, compile, outputs, optimize);
+
+    //  Results are reported for the outputs only
+    const vector<size_t> outIdx = prd.outputIndices();
+    varNames.clear();
+    for (auto idx : outIdx) varNames.push_back(prd.varNames()[idx]);
+
+    //  Model and random generator, cloned by the path runners
+    const PhiloxRanGen philox(seed);
+    const RandomGen& random = randomProto ? *randomProto : philox;
+    unique_ptr<Model<T>> model;
+    if (normal) model.reset(new SimpleBachelier<T>(today, spot, vol, rate));
+    else model.reset(new SimpleBlackScholes<T>(today, spot, vol, rate));
+
+    //  Batches and threads
+    const size_t numBatches = (numSim + PARALLEL_BATCH_SIZE - 1) / PARALLEL_BATCH_SIZE;
+    size_t nThreads = numThreads ? numThreads : thread::hardware_concurrency();
+    nThreads = max(size_t(1), min(nThreads, numBatches));
+    ThreadPool pool(nThreads);
+
+    //  Sums per batch
+    vector<vector<double>> batchSums(numBatches, vector<double>(outIdx.size(), 0.0));
+
+    //  Path runners, per worker
+    vector<unique_ptr<ScriptPathRunner<T>>> runners(pool.numWorkers());
+
+    //  One task per batch
+    vector<ThreadPool::Task> tasks;
+    for (size_t b = 0; b < numBatches; ++b)
+    {
+        tasks.push_back([&, b](const size_t w)
+        {
+            auto& runner = runners[w];
+            if (!runner)
+            {
+                runner = make_unique<ScriptPathRunner<T>>(prd, *model, random, fuzzy, defEps, maxNestedIfs, compile, bridge);
+            }
+            runner->random().setStream(b);
+
+            vector<double>& sums = batchSums[b];
+            const size_t last = min(size_t(numSim), (b + 1) * PARALLEL_BATCH_SIZE);
+            for (size_t i = b * PARALLEL_BATCH_SIZE; i < last; ++i)
+            {
+                const vector<T>& vars = runner->nextPath();
+                for (size_t v = 0; v < outIdx.size(); ++v) sums[v] += vars[outIdx[v]];
+            }
+        });
+    }
+    pool.run(tasks);
+
+    //  Sum over batches, in order
+    varVals.assign(outIdx.size(), 0.0);
+    for (const auto& sums : batchSums)
+    {
+        for (size_t v = 0; v < sums.size(); ++v) varVals[v] += sums[v];
+    }
+    for (auto& v : varVals) v /= numSim;
+}
+
+//  Value a portfolio of scripts in a simple model on a work stealing thread pool
+//  Products are prepared as tasks, then valued in tasks of PARALLEL_BATCH_SIZE paths,
+//      balanced across workers by stealing, since paths and products may have very different costs
+//  Batch b of every product runs on stream b of the random generator, PhiloxRanGen with the seed unless randomProto is given,
+//      whatever the worker that executes it,
+//      so results for a given seed do not depend on the number of threads or the scheduling
+//      and all products are valued on the same Gaussian numbers
+//  Each worker keeps a cache of path runners, one per product, built on its first batch of that product
+//  Outputs are given per product, all variables when empty or missing
+template <class T = double>
+inline void portfolioBsScriptVal(
+    ThreadPool&                     pool,
+	const Date&				        today,
+	const double			        spot,
+	const double			        vol,
+	const double			        rate,
+    const bool                      normal,
+	const vector<map<Date,string>>& portfolio,
+	const unsigned			        numSim,
+	const unsigned			        seed,
+	const bool				        fuzzy,
+	const double			        defEps,
+	const bool				        skipDoms,
+    const CompileMode               compile,
+    const vector<vector<string>>&   outputs,
+	//	Results, per product
+	vector<vector<string>>&	        varNames,
+	vector<vector<double>>&	        varVals,
+    //  Prototype random generator, PhiloxRanGen with the seed if null, must support streams
+    const RandomGen*                randomProto = nullptr,
+    //  Brownian bridge construction of the paths
+    const bool                      bridge = false,
+    //  Run the optimization passes, see Product::optimizationPasses()
+    const bool                      optimize = false)
+{
+    const size_t numPrds = portfolio.size();
+    for (const auto& events : portfolio)
+    {
+	    if( events.begin()->first < today)
+		    throw runtime_error("Events in the past are disallowed");
+    }
+
+    //  Prepare the products, one task each
+    vector<Product> prds(numPrds);
+    vector<size_t> maxNestedIfs(numPrds);
+    vector<ThreadPool::Task> tasks;
+    for (size_t p = 0; p < numPrds; ++p)
+    {
+        tasks.push_back([&, p](const size_t)
+        {
+            maxNestedIfs[p] = prepareScriptProduct(prds[p], portfolio[p], fuzzy, defEps, skipDoms, compile, 
+                p < outputs.size() ? outputs[p] : vector<string>(), optimize);
+        });
+    }
+    pool.run(tasks);
+
+    //  Results are reported for the outputs only
+    vector<vector<size_t>> outIdx(numPrds);
+    varNames.assign(numPrds, vector<string>());
+    for (size_t p = 0; p < numPrds; ++p)
+    {
+        outIdx[p] = prds[p].outputIndices();
+        for (auto idx : outIdx[p]) varNames[p].push_back(prds[p].varNames()[idx]);
+    }
+
+    //  Model and random generator, cloned by the path runners
+    const PhiloxRanGen philox(seed);
+    const RandomGen& random = randomProto ? *randomProto : philox;
+    unique_ptr<Model<T>> model;
+    if (normal) model.reset(new SimpleBachelier<T>(today, spot, vol, rate));
+    else model.reset(new SimpleBlackScholes<T>(today, spot, vol, rate));
+
+    //  Sums per product and batch
+    const size_t numBatches = (numSim + PARALLEL_BATCH_SIZE - 1) / PARALLEL_BATCH_SIZE;
+    vector<vector<vector<double>>> batchSums(numPrds);
+    for (size_t p = 0; p < numPrds; ++p)
+    {
+        batchSums[p].assign(numBatches, vector<double>(outIdx[p].size(), 0.0));
+    }
+
+    //  Path runners, per worker and product
+    vector<vector<unique_ptr<ScriptPathRunner<T>>>> runners(pool.numWorkers());
+    for (auto& workerRunners : runners) workerRunners.resize(numPrds);
+
+    //  One task per product and batch
+    tasks.clear();
+    for (size_t p = 0; p < numPrds; ++p)
+    {
+        for (size_t b = 0; b < numBatches; ++b)
+        {
+            tasks.push_back([&, p, b](const size_t w)
+            {
+                auto& runner = runners[w][p];
+                if (!runner)
+                {
+                    runner = make_unique<ScriptPathRunner<T>>(prds[p], *model, random, fuzzy, defEps, maxNestedIfs[p], compile, bridge);
+                }
+                runner->random().setStream(b);
+
+                vector<double>& sums = batchSums[p][b];
+                const vector<size_t>& idx = outIdx[p];
+                const size_t last = min(size_t(numSim), (b + 1) * PARALLEL_BATCH_SIZE);
+                for (size_t i = b * PARALLEL_BATCH_SIZE; i < last; ++i)
+                {
+                    const vector<T>& vars = runner->nextPath();
+                    for (size_t v = 0; v < idx.size(); ++v) sums[v] += vars[idx[v]];
+                }
+            });
+        }
+    }
+    pool.run(tasks);
+
+    //  Sum over batches, in order
+    varVals.assign(numPrds, vector<double>());
+    for (size_t p = 0; p < numPrds; ++p)
+    {
+        varVals[p].assign(outIdx[p].size(), 0.0);
+        for (const auto& sums : batchSums[p])
+        {
+            for (size_t v = 0; v < sums.size(); ++v) varVals[p][v] += sums[v];
+        }
+        for (auto& v : varVals[p]) v /= numSim;
+    }
+}
+
+//  Precision check: value a script in double and in float on the same Gaussian numbers
+//  Returns the largest difference between the float and double values of the variables,
+//      in proportion of the larger of 1 and the magnitude of the double value
+//  Differences of the order of 1.0e-7 are expected from the rounding of paths and evaluations in float,
+//      at most 8.5e-8 on the corpus of checkPrecision() in scriptingChecks.h with 100,000 paths,
+//      discontinuous payoffs may add up to 1 / numSim per path where float rounding flips a condition,
+//      larger differences indicate scripts that are not fit for single precision
+inline double simpleBsPrecisionCheck(
+	const Date&				today,
+	const double			spot,
+	const double			vol,
+	const double			rate,
+    const bool              normal,
+	const map<Date,string>& events,
+	const unsigned			numSim,
+	const unsigned			seed,
+	const bool				fuzzy,
+	const double			defEps,
+	const bool				skipDoms,
+    const CompileMode       compile,
+    const vector<string>&   outputs,
+	//	Results
+	vector<string>&			varNames,
+	vector<double>&			doubleVals,
+	vector<double>&			floatVals)
+{
+    simpleBsScriptVal<double>(today, spot, vol, rate, normal, events, numSim, seed, fuzzy, defEps, skipDoms, compile, outputs, varNames, doubleVals);
+    simpleBsScriptVal<float>(today, spot, vol, rate, normal, events, numSim, seed, fuzzy, defEps, skipDoms, compile, outputs, varNames, floatVals);
+
+    double maxDiff = 0.0;
+    for (size_t v = 0; v < doubleVals.size(); ++v)
+    {
+        maxDiff = max(maxDiff, fabs(floatVals[v] - doubleVals[v]) / max(1.0, fabs(doubleVals[v])));
+    }
+
+    return maxDiff;
+}
+
 //  Hard coded barrier
 inline void simpleBsBarVal(
     const Date&				today,
@@ -526,29 +1242,38 @@ inline void simpleBsCallsVal(
     const vector<double>&   strikes,
     const unsigned			numSim,
     const unsigned			seed,		//	0 = default
-    vector<double>&         vals)
+    vector<double>&         vals,
+    //  Prototype random generator, BasicRanGen with the seed if null
+    const RandomGen*        randomProto = nullptr)
 {
     //  Initialize model and random generator
-    BasicRanGen random(seed);
+    unique_ptr<RandomGen> random(randomProto ? randomProto->clone() : make_unique<BasicRanGen>(seed));
     unique_ptr<Model<double>> model;
     if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
     else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
 
     //	Initialize simulator
-    MonteCarloSimulator<double> simulator(*model, random);
-    vector<double> spots(1), numeraires(1);
+    MonteCarloSimulator<double> simulator(*model, *random);
     simulator.init(vector<Date>{mat});
 
+    //  Paths are simulated in blocks, with Gaussian numbers generated in bulk
+    vector<vector<double>> spots(SIMULATION_BLOCK_SIZE, vector<double>(1)), numeraires(SIMULATION_BLOCK_SIZE, vector<double>(1));
+
     //	Loop over simulations
     const size_t nk = strikes.size();
     vals.resize(nk, 0);
-    for (size_t i = 0; i<numSim; ++i)
+    for (size_t first = 0; first < numSim; first += SIMULATION_BLOCK_SIZE)
     {
-        //	Generate next scenario into scen
-        simulator.simulateOnePath(spots, numeraires);
-        const double s = spots[0], num = numeraires[0];
-        //	Evaluate calls
-        for (size_t j = 0; j < nk; ++j) if (s > strikes[j]) vals[j] += (s - strikes[j]) / num;
+        //	Generate next block of scenarios
+        const size_t n = min(SIMULATION_BLOCK_SIZE, numSim - first);
+        simulator.simulatePaths(n, spots, numeraires);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            const double s = spots[i][0], num = numeraires[i][0];
+            //	Evaluate calls
+            for (size_t j = 0; j < nk; ++j) if (s > strikes[j]) vals[j] += (s - strikes[j]) / num;
+        }
     }
 
     for (auto& val: vals) val /= numSim;
@@ -58,8 +58,8 @@ struct actNode : Node
 //  Nodes that return a bool
 struct boolNode : Node 
 {
-    bool				alwaysTrue;
-    bool				alwaysFalse;
+    bool				alwaysTrue = false;
+    bool				alwaysFalse = false;
 };
 
 //  All the concrete nodes
@@ -93,12 +93,12 @@ struct NodeSmooth : Visitable<exprNode, NodeSmooth, VISITORS> {};
 struct compNode : boolNode
 {
     //	Fuzzying stuff
-    bool				discrete;	//	Continuous or discrete
-                                    //	Continuous eps
-    double				eps;
+    bool				discrete = false;	//	Continuous or discrete
+                                            //	Continuous eps
+    double				eps = 0.0;
     //	Discrete butterfly bounds
-    double				lb;
-    double				rb;
+    double				lb = 0.0;
+    double				rb = 0.0;
     //	End of fuzzying stuff
 };
 
@@ -172,9 +172,9 @@ struct NodeIf : Visitable<actNode, NodeIf, VISITORS>
     int					firstElse;
     //	For fuzzy eval: indices of variables affected in statements, including nested
     vector<size_t>	    affectedVars;
-    //	Always true/false as per domain processor
-    bool				alwaysTrue;
-    bool				alwaysFalse;
+    //	Always true/false as per domain processor, false when it did not run
+    bool				alwaysTrue = false;
+    bool				alwaysFalse = false;
 };
 
 //	Collection of statements
@@ -196,6 +196,14 @@ Concrete* downcast(unique_ptr<Node>& node)
     return static_cast<Concrete*>(node.get());
 }
 
+//  Number of nodes in a tree
+inline size_t countNodes(const Node& node)
+{
+    size_t n = 1;
+    for (const auto& arg : node.arguments) n += countNodes(*arg);
+    return n;
+}
+
 //  Factories
 
 //  Make concrete node
@@ -0,0 +1,145 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//	Pass manager
+//	Runs an ordered list of named passes on a target, typically a Product,
+//		and records the time spent in each one and the number of nodes it removed or added
+//	Passes are registered, removed and reordered by name
+//	Target must provide size_t nodeCount() const
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+//	Statistics of a pass
+struct PassStats
+{
+	string	name;
+	size_t	nodesBefore;
+	size_t	nodesAfter;
+	double	milliseconds;
+
+	//	Negative when the pass removed nodes
+	long long nodeDelta() const
+	{
+		return (long long)(nodesAfter) - (long long)(nodesBefore);
+	}
+};
+
+template <class Target>
+class PassManager
+{
+	struct Pass
+	{
+		string						name;
+		function<void(Target&)>		run;
+	};
+
+	vector<Pass>		myPasses;
+	vector<PassStats>	myStats;
+
+	typename vector<Pass>::iterator find(const string& name)
+	{
+		auto it = find_if(myPasses.begin(), myPasses.end(), [&name](const Pass& pass) { return pass.name == name; });
+		if (it == myPasses.end()) throw runtime_error("Pass " + name + " not registered");
+		return it;
+	}
+
+public:
+
+	//	Register a pass, last
+	PassManager& add(const string& name, const function<void(Target&)>& pass)
+	{
+		myPasses.push_back(Pass{ name, pass });
+		return *this;
+	}
+
+	//	Register a pass, before another one
+	PassManager& insertBefore(const string& next, const string& name, const function<void(Target&)>& pass)
+	{
+		myPasses.insert(find(next), Pass{ name, pass });
+		return *this;
+	}
+
+	PassManager& remove(const string& name)
+	{
+		myPasses.erase(find(name));
+		return *this;
+	}
+
+	//	Reorder: the passes named, in that order, the others are removed
+	PassManager& order(const vector<string>& names)
+	{
+		vector<Pass> passes;
+		for (const auto& name : names) passes.push_back(*find(name));
+		myPasses = move(passes);
+		return *this;
+	}
+
+	vector<string> names() const
+	{
+		vector<string> names;
+		for (const auto& pass : myPasses) names.push_back(pass.name);
+		return names;
+	}
+
+	//	Run all the passes in order on the target
+	const vector<PassStats>& run(Target& target)
+	{
+		myStats.clear();
+		for (const auto& pass : myPasses)
+		{
+			PassStats stats;
+			stats.name = pass.name;
+			stats.nodesBefore = target.nodeCount();
+
+			const auto start = chrono::steady_clock::now();
+			pass.run(target);
+			const auto end = chrono::steady_clock::now();
+
+			stats.milliseconds = chrono::duration<double, milli>(end - start).count();
+			stats.nodesAfter = target.nodeCount();
+			myStats.push_back(stats);
+		}
+		return myStats;
+	}
+
+	//	Statistics of the last run
+	const vector<PassStats>& stats() const
+	{
+		return myStats;
+	}
+
+	//	Report of the last run, one line per pass
+	void report(ostream& ost) const
+	{
+		for (const auto& stats : myStats)
+		{
+			ost << left << setw(20) << stats.name << right
+				<< setw(10) << stats.nodesBefore << " nodes"
+				<< setw(8) << showpos << stats.nodeDelta() << noshowpos
+				<< setw(12) << fixed << setprecision(3) << stats.milliseconds << " ms" << endl;
+		}
+	}
+};
@@ -28,8 +28,22 @@ As long as this comment is preserved at the top of the file
 //  Scenarios
 #include "scriptingScenarios.h"
 
+//  Evaluation of the flat form
+#include "scriptingFlatEval.h"
+
+//  Batch evaluation of compiled streams
+#include "scriptingBatchEval.h"
+
+//  Native code generation
+#include "scriptingJit.h"
+
+//  Pass manager
+#include "scriptingPasses.h"
+
 using namespace std;
 #include <vector>
+#include <algorithm>
+#include <functional>
 
 //	Date class from your date library
 //	class Date;
@@ -43,18 +57,56 @@ class Product
 	vector<Date>		        myEventDates;
 	vector<Event>		        myEvents;
     vector<string>		        myVariables;
+    //  Declared outputs, all variables are outputs when empty
+    vector<string>              myOutputs;
+    //  As found by the if processor
+    size_t                      myMaxNestedIfs = 0;
+    //  Variables reset before each path, as found by the init processor, 
+    //      all of them when not analyzed or invalidated by a processor that changes the trees
+    vector<size_t>              myResetVars;
+    bool                        myInitAnalyzed = false;
+    //  Termination guard, as found by the guard processor: 
+    //      from event myGuardFrom on, the path is dead once variable myGuardVar differs from myGuardConst
+    //      no guard when myGuardFrom is -1
+    size_t                      myGuardFrom = size_t(-1);
+    size_t                      myGuardVar = 0;
+    double                      myGuardConst = 0.0;
 
     //  Compiled form
     vector<vector<int>>         myNodeStreams;
     vector<vector<double>>      myConstStreams;
-    vector<vector<const void*>> myDataStreams;
+    //  Packed for execution, constants inlined
+    vector<PackedStream>        myPackedStreams;
+    //  Work space of fuzzy IFs, when compiled in fuzzy mode
+    size_t                      myStoreSize = 0;
+    bool                        myCompiledFuzzy = false;
+    //  Maximum stack depths over events
+    StackDepths                 myStackDepths;
+    //  Statements of the packed streams, for profiling
+    vector<vector<CompiledStatement>> myStatements;
+
+    //  Flat form, nodes in one contiguous arena
+    FlatAst                     myFlat;
+
+    //  Threaded form, packed with opcodes resolved into handler addresses for double
+    vector<ThreadedStream>      myThreadedStreams;
+
+    //  Native form, empty where native code is not available
+    vector<JitFunction>         myJitFunctions;
+
+    //  Register form
+    vector<vector<RegInstr>>    myRegCode;
+    vector<double>              myRegConsts;
+    size_t                      mySpotRegister = 0;
+    //  0 until compiled to registers
+    size_t                      myNumRegisters = 0;
 
 public:
 
 	//	Accessors
 
 	//	Access event dates
-	const vector<Date>& eventDates()
+	const vector<Date>& eventDates() const
 	{
 		return myEventDates;
 	}
@@ -66,24 +118,112 @@ public:
 		return myVariables;
 	}
 
+    //  Number of nodes in all the trees
+    size_t nodeCount() const
+    {
+        size_t n = 0;
+        for (const auto& evt : myEvents)
+        {
+            for (const auto& stat : evt) n += countNodes(*stat);
+        }
+        return n;
+    }
+
+    //  Maximum number of nested ifs, as of the last if processing
+    size_t maxNestedIfs() const
+    {
+        return myMaxNestedIfs;
+    }
+
+    //  Declare the output variables, the only ones reported to the client
+    //  The product must be parsed and pre-processed first, liveProcess() then removes what does not contribute
+    //  Names are uppercased, as the parser does with identifiers
+    void declareOutputs(const vector<string>& outputs)
+    {
+        vector<string> upper;
+        for (string out : outputs)
+        {
+            transform(out.begin(), out.end(), out.begin(), ::toupper);
+            if (find(myVariables.begin(), myVariables.end(), out) == myVariables.end())
+            {
+                throw runtime_error("Output variable " + out + " not found in script");
+            }
+            upper.push_back(out);
+        }
+        myOutputs = upper;
+    }
+
+    //  Indices of the output variables, in the order of declaration, all variables if none declared
+    vector<size_t> outputIndices() const
+    {
+        vector<size_t> indices;
+        if (myOutputs.empty())
+        {
+            for (size_t v = 0; v < myVariables.size(); ++v) indices.push_back(v);
+        }
+        else
+        {
+            for (const auto& out : myOutputs)
+            {
+                indices.push_back(find(myVariables.begin(), myVariables.end(), out) - myVariables.begin());
+            }
+        }
+
+        //  Move
+        return indices;
+    }
+
 	//	Factories
 
 	//	Evaluator factory
 	template <class T>
-    Evaluator<T> buildEvaluator()
+    Evaluator<T> buildEvaluator() const
 	{
 		//	Move
 		return Evaluator<T>( myVariables.size());
 	}
     template <class T>
-	FuzzyEvaluator<T> buildFuzzyEvaluator( const size_t maxNestedIfs, const double defEps)
+	FuzzyEvaluator<T> buildFuzzyEvaluator( const size_t maxNestedIfs, const double defEps) const
 	{
 		return FuzzyEvaluator<T>( myVariables.size(), maxNestedIfs, defEps);
 	}
 
+    //  Evaluator of the flat form, sharp or fuzzy, sized for the variables of the flat form
+    template <class T>
+    FlatEvaluator<T> buildFlatEvaluator(const bool fuzzy = false, const double defEps = 0.0) const
+    {
+        return FlatEvaluator<T>(myFlat.varNames.size(), fuzzy, defEps);
+    }
+
+    //  State factory for compiled evaluation, sharp or fuzzy
+    //  The product must be compiled first
+    template <class T>
+    EvalState<T> buildCompiledState() const
+    {
+        //  Move
+        return EvalState<T>(myVariables.size(), myStoreSize, myStackDepths);
+    }
+
+    //  Register state factory: variables, then constants, spot and temporaries
+    //  The product must be compiled to registers first
+    template <class T>
+    EvalState<T> buildRegisterState() const
+    {
+        if (!myNumRegisters)
+            throw runtime_error("Product not compiled to registers, call compileRegisters() first");
+
+        EvalState<T> state(myNumRegisters);
+        for (size_t c = 0; c < myRegConsts.size(); ++c)
+        {
+            state.variables[myVariables.size() + c] = myRegConsts[c];
+        }
+        //  Move
+        return state;
+    }
+
 	//	Scenario factory
 	template <class T>
-    unique_ptr<Scenario<T>> buildScenario()
+    unique_ptr<Scenario<T>> buildScenario() const
 	{
 		//	Move
 		return unique_ptr<Scenario<T>>( new Scenario<T>( myEventDates.size()));
@@ -145,16 +285,34 @@ public:
     //  The product must be pre-processed first
     template <class T, class Eval>
 	void evaluate( const Scenario<T>& scen, Eval& eval) const
+	{
+        evaluate( scen, eval, [](const size_t, const size_t) {});
+	}
+
+    //	Same, with the scenario simulated lazily: simulate(first, last) fills events first to last-1 of scen,
+    //      it is called in order, and not called for the events of dead paths, see guardProcess()
+    template <class T, class Eval, class Sim>
+	void evaluate( const Scenario<T>& scen, Eval& eval, const Sim& simulate) const
 	{
 		//	Set scenario
 		eval.setScenario( &scen);
 
 		//	Initialize all variables
-		eval.init();
+		initState( eval);
+
+        //  Early termination in sharp mode only
+        const bool guarded = sharpEvaluator( eval) && myGuardFrom < myEvents.size();
+        simulate( 0, guarded ? myGuardFrom : myEvents.size());
 
 		//	Loop over events
 		for(size_t i=0; i<myEvents.size(); ++i)
 		{
+            if (guarded && i >= myGuardFrom)
+            {
+                if (dead( i, eval.varVals())) break;
+                simulate( i, i + 1);
+            }
+
 			//	Set current event
 			eval.setCurEvt( i);
 			
@@ -167,29 +325,301 @@ public:
 		}
 	}
 
+    //	Same on the flat form, with a flat evaluator
+    //  The product must be pre-processed then flattened first
+    //  Resets and termination use the analyses of the flat form, 
+    //      taken from the trees by flatten() and dropped when the flat form is transformed
+    template <class T>
+    void evaluateFlat(const Scenario<T>& scen, FlatEvaluator<T>& eval) const
+    {
+        //	Set scenario
+        eval.setScenario(&scen);
+
+        //	Initialize variables
+        if (myFlat.initAnalyzed) eval.init(myFlat.resetVars);
+        else eval.init();
+
+        //  Early termination in sharp mode only
+        const bool guarded = !eval.fuzzy();
+
+        //	Loop over events
+        for (size_t i = 0; i < myFlat.events.size(); ++i)
+        {
+            if (guarded && myFlat.dead(i, eval.varVals())) break;
+
+            //	Set current event
+            eval.setCurEvt(i);
+
+            //	Evaluate its statements
+            eval.evalEvent(myFlat);
+        }
+    }
+
+    //  Reject states with stacks too small for the compiled streams
+    template <class T>
+    void checkState(const EvalState<T>& state) const
+    {
+        if (!state.fits(myStackDepths))
+        {
+            throw runtime_error("Evaluation state too small for the compiled product, build it with buildCompiledState()");
+        }
+    }
+
     //	Evaluate all compiled statements in all events
-    //  The product must be pre-processed and compiled first
+    //  The product must be pre-processed and compiled first, 
+    //      and the state built with buildCompiledState(), which sizes the stacks of the virtual machine
     template <class T>
     void evaluateCompiled(
         const Scenario<T>& scen, 
         EvalState<T>& state) const
     {
+        evaluateCompiled(scen, state, [](const size_t, const size_t) {});
+    }
+
+    //	Same, with the scenario simulated lazily, like evaluate()
+    template <class T, class Sim>
+    void evaluateCompiled(
+        const Scenario<T>& scen, 
+        EvalState<T>& state,
+        const Sim& simulate) const
+    {
+        checkState(state);
+
         //	Initialize state
-        state.init();
+        initState(state);
+
+        //  Early termination in sharp mode only
+        const bool guarded = !myCompiledFuzzy && myGuardFrom < myEvents.size();
+        simulate(0, guarded ? myGuardFrom : myEvents.size());
 
         //	Loop over events
         for (size_t i = 0; i<myEvents.size(); ++i)
         {
+            if (guarded && i >= myGuardFrom)
+            {
+                if (dead(i, state.variables)) break;
+                simulate(i, i + 1);
+            }
+
             //	Evaluate the compiled events
-            evalCompiled(myNodeStreams[i], myConstStreams[i], myDataStreams[i], scen[i], state);
+            evalCompiled(myPackedStreams[i], scen[i], state);
+        }
+    }
+
+    //  Profile sized for the compiled streams, to be filled by evaluateProfiled()
+    OpcodeProfile buildProfile() const
+    {
+        vector<size_t> sizes;
+        for (const auto& stream : myPackedStreams) sizes.push_back(stream.size());
+        return OpcodeProfile(sizes);
+    }
+
+    //  Same as evaluateCompiled, with the instrumented interpreter, accumulates into profile
+    //  Results are identical, evaluation is much slower
+    template <class T>
+    void evaluateProfiled(
+        const Scenario<T>& scen,
+        EvalState<T>& state,
+        OpcodeProfile& profile) const
+    {
+        checkState(state);
+
+        //	Initialize state
+        initState(state);
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            if (!myCompiledFuzzy && dead(i, state.variables)) break;
+
+            profile.event = i;
+            evalCompiled<T, true>(myPackedStreams[i], scen[i], state, 0, 0, &profile);
+            profile.stop();
         }
+
+        ++profile.paths;
+    }
+
+    //	Same with the direct threaded interpreter
+    //  Results are identical to evaluateCompiled
+    //  Falls back to evaluateCompiled where the compiler does not support threaded dispatch
+    void evaluateThreaded(
+        const Scenario<double>& scen,
+        EvalState<double>& state) const
+    {
+#ifdef THREADED_DISPATCH
+        //  Not threaded, for instance compiled in fuzzy mode
+        if (myThreadedStreams.empty())
+        {
+            evaluateCompiled(scen, state);
+            return;
+        }
+
+        checkState(state);
+
+        //	Initialize state
+        initState(state);
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            if (dead(i, state.variables)) break;
+
+            //	Evaluate the threaded events
+            evalThreaded(myThreadedStreams[i], scen[i], state);
+        }
+#else
+        evaluateCompiled(scen, state);
+#endif
     }
     
+    //	Same with natively compiled events
+    //  Results are identical to evaluateCompiled
+    //  Falls back to evaluateCompiled where native code is not available
+    void evaluateJit(
+        const Scenario<double>& scen,
+        EvalState<double>& state) const
+    {
+        if (myJitFunctions.empty())
+        {
+            evaluateCompiled(scen, state);
+            return;
+        }
+
+        //	Initialize state
+        initState(state);
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            if (dead(i, state.variables)) break;
+
+            //	Execute the native events
+            myJitFunctions[i](scen[i], state);
+        }
+    }
+
+    //  Threaded and native forms are resolved for double only
+    //  Other number types, like float, fall back to evaluateCompiled
+    template <class T>
+    void evaluateThreaded(
+        const Scenario<T>& scen,
+        EvalState<T>& state) const
+    {
+        evaluateCompiled(scen, state);
+    }
+    template <class T>
+    void evaluateJit(
+        const Scenario<T>& scen,
+        EvalState<T>& state) const
+    {
+        evaluateCompiled(scen, state);
+    }
+
+    //	Evaluate all register compiled statements in all events
+    //  The product must be pre-processed and compiled to registers first
+    //  The state must be built with buildRegisterState()
+    template <class T>
+    void evaluateRegisters(
+        const Scenario<T>& scen,
+        EvalState<T>& state) const
+    {
+        //	Initialize variables, constants are left untouched
+        if (myInitAnalyzed) state.init(myResetVars);
+        else state.init(myVariables.size());
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            if (dead(i, state.variables)) break;
+
+            //	Evaluate the compiled events
+            evalRegisters(myRegCode[i], scen[i], state, mySpotRegister);
+        }
+    }
+
+    //	Evaluate all compiled statements in all events over a block of W paths at once
+    //  Each lane of the results is identical to the evaluateCompiled on the corresponding path
+    //  The product must be pre-processed and compiled first
+    template <class T, size_t W>
+    void evaluateBatch(
+        const Scenario<Lanes<T, W>>& scen,
+        EvalState<Lanes<T, W>>& state) const
+    {
+        if (myStackDepths.values > BATCH_STACK_SIZE || myStackDepths.bools > BATCH_STACK_SIZE)
+        {
+            throw runtime_error("Expressions too deep for the batch evaluator");
+        }
+
+        //	Initialize state
+        initState(state);
+
+        //  Start with all lanes active
+        const LaneMask<W> active = allLanes<W>();
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            //  All lanes dead
+            if (dead(i, state.variables)) break;
+
+            //	Evaluate the compiled events
+            evalBatch(myNodeStreams[i], myConstStreams[i], scen[i], state, active);
+        }
+    }
+
+    //  Initialize a state or evaluator before the evaluation of a path
+    //  Only the variables found by initProcess() are reset, all of them when it was not run
+    //  Not for register states, where the constants follow the variables, see evaluateRegisters()
+    template <class S>
+    void initState(S& s) const
+    {
+        if (myInitAnalyzed) s.init(myResetVars);
+        else s.init();
+    }
+
+    //  Is the path dead at the start of event evt, as per the termination guard, see guardProcess()
+    //  Sharp evaluation only
+    template <class T>
+    bool dead(const size_t evt, const vector<T>& variables) const
+    {
+        return evt >= myGuardFrom && variables[myGuardVar] != T(myGuardConst);
+    }
+    //  Batch: all lanes dead
+    template <class T, size_t W>
+    bool dead(const size_t evt, const vector<Lanes<T, W>>& variables) const
+    {
+        if (evt < myGuardFrom) return false;
+        for (size_t l = 0; l < W; ++l) if (variables[myGuardVar][l] == T(myGuardConst)) return false;
+        return true;
+    }
+
+    //  Is the evaluator sharp, only the Evaluator is
+    template <class Eval>
+    static bool sharpEvaluator(const Eval&)
+    {
+        return false;
+    }
+    template <class T>
+    static bool sharpEvaluator(const Evaluator<T>&)
+    {
+        return true;
+    }
+
+    //  The analyses of initProcess() and guardProcess() no longer hold after the trees or the indexing change
+    void invalidateAnalyses()
+    {
+        myInitAnalyzed = false;
+        myGuardFrom = size_t(-1);
+    }
+
     //  Processors
 
     //	Index all variables
 	void indexVariables()
 	{
+        invalidateAnalyses();
+
 		//	Our indexer
 		VarIndexer indexer;
 		
@@ -210,7 +640,7 @@ public:
 		visit( ifProc);
 
 		//	Return
-		return ifProc.maxNestedIfs();
+		return myMaxNestedIfs = ifProc.maxNestedIfs();
 	}
 
 	//	Domain processing
@@ -232,11 +662,140 @@ public:
         visit(cProc);
     }
 
+    //  Liveness process, remove the statements and variables that do not contribute to the declared outputs
+    //  Variables are indexed again, and the ifs processed again for fuzzy evaluation
+    //  Returns the number of statements removed
+    size_t liveProcess()
+    {
+        if (myOutputs.empty()) return 0;
+
+        LiveProcessor lProc(myVariables.size(), outputIndices());
+
+        //  Note that changes the structure of the trees, hence a special function must be called on every event
+        //  Backwards
+        for (auto evtIt = myEvents.rbegin(); evtIt != myEvents.rend(); ++evtIt)
+        {
+            lProc.processEvent(*evtIt);
+        }
+
+        indexVariables();
+        ifProcess();
+
+        //  Outputs no longer in the script are never written, they remain as variables, always 0
+        for (const auto& out : myOutputs)
+        {
+            if (find(myVariables.begin(), myVariables.end(), out) == myVariables.end()) myVariables.push_back(out);
+        }
+
+        return lProc.removed();
+    }
+
+    //  Simplification process, after constants are identified
+    //  rewrites is a combination of Simplifier::Rewrites flags
+    void simplifyProcess(const int rewrites)
+    {
+        constProcess();
+        invalidateAnalyses();
+
+        Simplifier simp(rewrites);
+
+        //  Note that changes the structure of the trees, hence a special function must be called 
+        //      from the top of each tree
+        for (auto& evt : myEvents)
+        {
+            for (auto& stat : evt)
+            {
+                simp.processFromTop(stat);
+            }
+        }
+    }
+
+    //  Common subexpression elimination, after constants are identified
+    //  Expressions repeated in an event are evaluated once into temporaries, 
+    //      new variables indexed after those of the script
+    //  Variables not declared as outputs before are all declared, so temporaries are not reported
+    //  Returns the number of nodes removed
+    size_t cseProcess()
+    {
+        constProcess();
+
+        //  Temporaries are not outputs
+        if (myOutputs.empty()) myOutputs = myVariables;
+
+        CseProcessor cse(myVariables);
+        invalidateAnalyses();
+
+        //  Note that changes the structure of the trees, hence a special function must be called on every event
+        for (auto& evt : myEvents)
+        {
+            cse.processEvent(evt);
+        }
+
+        myVariables = cse.varNames();
+        return cse.nodesRemoved();
+    }
+
+    //  Init process, find the variables that must be reset before each path, see scriptingInitProc.h
+    //  Variables definitely assigned before they are read, and not reported unassigned, 
+    //      are no longer reset by the evaluation functions
+    //  Must be run again after the processors that change the trees, which invalidate it,
+    //      it is the last of the pre-processing and optimization passes
+    //  Returns the number of variables to reset
+    size_t initProcess()
+    {
+        InitProcessor iProc(myVariables.size());
+
+        //  Visit
+        visit(iProc);
+
+        myResetVars = iProc.resetVars(outputIndices());
+        myInitAnalyzed = true;
+
+        return myResetVars.size();
+    }
+
+    //  Guard process, find the termination guard of the product, see scriptingGuardProc.h
+    //  Sharp evaluation functions stop evaluating a path once it is dead, 
+    //      and evaluate() and evaluateCompiled() stop simulating it when the scenario is simulated lazily
+    //  Like initProcess(), it must be run again after the processors that change the trees, which invalidate it
+    //  Returns the number of guarded events, at the end of the product
+    size_t guardProcess()
+    {
+        GuardProcessor gProc;
+
+        //  Backwards, as long as all statements are guarded by the same guard
+        size_t first = myEvents.size();
+        while (first > 0 && gProc.processEvent(myEvents[first - 1])) --first;
+
+        if (!gProc.found())
+        {
+            myGuardFrom = size_t(-1);
+            return 0;
+        }
+
+        myGuardFrom = first;
+        myGuardVar = gProc.guardVar();
+        myGuardConst = gProc.guardConst();
+
+        return myEvents.size() - first;
+    }
+
+    //  Variables reset before each path, all of them when initProcess() was not run or invalidated
+    vector<size_t> resetVars() const
+    {
+        if (myInitAnalyzed) return myResetVars;
+
+        vector<size_t> all(myVariables.size());
+        for (size_t v = 0; v < all.size(); ++v) all[v] = v;
+        return all;
+    }
+
 	//	Const condition process, remove all conditions that are always true or always false
 	void constCondProcess()
 	{
 		//	The const cond processor
 		ConstCondProcessor ccProc;
+        invalidateAnalyses();
 
 		//	Visit
 		//	Note that changes the structure of the tree, hence a special function must be called 
@@ -253,8 +812,48 @@ public:
 		}
 	}
 
-    //	Compile into streams of instructions, constants and data, one per event date
-    void compile()
+    //  Flatten the trees into one contiguous arena, in evaluation order, see scriptingFlatAst.h
+    //  Variables must be indexed, the product is normally pre-processed first
+    void flatten()
+    {
+        myFlat.build(myEvents, myVariables);
+
+        //  Analyses of the trees, which hold for the flat form until it is transformed
+        myFlat.resetVars = myResetVars;
+        myFlat.initAnalyzed = myInitAnalyzed;
+        myFlat.guardFrom = myGuardFrom;
+        myFlat.guardVar = myGuardVar;
+        myFlat.guardConst = myGuardConst;
+    }
+
+    //  Access the flat form, visitors run on it with flatAst().visit() or flatAst().transform()
+    const FlatAst& flatAst() const
+    {
+        return myFlat;
+    }
+    FlatAst& flatAst()
+    {
+        return myFlat;
+    }
+
+    //  Replace the trees with those of the flat form, after processing on the flat form
+    void unflatten()
+    {
+        myEvents = myFlat.toTrees();
+        myVariables = myFlat.varNames;
+
+        //  Analyses of the flat form, dropped if it was transformed
+        myResetVars = myFlat.resetVars;
+        myInitAnalyzed = myFlat.initAnalyzed;
+        myGuardFrom = myFlat.guardFrom;
+        myGuardVar = myFlat.guardVar;
+        myGuardConst = myFlat.guardConst;
+    }
+
+    //	Compile into streams of instructions and constants, one per event date, 
+    //      packed for execution into one stream of instructions with inlined operands
+    //  Frequent sequences of instructions are fused into superinstructions unless fuse is false
+    void compile(const bool fuse = true)
     {
         //  First, identify constants
         constProcess();
@@ -262,12 +861,19 @@ public:
         //  Clear
         myNodeStreams.clear();
         myConstStreams.clear();
-        myDataStreams.clear();
+        myPackedStreams.clear();
+        myThreadedStreams.clear();
+        myJitFunctions.clear();
+        myStatements.clear();
+        myStoreSize = 0;
+        myCompiledFuzzy = false;
+        myStackDepths = StackDepths();
         
         //  One per event date
         myNodeStreams.reserve(myEvents.size());
         myConstStreams.reserve(myEvents.size());
-        myDataStreams.reserve(myEvents.size());
+        myPackedStreams.reserve(myEvents.size());
+        myThreadedStreams.reserve(myEvents.size());
 
         //	Visit
         for (auto& evt : myEvents)
@@ -283,27 +889,424 @@ public:
             }
 
             //  Get compiled 
+            myStatements.push_back(comp.statements());
+            if (fuse)
+            {
+                vector<int> indexMap;
+                myNodeStreams.push_back(fuseStream(comp.nodeStream(), &indexMap));
+                remapStatements(myStatements.back(), indexMap);
+            }
+            else
+            {
+                myNodeStreams.push_back(comp.nodeStream());
+            }
+            myConstStreams.push_back(comp.constStream());
+            myPackedStreams.push_back(packStream(myNodeStreams.back(), myConstStreams.back()));
+            myStackDepths.cover(stackDepths(myNodeStreams.back()));
+
+#ifdef THREADED_DISPATCH
+            //  Resolve handler addresses once and for all
+            myThreadedStreams.push_back(threadStream<double>(myPackedStreams.back()));
+#endif
+        }
+    }
+
+    //	Compile in fuzzy mode: conditions are compiled into degrees of truth and IFs blend their affected variables
+    //  Evaluation with evaluateCompiled() produces the same results as the FuzzyEvaluator
+    //  The product must be pre-processed for fuzzy evaluation, and evaluated with a state from buildCompiledState()
+    void compileFuzzy(const double defEps)
+    {
+        //  First, identify constants
+        constProcess();
+
+        //  Clear
+        myNodeStreams.clear();
+        myConstStreams.clear();
+        myPackedStreams.clear();
+        myThreadedStreams.clear();
+        myJitFunctions.clear();
+        myStatements.clear();
+        myStoreSize = 0;
+        myCompiledFuzzy = true;
+        myStackDepths = StackDepths();
+
+        //  One per event date
+        myNodeStreams.reserve(myEvents.size());
+        myConstStreams.reserve(myEvents.size());
+        myPackedStreams.reserve(myEvents.size());
+
+        //	Visit
+        for (auto& evt : myEvents)
+        {
+            //	The compiler, in fuzzy mode
+            Compiler comp(true, defEps);
+
+            //	Loop over statements in event
+            for (auto& stat : evt)
+            {
+                //	Visit statement
+                stat->accept(comp);
+            }
+
+            //  Get compiled, events are evaluated in sequence so work spaces are shared
             myNodeStreams.push_back(comp.nodeStream());
+            myStatements.push_back(comp.statements());
             myConstStreams.push_back(comp.constStream());
-            myDataStreams.push_back(comp.dataStream());
+            myPackedStreams.push_back(packStream(myNodeStreams.back(), myConstStreams.back()));
+            myStoreSize = max(myStoreSize, comp.storeSize());
+            myStackDepths.cover(stackDepths(myNodeStreams.back()));
         }
     }
 
-	//	All preprocessing
-	size_t preProcess( const bool fuzzy, const bool skipDoms)
-	{
-		indexVariables();
+    //  Static opcode frequency report over the compiled streams
+    //  Counts of every opcode, and the most frequent sequences of 2 and 3 instructions,
+    //      the candidates for superinstructions
+    //  The product must be compiled first, compile(false) reports on the unfused streams
+    void opcodeReport(ostream& ost, const size_t topSequences = 10) const
+    {
+        OpcodeStats stats;
+        for (const auto& stream : myNodeStreams) stats.add(stream);
+
+        size_t total = 0;
+        for (const auto& op : stats.singles) total += op.second;
+
+        //  Sort by decreasing frequency
+        vector<pair<size_t, int>> singles;
+        for (const auto& op : stats.singles) singles.push_back(make_pair(op.second, op.first));
+        sort(singles.begin(), singles.end(), greater<pair<size_t, int>>());
+
+        ost << "Instructions: " << total << endl;
+        for (const auto& op : singles)
+        {
+            ost << opcodeName(op.second) << "\t" << op.first << "\t" << 100.0 * op.first / total << "%" << endl;
+        }
+
+        vector<pair<size_t, vector<int>>> sequences;
+        for (const auto& seq : stats.sequences) sequences.push_back(make_pair(seq.second, seq.first));
+        sort(sequences.begin(), sequences.end(), greater<pair<size_t, vector<int>>>());
+        if (sequences.size() > topSequences) sequences.resize(topSequences);
+
+        ost << "Sequences:" << endl;
+        for (const auto& seq : sequences)
+        {
+            for (size_t k = 0; k < seq.second.size(); ++k)
+            {
+                ost << (k ? " " : "") << opcodeName(seq.second[k]);
+            }
+            ost << "\t" << seq.first << endl;
+        }
+    }
+
+    //  Dynamic profile report, from a profile filled by evaluateProfiled() on the current compiled streams
+    //  Ticks per opcode, per statement of the script, and the hottest instructions
+    //  Ticks of statements include those of nested statements
+    void profileReport(const OpcodeProfile& profile, ostream& ost, const size_t top = 20) const
+    {
+        unsigned long long total = 0, executed = 0;
+        for (int op = 0; op < NumNodeTypes; ++op)
+        {
+            total += profile.opTicks[op];
+            executed += profile.opCount[op];
+        }
+        if (!total) total = 1;
+
+        ost << "Paths: " << profile.paths << "\tInstructions: " << executed << "\tTicks: " << total
+            << "\tMeasurement overhead: " << profile.overhead << " ticks per instruction" << endl;
+
+        //  Per opcode, by decreasing ticks
+        vector<pair<unsigned long long, int>> ops;
+        for (int op = 0; op < NumNodeTypes; ++op)
+        {
+            if (profile.opCount[op]) ops.push_back(make_pair(profile.opTicks[op], op));
+        }
+        sort(ops.begin(), ops.end(), greater<pair<unsigned long long, int>>());
+
+        ost << "Opcode\tCount\tTicks\tTicks/instr\t%" << endl;
+        for (const auto& op : ops)
+        {
+            ost << opcodeName(op.second) << "\t" << profile.opCount[op.second] << "\t" << op.first
+                << "\t" << double(op.first) / profile.opCount[op.second] << "\t" << 100.0 * op.first / total << endl;
+        }
+
+        //  Per statement, by decreasing ticks
+        vector<pair<unsigned long long, pair<size_t, size_t>>> stats;
+        for (size_t e = 0; e < myStatements.size() && e < profile.ticks.size(); ++e)
+        {
+            for (size_t s = 0; s < myStatements[e].size(); ++s)
+            {
+                const auto& stat = myStatements[e][s];
+                unsigned long long ticks = 0;
+                for (size_t i = stat.begin; i < stat.end; ++i) ticks += profile.ticks[e][i];
+                if (ticks) stats.push_back(make_pair(ticks, make_pair(e, s)));
+            }
+        }
+        sort(stats.begin(), stats.end(), greater<pair<unsigned long long, pair<size_t, size_t>>>());
+        if (stats.size() > top) stats.resize(top);
+
+        ost << "Event\tStatement\t\tTicks\t%" << endl;
+        for (const auto& stat : stats)
+        {
+            const auto& cs = myStatements[stat.second.first][stat.second.second];
+            ost << stat.second.first << "\t" << cs.path << "\t" << cs.label << "\t" << stat.first 
+                << "\t" << 100.0 * stat.first / total << endl;
+        }
+
+        //  Hottest instructions
+        vector<pair<unsigned long long, pair<size_t, size_t>>> instrs;
+        for (size_t e = 0; e < profile.ticks.size(); ++e)
+        {
+            for (size_t i = 0; i < profile.ticks[e].size(); ++i)
+            {
+                if (profile.count[e][i]) instrs.push_back(make_pair(profile.ticks[e][i], make_pair(e, i)));
+            }
+        }
+        sort(instrs.begin(), instrs.end(), greater<pair<unsigned long long, pair<size_t, size_t>>>());
+        if (instrs.size() > top) instrs.resize(top);
+
+        ost << "Event\tPosition\tOpcode\tCount\tTicks\t%\tStatement" << endl;
+        for (const auto& instr : instrs)
+        {
+            const size_t e = instr.second.first, i = instr.second.second;
+            ost << e << "\t" << i << "\t" << opcodeName(int(myPackedStreams[e][i].i)) << "\t" << profile.count[e][i]
+                << "\t" << instr.first << "\t" << 100.0 * instr.first / total << "\t";
+
+            //  Innermost statement: the last one containing the position, nested statements follow their parent
+            const CompiledStatement* inner = nullptr;
+            for (const auto& stat : myStatements[e])
+            {
+                if (stat.begin <= i && i < stat.end) inner = &stat;
+            }
+            if (inner) ost << inner->path << " " << inner->label;
+            ost << endl;
+        }
+    }
+
+    //  Code footprint per event: instructions, words, bytes of the node and const streams and of the packed stream
+    //  Packed streams are executed by evaluateCompiled() and evaluateThreaded()
+    //  The product must be compiled first
+    void footprintReport(ostream& ost) const
+    {
+        size_t totInstr = 0, totNode = 0, totPacked = 0;
+
+        ost << "Event\tInstructions\tWords\tConstants\tNode+const bytes\tPacked bytes" << endl;
+        for (size_t i = 0; i < myNodeStreams.size(); ++i)
+        {
+            size_t instr = 0;
+            for (size_t j = 0; j < myNodeStreams[i].size(); j += 1 + numOperands(myNodeStreams[i][j])) ++instr;
+            const size_t node = myNodeStreams[i].size() * sizeof(int) + myConstStreams[i].size() * sizeof(double);
+            const size_t packed = myPackedStreams[i].size() * sizeof(PackedWord);
+
+            ost << i << "\t" << instr << "\t" << myNodeStreams[i].size() << "\t" << myConstStreams[i].size()
+                << "\t" << node << "\t" << packed << endl;
+
+            totInstr += instr;
+            totNode += node;
+            totPacked += packed;
+        }
+        ost << "Total\t" << totInstr << "\t\t\t" << totNode << "\t" << totPacked << endl;
+    }
+
+    //  Compile the node streams into native code, one function per event date
+    //  The product must be compiled first
+    //  Returns false, and evaluateJit() falls back to the interpreter, where native code is not available
+    bool jit()
+    {
+        myJitFunctions.clear();
+        myJitFunctions.reserve(myNodeStreams.size());
+
+        for (size_t i = 0; i < myNodeStreams.size(); ++i)
+        {
+            myJitFunctions.push_back(jitCompile(myNodeStreams[i], myConstStreams[i]));
+            if (!myJitFunctions.back().valid())
+            {
+                myJitFunctions.clear();
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    //	Compile into three address code over registers, one per event date
+    void compileRegisters()
+    {
+        //  First, identify constants
+        constProcess();
+
+        //	The compiler
+        RegCompiler comp(myVariables.size());
+
+        //  One per event date
+        myRegCode.clear();
+        myRegCode.reserve(myEvents.size());
+        for (auto& evt : myEvents)
+        {
+            myRegCode.push_back(comp.compileEvent(evt));
+        }
+
+        //  Resolve registers now that all constants are known
+        for (auto& code : myRegCode)
+        {
+            comp.finalize(code);
+        }
+
+        myRegConsts = comp.constants();
+        mySpotRegister = comp.spotRegister();
+        myNumRegisters = comp.numRegisters();
+    }
+
+    //  Write a self-contained C++ source file that evaluates the product
+    //  One function per event, templated on the number type, with the semantics of the Evaluator,
+    //      and an entry point for double exported as <name>_evaluate, see scriptingAot.h
+    //  The file may also be included in client code and called with any number type
+    //  The product must be pre-processed first
+    void generateCpp(ostream& ost, const string& name = "script")
+    {
+        //  Constants are written as literals
+        constProcess();
+
+        ost << "//  Generated by Product::generateCpp()" << endl;
+        ost << "//  Variables:" << endl;
+        for (size_t v = 0; v < myVariables.size(); ++v)
+        {
+            ost << "//      v[" << v << "] = " << myVariables[v] << endl;
+        }
+        ost << endl;
+        ost << "#include <cmath>" << endl;
+        ost << "#include <cstddef>" << endl;
+        ost << "#include <limits>" << endl;
+        ost << endl;
+        ost << "#ifdef _WIN32" << endl;
+        ost << "#define SCRIPT_EXPORT extern \"C\" __declspec(dllexport)" << endl;
+        ost << "#else" << endl;
+        ost << "#define SCRIPT_EXPORT extern \"C\"" << endl;
+        ost << "#endif" << endl;
+        ost << endl;
+        ost << "namespace " << name << endl;
+        ost << "{" << endl;
+        ost << "    using std::log;" << endl;
+        ost << "    using std::sqrt;" << endl;
+        ost << "    using std::pow;" << endl;
+        ost << endl;
+        ost << "    //  Same layout as SimulData in scriptingScenarios.h" << endl;
+        ost << "    template <class T>" << endl;
+        ost << "    struct SimulData" << endl;
+        ost << "    {" << endl;
+        ost << "        T spot;" << endl;
+        ost << "        T numeraire;" << endl;
+        ost << "    };" << endl;
+        ost << endl;
+        ost << "    template <class T>" << endl;
+        ost << "    inline T scriptMax(const T x, const T y) { return x < y ? y : x; }" << endl;
+        ost << "    template <class T>" << endl;
+        ost << "    inline T scriptMin(const T x, const T y) { return x > y ? y : x; }" << endl;
+        ost << endl;
+        ost << "    const size_t numEvents = " << myEvents.size() << ";" << endl;
+        ost << "    const size_t numVariables = " << myVariables.size() << ";" << endl;
+
+        //  One function per event
+        for (size_t e = 0; e < myEvents.size(); ++e)
+        {
+            CppGenerator gen("        ");
+            for (auto& stat : myEvents[e])
+            {
+                stat->accept(gen);
+            }
+
+            ost << endl;
+            ost << "    //  Event " << e + 1 << ", date " << myEventDates[e] << endl;
+            ost << "    template <class T>" << endl;
+            //  Parameters not used by the event are left unnamed, so the file compiles without warnings
+            const string& code = gen.code();
+            const bool readsScen = code.find("scen.") != string::npos;
+            const bool readsVars = code.find("v[") != string::npos;
+            ost << "    inline void event" << e << "(const SimulData<T>&" << (readsScen ? " scen" : "") 
+                << ", T*" << (readsVars ? " v" : "") << ")" << endl;
+            ost << "    {" << endl;
+            ost << code;
+            ost << "    }" << endl;
+        }
+
+        //  All events
+        ost << endl;
+        ost << "    //  Evaluate all events, variables must be initialized to 0" << endl;
+        ost << "    template <class T>" << endl;
+        ost << "    inline void evaluate(const SimulData<T>* scen, T* v)" << endl;
+        ost << "    {" << endl;
+        for (size_t e = 0; e < myEvents.size(); ++e)
+        {
+            ost << "        event" << e << "(scen[" << e << "], v);" << endl;
+        }
+        ost << "    }" << endl;
+        ost << "}" << endl;
+
+        //  Entry points
+        ost << endl;
+        ost << "SCRIPT_EXPORT void " << name << "_evaluate(const void* scen, double* v)" << endl;
+        ost << "{" << endl;
+        ost << "    " << name << "::evaluate(static_cast<const " << name << "::SimulData<double>*>(scen), v);" << endl;
+        ost << "}" << endl;
+        ost << endl;
+        ost << "SCRIPT_EXPORT size_t " << name << "_numEvents()" << endl;
+        ost << "{" << endl;
+        ost << "    return " << name << "::numEvents;" << endl;
+        ost << "}" << endl;
+        ost << endl;
+        ost << "SCRIPT_EXPORT size_t " << name << "_numVariables()" << endl;
+        ost << "{" << endl;
+        ost << "    return " << name << "::numVariables;" << endl;
+        ost << "}" << endl;
+    }
+
+    //  Pass managers
+
+    //  Pre-processing passes, in order
+    PassManager<Product> preProcessPasses( const bool fuzzy, const bool skipDoms)
+    {
+        PassManager<Product> passes;
+
+        passes.add("indexVariables", [](Product& prd) { prd.indexVariables(); });
 
-        size_t maxNestedIfs = 0;
-		
 		if( fuzzy || !skipDoms)
 		{
-			maxNestedIfs = ifProcess();
-			domainProcess( fuzzy);
-			constCondProcess();
+            passes.add("ifProcess", [](Product& prd) { prd.ifProcess(); });
+            passes.add("domainProcess", [fuzzy](Product& prd) { prd.domainProcess(fuzzy); });
+            passes.add("constCondProcess", [](Product& prd) { prd.constCondProcess(); });
 		}
 
-		return maxNestedIfs;
+        passes.add("initProcess", [](Product& prd) { prd.initProcess(); });
+        passes.add("guardProcess", [](Product& prd) { prd.guardProcess(); });
+
+        return passes;
+    }
+
+    //  Optimization passes, after pre-processing, in order
+    //  Outputs should be declared first, otherwise all variables are outputs and liveProcess does nothing
+    //  Strength reductions are inexact (see Simplifier) and only run on request
+    PassManager<Product> optimizationPasses( const bool strength = false)
+    {
+        PassManager<Product> passes;
+
+        passes.add("liveProcess", [](Product& prd) { prd.liveProcess(); });
+        passes.add("constFold", [](Product& prd) { prd.simplifyProcess(Simplifier::constFold); });
+        passes.add("simplify", [](Product& prd) { prd.simplifyProcess(Simplifier::algebraic); });
+        if (strength)
+        {
+            passes.add("strengthReduce", [](Product& prd) { prd.simplifyProcess(Simplifier::strength); });
+        }
+        passes.add("cseProcess", [](Product& prd) { prd.cseProcess(); });
+        passes.add("initProcess", [](Product& prd) { prd.initProcess(); });
+        passes.add("guardProcess", [](Product& prd) { prd.guardProcess(); });
+
+        return passes;
+    }
+
+	//	All preprocessing, returns max number of nested ifs
+	size_t preProcess( const bool fuzzy, const bool skipDoms)
+	{
+        myMaxNestedIfs = 0;
+        preProcessPasses( fuzzy, skipDoms).run( *this);
+		return myMaxNestedIfs;
 	}
 
 	//	Debug whole product
@@ -0,0 +1,705 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Register based compiler and interpreter
+//  An alternative to the stack machine of scriptingCompiler.h
+//  Statements are lowered into three address instructions dst = op(a, b) over a file of registers:
+//      [0, nVar)                       the variables, so variables are operands, not loads
+//      [nVar, nVar + nConst)           the constants of all events, loaded once in the state
+//      nVar + nConst                   the spot of the current event
+//      [nVar + nConst + 1, nReg)       the temporaries
+//  Booleans live in a separate, small file of boolean registers
+//  Temporaries are allocated by linear scan:
+//      a temporary is freed at its (unique) use and the lowest free temporary is reused first
+
+#include "scriptingNodes.h"
+#include "scriptingScenarios.h"
+#include "scriptingCompiler.h"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <cstring>
+#include <climits>
+
+enum RegOp
+{
+    RAdd,
+    RSub,
+    RMult,
+    RDiv,
+    RPow,
+    RMax,
+    RMin,
+    RUminus,
+    RLog,
+    RSqrt,
+    RSmooth,        //  dst = smooth(x = a, eps = b), vPos and vNeg in the next instruction
+    RSmoothArgs,    //  Not executed, holds a = vPos, b = vNeg for the preceding RSmooth
+    RMove,
+    RPays,          //  dst += a / numeraire
+    REqual,         //  Boolean dst = a == 0
+    RSup,           //  Boolean dst = a > 0
+    RSupEqual,      //  Boolean dst = a >= 0
+    RAnd,           //  Boolean dst = a and b
+    ROr,            //  Boolean dst = a or b
+    RNot,           //  Boolean dst = not a
+    RSetBool,       //  Boolean dst = a
+    RJump,          //  Jump to dst
+    RJumpIfFalse    //  Jump to dst if boolean a is false
+};
+
+//  Three address instruction
+struct RegInstr
+{
+    int     op;
+    int     dst;
+    int     a;
+    int     b;
+};
+
+//  Maximum number of boolean registers
+#define MAXBOOLREGS 64
+
+class RegCompiler : public constVisitor<RegCompiler>
+{
+    //  Layout
+    const size_t                myNumVar;
+
+    //  Constants, keyed by bit pattern so that 0 and -0 remain distinct
+    vector<double>              myConsts;
+    map<unsigned long long, int> myConstMap;
+
+    //  Code for the event being compiled
+    vector<RegInstr>            myCode;
+
+    //  Temporaries, indexed from 0, offset by the layout when code is finalized
+    vector<char>                myTempFree;
+    vector<char>                myBoolFree;
+
+    //  Result of the last expression or condition visited:
+    //      a register, where temporaries are marked with a negative index -1 - tempIdx
+    int                         myResult;
+
+    //  Index of the instruction that defined the last result, -1 if none
+    int                         myResultDef;
+
+    //  Marker for the spot register, resolved when code is finalized
+    static const int            spotMarker = INT_MIN;
+
+    //  Temporaries
+
+    int allocTemp()
+    {
+        size_t t = 0;
+        while (t < myTempFree.size() && !myTempFree[t]) ++t;
+        if (t == myTempFree.size()) myTempFree.push_back(false);
+        else myTempFree[t] = false;
+        return -1 - int(t);
+    }
+
+    void release(const int reg)
+    {
+        if (reg < 0 && reg != spotMarker) myTempFree[-1 - reg] = true;
+    }
+
+    int allocBool()
+    {
+        size_t b = 0;
+        while (b < myBoolFree.size() && !myBoolFree[b]) ++b;
+        if (b == myBoolFree.size())
+        {
+            if (b >= MAXBOOLREGS) throw runtime_error("Condition too complex for the register VM");
+            myBoolFree.push_back(false);
+        }
+        else myBoolFree[b] = false;
+        return int(b);
+    }
+
+    void releaseBool(const int b)
+    {
+        myBoolFree[b] = true;
+    }
+
+    //  Constants
+
+    int constReg(const double val)
+    {
+        unsigned long long key;
+        memcpy(&key, &val, sizeof(key));
+        auto it = myConstMap.find(key);
+        if (it != myConstMap.end()) return it->second;
+        const int reg = int(myNumVar + myConsts.size());
+        myConsts.push_back(val);
+        myConstMap[key] = reg;
+        return reg;
+    }
+
+    //  Emission
+
+    int emit(const int op, const int dst, const int a = 0, const int b = 0)
+    {
+        myCode.push_back(RegInstr{ op, dst, a, b });
+        return int(myCode.size()) - 1;
+    }
+
+    //  Visit an expression, return its register
+    int visitExpr(const Node& node)
+    {
+        const exprNode& expr = static_cast<const exprNode&>(node);
+        if (expr.isConst) return constReg(expr.constVal);
+
+        node.accept(*this);
+        return myResult;
+    }
+
+    //  Visit a condition, return its boolean register
+    int visitCond(const Node& node)
+    {
+        node.accept(*this);
+        return myResult;
+    }
+
+public:
+
+    using constVisitor<RegCompiler>::visit;
+
+    RegCompiler(const size_t nVar) : myNumVar(nVar) {}
+
+    //  Accessors
+
+    //  Constants of all events compiled so far
+    const vector<double>& constants() const
+    {
+        return myConsts;
+    }
+
+    //  Register of the spot
+    size_t spotRegister() const
+    {
+        return myNumVar + myConsts.size();
+    }
+
+    //  Total number of registers
+    size_t numRegisters() const
+    {
+        return spotRegister() + 1 + myTempFree.size();
+    }
+
+    //  Compile one event, return its code
+    //  Registers refer to temporaries and spot by markers until finalize() is called
+    vector<RegInstr> compileEvent(const Event& evt)
+    {
+        myCode.clear();
+        for (const auto& stat : evt)
+        {
+            stat->accept(*this);
+        }
+        return move(myCode);
+    }
+
+    //  Resolve spot and temporaries once all events are compiled and the number of constants is known
+    void finalize(vector<RegInstr>& code) const
+    {
+        const int spotReg = int(spotRegister());
+
+        auto resolve = [&](int& reg)
+        {
+            if (reg == spotMarker) reg = spotReg;
+            else if (reg < 0) reg = spotReg + 1 + (-1 - reg);
+        };
+
+        for (auto& instr : code)
+        {
+            switch (instr.op)
+            {
+            //  Boolean destination, numeric operand
+            case REqual:
+            case RSup:
+            case RSupEqual:
+                resolve(instr.a);
+                break;
+
+            //  Boolean or control only
+            case RAnd:
+            case ROr:
+            case RNot:
+            case RSetBool:
+            case RJump:
+            case RJumpIfFalse:
+                break;
+
+            //  Numeric destination and operands
+            default:
+                resolve(instr.dst);
+                resolve(instr.a);
+                resolve(instr.b);
+                break;
+            }
+        }
+    }
+
+    //	Visitors
+
+    //	Expressions
+
+    //  Binaries
+
+    void visitBinary(const exprNode& node, const int op)
+    {
+        const int a = visitExpr(*node.arguments[0]);
+        const int b = visitExpr(*node.arguments[1]);
+        release(a);
+        release(b);
+        myResult = allocTemp();
+        myResultDef = emit(op, myResult, a, b);
+    }
+
+    void visit(const NodeAdd& node)
+    {
+        visitBinary(node, RAdd);
+    }
+    void visit(const NodeSub& node)
+    {
+        visitBinary(node, RSub);
+    }
+    void visit(const NodeMult& node)
+    {
+        visitBinary(node, RMult);
+    }
+    void visit(const NodeDiv& node)
+    {
+        visitBinary(node, RDiv);
+    }
+    void visit(const NodePow& node)
+    {
+        visitBinary(node, RPow);
+    }
+    void visit(const NodeMax& node)
+    {
+        visitBinary(node, RMax);
+    }
+    void visit(const NodeMin& node)
+    {
+        visitBinary(node, RMin);
+    }
+
+    //	Unaries
+
+    void visitUnary(const exprNode& node, const int op)
+    {
+        const int a = visitExpr(*node.arguments[0]);
+        release(a);
+        myResult = allocTemp();
+        myResultDef = emit(op, myResult, a);
+    }
+
+    void visit(const NodeUplus& node)
+    {
+        myResult = visitExpr(*node.arguments[0]);
+    }
+    void visit(const NodeUminus& node)
+    {
+        visitUnary(node, RUminus);
+    }
+    void visit(const NodeLog& node)
+    {
+        visitUnary(node, RLog);
+    }
+    void visit(const NodeSqrt& node)
+    {
+        visitUnary(node, RSqrt);
+    }
+
+    //  Multies
+
+    void visit(const NodeSmooth& node)
+    {
+        const int x = visitExpr(*node.arguments[0]);
+        const int vPos = visitExpr(*node.arguments[1]);
+        const int vNeg = visitExpr(*node.arguments[2]);
+        const int eps = visitExpr(*node.arguments[3]);
+        release(x);
+        release(vPos);
+        release(vNeg);
+        release(eps);
+        myResult = allocTemp();
+        myResultDef = emit(RSmooth, myResult, x, eps);
+        emit(RSmoothArgs, 0, vPos, vNeg);
+    }
+
+    //	Conditions
+
+    template<typename OP>
+    void visitCondition(const boolNode& node, const int op, OP constOp)
+    {
+        const exprNode* arg = downcast<exprNode>(node.arguments[0]);
+
+        if (arg->isConst)
+        {
+            myResult = allocBool();
+            emit(RSetBool, myResult, constOp(arg->constVal));
+        }
+        else
+        {
+            const int a = visitExpr(*node.arguments[0]);
+            release(a);
+            myResult = allocBool();
+            emit(op, myResult, a);
+        }
+    }
+
+    void visit(const NodeEqual& node)
+    {
+        visitCondition(node, REqual, [](const double x) {return x == 0.0; });
+    }
+    void visit(const NodeSup& node)
+    {
+        visitCondition(node, RSup, [](const double x) {return x > 0.0; });
+    }
+    void visit(const NodeSupEqual& node)
+    {
+        visitCondition(node, RSupEqual, [](const double x) {return x > -EPS; });
+    }
+
+    //  And/Or/Not
+
+    void visitCombinator(const boolNode& node, const int op)
+    {
+        const int a = visitCond(*node.arguments[0]);
+        const int b = visitCond(*node.arguments[1]);
+        releaseBool(a);
+        releaseBool(b);
+        myResult = allocBool();
+        emit(op, myResult, a, b);
+    }
+
+    void visit(const NodeAnd& node)
+    {
+        visitCombinator(node, RAnd);
+    }
+    void visit(const NodeOr& node)
+    {
+        visitCombinator(node, ROr);
+    }
+    void visit(const NodeNot& node)
+    {
+        const int a = visitCond(*node.arguments[0]);
+        releaseBool(a);
+        myResult = allocBool();
+        emit(RNot, myResult, a);
+    }
+
+    void visit(const NodeTrue& node)
+    {
+        myResult = allocBool();
+        emit(RSetBool, myResult, true);
+    }
+    void visit(const NodeFalse& node)
+    {
+        myResult = allocBool();
+        emit(RSetBool, myResult, false);
+    }
+
+    //  Assign, pays
+
+    void visit(const NodeAssign& node)
+    {
+        const int var = int(downcast<NodeVar>(node.arguments[0])->index);
+
+        myResultDef = -1;
+        const int r = visitExpr(*node.arguments[1]);
+
+        //  The result is a temporary computed by the last instruction: compute directly into the variable
+        if (r < 0 && r != spotMarker && myResultDef == int(myCode.size()) - 1 - (myCode[myResultDef].op == RSmooth))
+        {
+            myCode[myResultDef].dst = var;
+            release(r);
+        }
+        else
+        {
+            release(r);
+            emit(RMove, var, r);
+        }
+    }
+
+    void visit(const NodePays& node)
+    {
+        const int var = int(downcast<NodeVar>(node.arguments[0])->index);
+        const int r = visitExpr(*node.arguments[1]);
+        release(r);
+        emit(RPays, var, r);
+    }
+
+    //  Leaves
+
+    void visit(const NodeVar& node)
+    {
+        //  The variable is its own register
+        myResult = int(node.index);
+    }
+
+    void visit(const NodeConst& node)
+    {
+        myResult = constReg(node.constVal);
+    }
+
+    void visit(const NodeSpot& node)
+    {
+        myResult = spotMarker;
+    }
+
+    //	Instructions
+
+    void visit(const NodeIf& node)
+    {
+        //  Condition
+        const int b = visitCond(*node.arguments[0]);
+        releaseBool(b);
+        const int jumpFalse = emit(RJumpIfFalse, 0, b);
+
+        //  If-true statements
+        const size_t lastTrue = node.firstElse == -1 ? node.arguments.size() - 1 : node.firstElse - 1;
+        for (size_t i = 1; i <= lastTrue; ++i)
+        {
+            node.arguments[i]->accept(*this);
+        }
+
+        //  If-false statements
+        if (node.firstElse == -1)
+        {
+            myCode[jumpFalse].dst = int(myCode.size());
+        }
+        else
+        {
+            const int jumpEnd = emit(RJump, 0);
+            myCode[jumpFalse].dst = int(myCode.size());
+
+            for (size_t i = node.firstElse; i < node.arguments.size(); ++i)
+            {
+                node.arguments[i]->accept(*this);
+            }
+
+            myCode[jumpEnd].dst = int(myCode.size());
+        }
+    }
+};
+
+//  The register interpreter
+//  Registers are the variables of the state, sized and loaded with the constants by the product
+template <class T>
+inline void evalRegisters(
+    //  Code to eval
+    const vector<RegInstr>&     code,
+    //  Scenario
+    const SimulData<T>&         scen,
+    //  State
+    EvalState<T>&               state,
+    //  Register of the spot
+    const size_t                spotReg)
+{
+    T* regs = state.variables.data();
+    char bregs[MAXBOOLREGS];
+
+    regs[spotReg] = scen.spot;
+
+    const RegInstr* instr = code.data();
+    const size_t n = code.size();
+    size_t i = 0;
+
+    T x, y;
+
+    //  Loop on instructions
+    while (i < n)
+    {
+        const RegInstr& in = instr[i];
+
+        switch (in.op)
+        {
+
+        case RAdd:
+
+            regs[in.dst] = regs[in.a] + regs[in.b];
+
+            ++i;
+            break;
+
+        case RSub:
+
+            regs[in.dst] = regs[in.a] - regs[in.b];
+
+            ++i;
+            break;
+
+        case RMult:
+
+            regs[in.dst] = regs[in.a] * regs[in.b];
+
+            ++i;
+            break;
+
+        case RDiv:
+
+            regs[in.dst] = regs[in.a] / regs[in.b];
+
+            ++i;
+            break;
+
+        case RPow:
+
+            regs[in.dst] = pow(regs[in.a], regs[in.b]);
+
+            ++i;
+            break;
+
+        case RMax:
+
+            x = regs[in.a];
+            y = regs[in.b];
+            regs[in.dst] = y > x ? y : x;
+
+            ++i;
+            break;
+
+        case RMin:
+
+            x = regs[in.a];
+            y = regs[in.b];
+            regs[in.dst] = y < x ? y : x;
+
+            ++i;
+            break;
+
+        case RUminus:
+
+            regs[in.dst] = -regs[in.a];
+
+            ++i;
+            break;
+
+        case RLog:
+
+            regs[in.dst] = log(regs[in.a]);
+
+            ++i;
+            break;
+
+        case RSqrt:
+
+            regs[in.dst] = sqrt(regs[in.a]);
+
+            ++i;
+            break;
+
+        case RSmooth:
+        {
+            x = regs[in.a];
+            const T halfEps = 0.5 * regs[in.b];
+            const T vPos = regs[instr[i + 1].a];
+            const T vNeg = regs[instr[i + 1].b];
+
+            //	Left
+            if (x < -halfEps) regs[in.dst] = vNeg;
+            //	Right
+            else if (x > halfEps) regs[in.dst] = vPos;
+            //	Fuzzy
+            else regs[in.dst] = vNeg + 0.5 * (vPos - vNeg) / halfEps * (x + halfEps);
+
+            i += 2;
+            break;
+        }
+
+        case RMove:
+
+            regs[in.dst] = regs[in.a];
+
+            ++i;
+            break;
+
+        case RPays:
+
+            regs[in.dst] += regs[in.a] / scen.numeraire;
+
+            ++i;
+            break;
+
+        case REqual:
+
+            bregs[in.dst] = regs[in.a] == 0;
+
+            ++i;
+            break;
+
+        case RSup:
+
+            bregs[in.dst] = regs[in.a] > 0;
+
+            ++i;
+            break;
+
+        case RSupEqual:
+
+            bregs[in.dst] = regs[in.a] >= 0;
+
+            ++i;
+            break;
+
+        case RAnd:
+
+            bregs[in.dst] = bregs[in.a] && bregs[in.b];
+
+            ++i;
+            break;
+
+        case ROr:
+
+            bregs[in.dst] = bregs[in.a] || bregs[in.b];
+
+            ++i;
+            break;
+
+        case RNot:
+
+            bregs[in.dst] = !bregs[in.a];
+
+            ++i;
+            break;
+
+        case RSetBool:
+
+            bregs[in.dst] = char(in.a);
+
+            ++i;
+            break;
+
+        case RJump:
+
+            i = in.dst;
+            break;
+
+        case RJumpIfFalse:
+
+            i = bregs[in.a] ? i + 1 : in.dst;
+            break;
+
+        default:
+
+            ++i;
+            break;
+        }
+    }
+}
@@ -0,0 +1,350 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//	Simplifier
+//	Rewrites expressions into cheaper equivalents, bottom up, so rewritten arguments may enable rewrites of their parents
+//	The rewrites are selected with a combination of flags:
+//		constFold:	constant subtrees, including reads of variables with a known constant value, 
+//					are replaced by constant nodes
+//		algebraic:	identities x + 0, 0 + x, x - 0, x * 1, 1 * x, x / 1, x ^ 1, x ^ 0, 0 - x into -x, --x, +x
+//		strength:	SQRT(x) ^ 2 into x, x ^ n into multiplications for small integers n and x a variable or spot,
+//					division by a constant into multiplication by its reciprocal
+//	Algebraic rewrites are exact, except for the sign of zero in additions and subtractions of 0
+//	Strength reductions may change the last bit, and SQRT(x) ^ 2 returns x where x < 0 
+//	The const processor must have been run first
+
+#include "scriptingNodes.h"
+
+class Simplifier : public Visitor<Simplifier>
+{
+public:
+
+	enum Rewrites
+	{
+		constFold = 1,
+		algebraic = 2,
+		strength = 4
+	};
+
+private:
+
+	const int		myRewrites;
+
+	//	The (unique) pointer on the node currently being visited
+	ExprTree*		myCurrent;
+
+	//	Kind of the nodes, as far as rewrites are concerned
+	enum Kind
+	{
+		otherKind,
+		varKind,
+		spotKind,
+		sqrtKind,
+		uminusKind
+	};
+
+	//	Kind of the node last visited, after rewrite
+	Kind			myKind;
+
+	//	Visit arguments plus set myCurrent pointer, restored after
+	void visitArgsSetCurrent(Node& node)
+	{
+		ExprTree* current = myCurrent;
+		for (auto& arg : node.arguments)
+		{
+			myCurrent = &arg;
+			arg->accept(*this);
+		}
+		myCurrent = current;
+	}
+
+	//	Same, for expressions: returns the kinds of the arguments
+	vector<Kind> visitExprArgs(exprNode& node)
+	{
+		vector<Kind> kinds;
+		ExprTree* current = myCurrent;
+		for (auto& arg : node.arguments)
+		{
+			myCurrent = &arg;
+			arg->accept(*this);
+			kinds.push_back(myKind);
+		}
+		myCurrent = current;
+		myKind = otherKind;
+		return kinds;
+	}
+
+	//	Constant argument with a given value?
+	static bool isConstVal(const ExprTree& arg, const double val)
+	{
+		const exprNode* node = downcast<exprNode>(arg);
+		return node->isConst && node->constVal == val;
+	}
+
+	//	Replace the current node by one of its arguments, with its kind
+	void replaceByArg(const size_t i, const Kind kind)
+	{
+		ExprTree arg = move((*myCurrent)->arguments[i]);
+		*myCurrent = move(arg);
+		myKind = kind;
+	}
+
+	void replaceByConst(const double val)
+	{
+		myCurrent->reset(new NodeConst(val));
+		myKind = otherKind;
+	}
+
+	//	Fold the current node if constant, returns true if folded
+	bool fold(const exprNode& node)
+	{
+		if ((myRewrites & constFold) && node.isConst)
+		{
+			replaceByConst(node.constVal);
+			return true;
+		}
+		return false;
+	}
+
+	//	Copy of a leaf
+	ExprTree copyLeaf(const ExprTree& leaf, const Kind kind) const
+	{
+		if (kind == spotKind) return make_base_node<NodeSpot>();
+
+		const NodeVar* var = downcast<NodeVar>(leaf);
+		auto cpy = make_node<NodeVar>(var->name);
+		cpy->index = var->index;
+		cpy->isConst = var->isConst;
+		cpy->constVal = var->constVal;
+		return cpy;
+	}
+
+public:
+
+	using Visitor<Simplifier>::visit;
+
+	Simplifier(const int rewrites) : myRewrites(rewrites), myCurrent(nullptr), myKind(otherKind) {}
+
+	//	This visitor modifies the structure of the tree, hence it must be called only
+	//		with this method from the top of every tree
+	void processFromTop(unique_ptr<Node>& top)
+	{
+		myCurrent = &top;
+		top->accept(*this);
+	}
+
+	//	Overload catch-all-nodes visitor to visit arguments plus set myCurrent
+	template <class NODE>
+	enable_if_t<is_same<NODE, remove_const_t<NODE>>::value && !hasConstVisit<Simplifier>::forNodeType<NODE>()> visit(NODE& node)
+	{
+		visitArgsSetCurrent(node);
+	}
+
+	//	Statements, LHS variables are not visited
+
+	void visit(NodeAssign& node)
+	{
+		myCurrent = &node.arguments[1];
+		node.arguments[1]->accept(*this);
+	}
+
+	void visit(NodePays& node)
+	{
+		myCurrent = &node.arguments[1];
+		node.arguments[1]->accept(*this);
+	}
+
+	//	Expressions
+
+	void visit(NodeAdd& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node) || !(myRewrites & algebraic)) return;
+
+		if (isConstVal(node.arguments[1], 0.0)) replaceByArg(0, kinds[0]);
+		else if (isConstVal(node.arguments[0], 0.0)) replaceByArg(1, kinds[1]);
+	}
+
+	void visit(NodeSub& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node) || !(myRewrites & algebraic)) return;
+
+		if (isConstVal(node.arguments[1], 0.0)) replaceByArg(0, kinds[0]);
+		else if (isConstVal(node.arguments[0], 0.0))
+		{
+			auto uminus = make_base_node<NodeUminus>();
+			uminus->arguments.push_back(move(node.arguments[1]));
+			*myCurrent = move(uminus);
+			myKind = uminusKind;
+		}
+	}
+
+	void visit(NodeMult& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node) || !(myRewrites & algebraic)) return;
+
+		if (isConstVal(node.arguments[1], 1.0)) replaceByArg(0, kinds[0]);
+		else if (isConstVal(node.arguments[0], 1.0)) replaceByArg(1, kinds[1]);
+	}
+
+	void visit(NodeDiv& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node)) return;
+
+		if ((myRewrites & algebraic) && isConstVal(node.arguments[1], 1.0))
+		{
+			replaceByArg(0, kinds[0]);
+		}
+		else if ((myRewrites & strength) && downcast<exprNode>(node.arguments[1])->isConst
+			&& downcast<exprNode>(node.arguments[1])->constVal != 0.0)
+		{
+			const double c = downcast<exprNode>(node.arguments[1])->constVal;
+			auto mult = make_base_node<NodeMult>();
+			mult->arguments.push_back(move(node.arguments[0]));
+			mult->arguments.push_back(make_base_node<NodeConst>(1.0 / c));
+			*myCurrent = move(mult);
+		}
+	}
+
+	void visit(NodePow& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node)) return;
+
+		const exprNode* exponent = downcast<exprNode>(node.arguments[1]);
+		if (!exponent->isConst) return;
+		const double n = exponent->constVal;
+
+		if (myRewrites & algebraic)
+		{
+			if (n == 1.0)
+			{
+				replaceByArg(0, kinds[0]);
+				return;
+			}
+			if (n == 0.0)
+			{
+				replaceByConst(1.0);
+				return;
+			}
+		}
+
+		if (!(myRewrites & strength)) return;
+
+		//	SQRT(x) ^ 2 = x
+		if (kinds[0] == sqrtKind && n == 2.0)
+		{
+			ExprTree x = move(node.arguments[0]->arguments[0]);
+			*myCurrent = move(x);
+			return;
+		}
+
+		//	x ^ n = x * ... * x, 1 / (x * ... * x) for negative n
+		const bool leaf = kinds[0] == varKind || kinds[0] == spotKind;
+		const int absN = int(fabs(n));
+		if (leaf && n == floor(n) && absN >= 1 && absN <= 4 && n != 1.0)
+		{
+			ExprTree prod = copyLeaf(node.arguments[0], kinds[0]);
+			for (int i = 1; i < absN; ++i)
+			{
+				auto mult = make_base_node<NodeMult>();
+				mult->arguments.push_back(move(prod));
+				mult->arguments.push_back(copyLeaf(node.arguments[0], kinds[0]));
+				prod = move(mult);
+			}
+			if (n < 0)
+			{
+				auto div = make_base_node<NodeDiv>();
+				div->arguments.push_back(make_base_node<NodeConst>(1.0));
+				div->arguments.push_back(move(prod));
+				prod = move(div);
+			}
+			*myCurrent = move(prod);
+		}
+	}
+
+	void visit(NodeUminus& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node)) return;
+		myKind = uminusKind;
+		if (!(myRewrites & algebraic)) return;
+
+		//	--x = x
+		if (kinds[0] == uminusKind)
+		{
+			ExprTree x = move(node.arguments[0]->arguments[0]);
+			*myCurrent = move(x);
+			myKind = otherKind;
+		}
+	}
+
+	void visit(NodeUplus& node)
+	{
+		const auto kinds = visitExprArgs(node);
+		if (fold(node) || !(myRewrites & algebraic)) return;
+
+		replaceByArg(0, kinds[0]);
+	}
+
+	void visit(NodeSqrt& node)
+	{
+		visitExprArgs(node);
+		if (!fold(node)) myKind = sqrtKind;
+	}
+
+	void visit(NodeMax& node)
+	{
+		visitExprArgs(node);
+		fold(node);
+	}
+	void visit(NodeMin& node)
+	{
+		visitExprArgs(node);
+		fold(node);
+	}
+	void visit(NodeLog& node)
+	{
+		visitExprArgs(node);
+		fold(node);
+	}
+	void visit(NodeSmooth& node)
+	{
+		visitExprArgs(node);
+		fold(node);
+	}
+
+	//	Leaves
+
+	void visit(NodeVar& node)
+	{
+		if (!fold(node)) myKind = varKind;
+	}
+
+	void visit(NodeSpot& node)
+	{
+		myKind = spotKind;
+	}
+
+	void visit(NodeConst& node)
+	{
+		myKind = otherKind;
+	}
+};
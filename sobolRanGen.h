@@ -0,0 +1,224 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+/*	Sobol quasi-random generator with the direction numbers of Joe and Kuo, 2008
+	Points are generated in Gray code order, each point from the previous one with one xor per coordinate
+	skipAhead() computes the point directly from its index, in constant time in the length of the skip
+	An optional random digital shift, a function of the seed, xors every coordinate with a random 32 bit number:
+		valuations with different seeds are independent and unbiased, for an error estimate,
+		and each of them retains the low discrepancy of the sequence
+	Coordinates are turned into Gaussians with the inverse normal CDF
+	The sequence has up to SOBOL_MAX_DIM dimensions and 2^32-1 points, the first (all zero) point is skipped
+	Quasi-random numbers are only efficient when the coordinates are used in order of importance,
+		see the Brownian bridge option in MonteCarloSimulator */
+
+#include "cpp11basicRanGen.h"
+#include "philoxRanGen.h"
+#include "sobolDirections.h"
+
+#include <cstdint>
+
+//	Index of the last point of the sequence, 2^32-1
+#define SOBOL_MAX_POINTS 0xFFFFFFFFull
+
+//	Number of points per stream, see setStream()
+#ifndef SOBOL_STREAM_SIZE
+#define SOBOL_STREAM_SIZE 1024
+#endif
+
+class SobolRanGen : public RandomGen
+{
+	//	Seed of the digital shift, 0 = no shift
+	unsigned				mySeed;
+	size_t				    myDim;
+
+	//	Direction number k of coordinate j in myDirections[k * myDim + j]
+	vector<uint32_t>		myDirections;
+	vector<uint32_t>		myShift;
+
+	//	Index of the last point and its unshifted coordinates
+	uint64_t				myPoint;
+	vector<uint32_t>		myState;
+
+	vector<double>			myNormVec;
+
+	//	Gray code: point n differs from point n-1 by the direction number of the lowest set bit of n
+	void nextPoint()
+	{
+		if( myPoint >= SOBOL_MAX_POINTS)
+			throw randomgen_error("Sobol generator: sequence exhausted");
+
+		uint64_t n = ++myPoint;
+		unsigned k = 0;
+		while( !(n & 1))
+		{
+			n >>= 1;
+			++k;
+		}
+
+		const uint32_t* dir = myDirections.data() + k * myDim;
+		for( size_t j=0; j<myDim; ++j)
+		{
+			myState[j] ^= dir[j];
+		}
+	}
+
+	//	Shifted uniforms of the current point into out
+	void uniforms( double* out) const
+	{
+		for( size_t j=0; j<myDim; ++j)
+		{
+			out[j] = PhiloxRanGen::uniform( myState[j] ^ myShift[j]);
+		}
+	}
+
+	//	Jump to point n, the last point generated
+	//	The point of index n is the xor of the direction numbers of the set bits of the Gray code n ^ (n >> 1)
+	void setPoint( const uint64_t n)
+	{
+		myPoint = n;
+
+		myState.assign( myDim, 0);
+		const uint64_t gray = myPoint ^ (myPoint >> 1);
+		for( unsigned k=0; k<32; ++k)
+		{
+			if( (gray >> k) & 1)
+			{
+				const uint32_t* dir = myDirections.data() + k * myDim;
+				for( size_t j=0; j<myDim; ++j)
+				{
+					myState[j] ^= dir[j];
+				}
+			}
+		}
+	}
+
+public:
+
+	SobolRanGen( const unsigned seed = 0) : mySeed( seed), myDim( 0), myPoint( 0) {}
+
+    void init( const size_t dim) override
+    {
+		if( dim > SOBOL_MAX_DIM)
+			throw randomgen_error("Sobol generator: dimension too large");
+
+        myDim = dim;
+        myNormVec.resize( dim);
+
+		//	Direction numbers, left aligned on 32 bits
+		myDirections.assign( 32 * dim, 0);
+
+		//	First coordinate: Van der Corput
+		if( dim) for( unsigned k=0; k<32; ++k)
+		{
+			myDirections[k * dim] = 1u << (31 - k);
+		}
+
+		//	Other coordinates: initial m_1 to m_s, then the recurrence of the primitive polynomial
+		for( size_t j=1; j<dim; ++j)
+		{
+			const SobolDirections& init = sobolDirections[j - 1];
+			const unsigned s = init.s;
+
+			for( unsigned k=0; k<32; ++k)
+			{
+				uint32_t& v = myDirections[k * dim + j];
+
+				if( k < s)
+				{
+					v = init.m[k] << (31 - k);
+				}
+				else
+				{
+					v = myDirections[(k - s) * dim + j];
+					v ^= v >> s;
+					for( unsigned i=1; i<s; ++i)
+					{
+						if( (init.a >> (s - 1 - i)) & 1) v ^= myDirections[(k - i) * dim + j];
+					}
+				}
+			}
+		}
+
+		//	Digital shift, 4 coordinates per Philox block keyed by the seed
+		myShift.assign( dim, 0);
+		if( mySeed)
+		{
+			const uint32_t key[2] = { mySeed, 0};
+			for( size_t j=0; j<dim; j+=4)
+			{
+				uint32_t ctr[4] = { uint32_t( j / 4), 0, 0, 0};
+				PhiloxRanGen::philox( ctr, key);
+
+				const size_t n = min( size_t( 4), dim - j);
+				for( size_t i=0; i<n; ++i) myShift[j + i] = ctr[i];
+			}
+		}
+
+		myPoint = 0;
+		myState.assign( dim, 0);
+    }
+
+	void genNextNormVec() override
+	{
+		nextPoint();
+		uniforms( myNormVec.data());
+		invNormalCdfBatch( myNormVec.data(), myNormVec.data(), myDim);
+	}
+
+    const vector<double>& getNorm() const override
+	{
+		return myNormVec;
+	}
+
+	//	Bulk generation: uniforms of all the points first, then Gaussians in one batch
+	void genNextNormVecs( const size_t numPoints, double* out) override
+	{
+		for( size_t p=0; p<numPoints; ++p)
+		{
+			nextPoint();
+			uniforms( out + p * myDim);
+		}
+		invNormalCdfBatch( out, out, numPoints * myDim);
+	}
+
+    //  Clone
+    unique_ptr<RandomGen> clone() const override
+    {
+        return unique_ptr<RandomGen>( new SobolRanGen( *this));
+    }
+
+	//	Skip ahead by skip points, constant time
+	void skipAhead( const long skip) override
+	{
+		if( skip < 0 || uint64_t( skip) > SOBOL_MAX_POINTS - myPoint)
+			throw randomgen_error("Sobol generator: sequence exhausted");
+
+		setPoint( myPoint + skip);
+	}
+
+	//	Streams are consecutive segments of SOBOL_STREAM_SIZE points of the sequence, 
+	//		stream s starts after point s * SOBOL_STREAM_SIZE, in constant time
+	//	With streams the size of the batches of the parallel drivers, the batches use the points of the sequential run
+	void setStream( const size_t stream) override
+	{
+		if( uint64_t( stream) > SOBOL_MAX_POINTS / SOBOL_STREAM_SIZE)
+			throw randomgen_error("Sobol generator: sequence exhausted");
+
+		setPoint( uint64_t( stream) * SOBOL_STREAM_SIZE);
+	}
+};
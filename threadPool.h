@@ -0,0 +1,213 @@
+/*
+Written by Antoine Savine in 2018
+
+This code is the strict IP of Antoine Savine
+
+License to use and alter this code for personal and commercial applications
+is freely granted to any person or company who purchased a copy of the book
+
+Modern Computational Finance: Scripting for Derivatives and XVA
+Jesper Andreasen & Antoine Savine
+Wiley, 2018
+
+As long as this comment is preserved at the top of the file
+*/
+
+#pragma once
+
+//  Work stealing thread pool
+//  Each worker owns a deque of tasks: it executes its own tasks last in first out,
+//      and when it runs out, steals the oldest tasks of the other workers,
+//      so batches of very different costs are balanced across threads
+//  Tasks are given the index of the worker that executes them, 
+//      so they may use per-worker caches without synchronization
+//  What a task computes must only depend on the task itself, not on the worker that executes it,
+//      for results not to depend on scheduling
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+using namespace std;
+
+class ThreadPool
+{
+public:
+
+    //  Tasks are called with the index of the worker, 0 to numWorkers()-1
+    using Task = function<void(const size_t)>;
+
+private:
+
+    struct Worker
+    {
+        mutex           lock;
+        deque<Task>     tasks;
+    };
+
+    //  Worker 0 is the thread that calls run(), the others are the threads of the pool
+    vector<unique_ptr<Worker>>  myWorkers;
+    vector<thread>              myThreads;
+
+    //  Synchronization of the runs
+    mutex                       myLock;
+    condition_variable          myWake;
+    condition_variable          myDone;
+    size_t                      myGeneration;
+    bool                        myStop;
+
+    //  Tasks of the current run not yet completed
+    atomic<size_t>              myPending;
+
+    //  First exception thrown by a task of the current run
+    exception_ptr               myError;
+
+    //  Next task for worker w: its own newest, or else the oldest of another worker
+    bool pop(const size_t w, Task& task)
+    {
+        {
+            Worker& own = *myWorkers[w];
+            lock_guard<mutex> lk(own.lock);
+            if (!own.tasks.empty())
+            {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        const size_t n = myWorkers.size();
+        for (size_t i = 1; i < n; ++i)
+        {
+            Worker& victim = *myWorkers[(w + i) % n];
+            lock_guard<mutex> lk(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    //  Execute tasks until there is none left to execute or steal
+    void drain(const size_t w)
+    {
+        Task task;
+        while (pop(w, task))
+        {
+            try
+            {
+                task(w);
+            }
+            catch (...)
+            {
+                lock_guard<mutex> lk(myLock);
+                if (!myError) myError = current_exception();
+            }
+
+            if (--myPending == 0)
+            {
+                lock_guard<mutex> lk(myLock);
+                myDone.notify_all();
+            }
+        }
+    }
+
+    //  Loop of the threads of the pool: wait for a run, drain, repeat
+    void loop(const size_t w)
+    {
+        size_t seen = 0;
+        for (;;)
+        {
+            {
+                unique_lock<mutex> lk(myLock);
+                myWake.wait(lk, [&]() { return myStop || myGeneration != seen; });
+                if (myStop) return;
+                seen = myGeneration;
+            }
+
+            drain(w);
+        }
+    }
+
+public:
+
+    //  Constructor, numThreads = number of workers including the calling thread, 0 for the number of hardware threads
+    explicit ThreadPool(const size_t numThreads = 0) : myGeneration(0), myStop(false), myPending(0)
+    {
+        size_t n = numThreads ? numThreads : thread::hardware_concurrency();
+        if (n == 0) n = 1;
+
+        for (size_t w = 0; w < n; ++w) myWorkers.push_back(make_unique<Worker>());
+        for (size_t w = 1; w < n; ++w) myThreads.emplace_back(&ThreadPool::loop, this, w);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lk(myLock);
+            myStop = true;
+        }
+        myWake.notify_all();
+        for (auto& th : myThreads) th.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t numWorkers() const
+    {
+        return myWorkers.size();
+    }
+
+    //  Execute all the tasks, on the threads of the pool and the calling thread, and wait for their completion
+    //  Tasks are dealt round robin to the workers, then balanced by stealing
+    //  Rethrows the first exception thrown by a task, once all tasks completed
+    //  Tasks must not call run()
+    void run(vector<Task>& tasks)
+    {
+        if (tasks.empty()) return;
+
+        {
+            lock_guard<mutex> lk(myLock);
+            myError = nullptr;
+        }
+        myPending = tasks.size();
+
+        const size_t n = myWorkers.size();
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            Worker& worker = *myWorkers[i % n];
+            lock_guard<mutex> lk(worker.lock);
+            worker.tasks.push_back(move(tasks[i]));
+        }
+
+        //  Wake up the pool
+        {
+            lock_guard<mutex> lk(myLock);
+            ++myGeneration;
+        }
+        myWake.notify_all();
+
+        //  Work on the calling thread
+        drain(0);
+
+        //  Wait for the tasks still executing on the pool
+        exception_ptr err;
+        {
+            unique_lock<mutex> lk(myLock);
+            myDone.wait(lk, [&]() { return myPending == 0; });
+            err = myError;
+        }
+        if (err) rethrow_exception(err);
+    }
+};
@@ -6,8 +6,16 @@
 #include "scriptingDebugger.h"
 #include "scriptingEvaluator.h"
 #include "scriptingCompiler.h"
+#include "scriptingRegisterVM.h"
+#include "scriptingCodeGen.h"
 #include "scriptingFuzzyEval.h"
 #include "scriptingDomainProc.h"
 #include "scriptingConstCondProc.h"
 #include "scriptingConstProcessor.h"
+#include "scriptingCseProc.h"
+#include "scriptingLiveProc.h"
+#include "scriptingSimplifier.h"
+#include "scriptingFlatAst.h"
+#include "scriptingInitProc.h"
+#include "scriptingGuardProc.h"
 #include "scriptingIfProc.h"
@@ -10,14 +10,22 @@ class ConstCondProcessor;
 class IfProcessor;
 class DomainProcessor;
 template <class T> class FuzzyEvaluator;
+class RegCompiler;
+class CppGenerator;
+class CseProcessor;
+class LiveProcessor;
+class Simplifier;
+class Flattener;
+class InitProcessor;
+class GuardProcessor;
 
 //  List
 
 //  Modifying visitors
-#define MVISITORS VarIndexer, ConstProcessor, ConstCondProcessor, IfProcessor, DomainProcessor
+#define MVISITORS VarIndexer, ConstProcessor, ConstCondProcessor, IfProcessor, DomainProcessor, CseProcessor, LiveProcessor, Simplifier
 
 //  Const visitors
-#define CVISITORS Debugger, Evaluator<double>, Compiler, FuzzyEvaluator<double>
+#define CVISITORS Debugger, Evaluator<double>, Evaluator<float>, Compiler, FuzzyEvaluator<double>, FuzzyEvaluator<float>, RegCompiler, CppGenerator, Flattener, InitProcessor, GuardProcessor
 
 //  All visitors
 #define VISITORS MVISITORS , CVISITORS
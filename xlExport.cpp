@@ -32,6 +32,7 @@ double xMultiply2Numbers(double x, double y)
 
 #include "visitorHeaders.h"
 #include "scriptingModel.h"
+#include "scriptingChecks.h"
 
 extern "C" __declspec(dllexport) myXlOper* TestScript(
 	myXlOper *xToday,
@@ -46,7 +47,12 @@ extern "C" __declspec(dllexport) myXlOper* TestScript(
 	myXlOper *xEps,
 	myXlOper *xSkipDoms,
     myXlOper *xComp,
-    myXlOper *xNormal){
+    myXlOper *xNormal,
+    myXlOper *xOutputs,
+    myXlOper *xNumThreads,
+    myXlOper *xQuasi,
+    myXlOper *xOptimize,
+    myXlOper *xSingle){
 	
 	try{
 
@@ -75,14 +81,59 @@ extern "C" __declspec(dllexport) myXlOper* TestScript(
 		if( fuzzy) eps = double( *xEps);
 		bool skipDoms = bool( *xSkipDoms);
 
-        bool comp = bool(*xComp);
+        //  Compile mode, TRUE/FALSE for stack VM/none or a CompileMode number
+        int compNum = xComp->Type() == xltypeNum ? int(*xComp) : int(bool(*xComp));
+        if (compNum < noCompile || compNum > nativeJit) throw runtime_error("Compile must be TRUE/FALSE or a number between 0 and 5");
+        CompileMode comp = CompileMode(compNum);
 
         bool normal = bool( *xNormal);
 
+        //  Output variables, all variables if none
+        vector<string> outputs;
+        for( unsigned i=0; i<xOutputs->Size(); ++i)
+        {
+            string out = (*xOutputs)(i);
+            if( !out.empty()) outputs.push_back( out);
+        }
+
 		vector<string>			varNames;
 		vector<double>			varVals;
 
-		simpleBsScriptVal( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, varNames, varVals);
+        //  Number of threads, sequential if missing, 0 or 1, all hardware threads if negative
+        int numThreads = int( *xNumThreads);
+
+        //  Quasi random: Sobol, digitally shifted with the seed unless 0, with Brownian bridge
+        bool quasi = bool( *xQuasi);
+
+        //  Optimization passes: liveness, simplification, common subexpressions
+        bool optimize = bool( *xOptimize);
+
+        //  Simulation and evaluation in single precision
+        bool single = bool( *xSingle);
+
+        //  Sequential, with the basic C++11 generator
+        if( (numThreads == 0 || numThreads == 1) && !quasi)
+        {
+            if( single) simpleBsScriptVal<float>( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, outputs, 
+                varNames, varVals, optimize);
+            else simpleBsScriptVal<double>( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, outputs, 
+                varNames, varVals, optimize);
+        }
+        //  Parallel, with the Philox generator, or Sobol if quasi random
+        //  Results are identical for a given seed whatever the number of threads, 
+        //      but differ from the sequential results with the basic generator
+        else
+        {
+            size_t nThreads = numThreads < 0 ? 0 : numThreads == 0 ? 1 : size_t( numThreads);     //  0 = hardware threads for the driver
+
+            unique_ptr<RandomGen> random;
+            if( quasi) random = make_unique<SobolRanGen>( seed);
+
+            if( single) parallelBsScriptVal<float>( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, outputs, 
+                nThreads, varNames, varVals, random.get(), quasi, optimize);
+            else parallelBsScriptVal<double>( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, outputs, 
+                nThreads, varNames, varVals, random.get(), quasi, optimize);
+        }
 
 		myXlOper res( unsigned(varNames.size()), 2);
 
@@ -215,6 +266,91 @@ extern "C" __declspec(dllexport) myXlOper* TestAsian(
 
 }
 
+extern "C" __declspec(dllexport) myXlOper* TestRanGenSpeed(
+    myXlOper *xDim,
+    myXlOper *xNumPoints,
+    myXlOper *xSeed) {
+
+    try {
+
+        size_t dim = size_t(int(*xDim));
+        size_t numPoints = size_t(int(*xNumPoints));
+        unsigned seed = (unsigned) int(*xSeed);
+
+        if (dim == 0 || numPoints == 0) throw exception();
+
+        vector<double> res = compareRanGenThroughput(dim, numPoints, seed);
+
+        //  Gaussian numbers per second
+        myXlOper xRes(3, 2);
+        xRes(0, 0) = myXlOper(string("BasicRanGen"));
+        xRes(0, 1) = myXlOper(res[0]);
+        xRes(1, 0) = myXlOper(string("PhiloxRanGen"));
+        xRes(1, 1) = myXlOper(res[1]);
+        xRes(2, 0) = myXlOper(string("PhiloxRanGen bulk"));
+        xRes(2, 1) = myXlOper(res[2]);
+
+        return return_xloper_raw_ptr(xRes);
+
+    }
+    catch (const exception& e) {
+
+        myXlOper xRes(e.what());
+        return return_xloper_raw_ptr(xRes);
+    }
+    catch (...) {
+
+        return &error;
+    }
+
+}
+
+extern "C" __declspec(dllexport) myXlOper* TestChecks(
+    myXlOper *xNumSim,
+    myXlOper *xSeed) {
+
+    try {
+
+        size_t numSim = size_t(int(*xNumSim));
+        unsigned seed = (unsigned) int(*xSeed);
+
+        if (numSim == 0) numSim = 1000;
+        if (seed == 0) seed = 1234;
+
+        //  Largest differences against the reference evaluation over the corpus, 0 when identical,
+        //      of the order of 1.0e-7 for float against double
+        vector<pair<string, double>> res;
+        res.emplace_back("Threaded vs evalCompiled", checkThreaded(numSim, seed));
+        res.emplace_back("Registers vs Evaluator", checkRegisters(numSim, seed));
+        res.emplace_back("Jit vs evalCompiled", checkJit(numSim, seed));
+        res.emplace_back("Packed vs Evaluator", checkPacked(numSim, seed));
+        res.emplace_back("Short-circuit vs Evaluator", checkShortCircuit(numSim, seed));
+        res.emplace_back("CSE vs no CSE", checkCse(numSim, seed));
+        res.emplace_back("invNormalCdfBatch vs invNormalCdf", checkInvNormalCdf());
+        res.emplace_back("Float vs double, relative", checkPrecision(numSim, seed));
+
+        myXlOper xRes(unsigned(res.size()), 2);
+        for (unsigned i = 0; i < res.size(); ++i)
+        {
+            xRes(i, 0) = myXlOper(res[i].first);
+            xRes(i, 1) = myXlOper(res[i].second);
+        }
+
+        return return_xloper_raw_ptr(xRes);
+
+    }
+    catch (const exception& e) {
+
+        myXlOper xRes(e.what());
+        return return_xloper_raw_ptr(xRes);
+    }
+    catch (...) {
+
+        return &error;
+    }
+
+}
+
 extern "C" __declspec(dllexport) myXlOper* TestCalls(
     myXlOper *xToday,
     myXlOper *xSpot,
@@ -224,7 +360,8 @@ extern "C" __declspec(dllexport) myXlOper* TestCalls(
     myXlOper *xStrikes,
     myXlOper *xNumSim,
     myXlOper *xSeed,
-    myXlOper *xNormal) {
+    myXlOper *xNormal,
+    myXlOper *xPhilox) {
 
     try {
 
@@ -239,6 +376,9 @@ extern "C" __declspec(dllexport) myXlOper* TestCalls(
 
         Date mat = int(*xMat);
 
+        //  Philox generator, Gaussian numbers in bulk, instead of the basic C++11 generator
+        bool philox = bool(*xPhilox);
+
         vector<double> strikes;
         for (unsigned i = 0; i<xStrikes->Size(); ++i)
         {
@@ -249,7 +389,8 @@ extern "C" __declspec(dllexport) myXlOper* TestCalls(
 
         vector<double> res;
 
-        simpleBsCallsVal(today, spot, vol, rate, normal, mat, strikes, numSim, seed, res);
+        PhiloxRanGen philoxGen(seed);
+        simpleBsCallsVal(today, spot, vol, rate, normal, mat, strikes, numSim, seed, res, philox ? &philoxGen : nullptr);
 
         myXlOper xRes(strikes.size(), 1);
         for (unsigned i = 0; i < strikes.size(); ++i) xRes(i, 0) = myXlOper(res[i]);
@@ -291,9 +432,9 @@ extern "C" __declspec(dllexport) int xlAutoOpen(void)
 
 	Excel12f(xlfRegister, 0, 11, (LPXLOPER12)&xDLL,
 		(LPXLOPER12)TempStr12(L"TestScript"),
-		(LPXLOPER12)TempStr12(L"QQQQQQQQQQQQQQ"),
+		(LPXLOPER12)TempStr12(L"QQQQQQQQQQQQQQQQQQQ"),
 		(LPXLOPER12)TempStr12(L"TestScript"),
-		(LPXLOPER12)TempStr12(L"today,spot,vol,rate,{evtDates},{events},numSim,[Seed],[FuzzyEval],[FuzzyEps],[SkipDomains],[Compile],[Normal]"),
+		(LPXLOPER12)TempStr12(L"today,spot,vol,rate,{evtDates},{events},numSim,[Seed],[FuzzyEval],[FuzzyEps],[SkipDomains],[Compile],[Normal],[{Outputs}],[NumThreads],[QuasiRandom],[Optimize],[SinglePrecision]"),
 		(LPXLOPER12)TempStr12(L"1"),
 		(LPXLOPER12)TempStr12(L"myOwnCppFunctions"),
 		(LPXLOPER12)TempStr12(L""),
@@ -327,9 +468,33 @@ extern "C" __declspec(dllexport) int xlAutoOpen(void)
 
     Excel12f(xlfRegister, 0, 11, (LPXLOPER12)&xDLL,
         (LPXLOPER12)TempStr12(L"TestCalls"),
-        (LPXLOPER12)TempStr12(L"QQQQQQQQQQ"),
+        (LPXLOPER12)TempStr12(L"QQQQQQQQQQQ"),
         (LPXLOPER12)TempStr12(L"TestCalls"),
-        (LPXLOPER12)TempStr12(L"today,spot,vol,rate,mat,strikes,numSim,[Seed],[Normal]"),
+        (LPXLOPER12)TempStr12(L"today,spot,vol,rate,mat,strikes,numSim,[Seed],[Normal],[Philox]"),
+        (LPXLOPER12)TempStr12(L"1"),
+        (LPXLOPER12)TempStr12(L"myOwnCppFunctions"),
+        (LPXLOPER12)TempStr12(L""),
+        (LPXLOPER12)TempStr12(L""),
+        (LPXLOPER12)TempStr12(L""),
+        (LPXLOPER12)TempStr12(L""));
+
+    Excel12f(xlfRegister, 0, 11, (LPXLOPER12)&xDLL,
+        (LPXLOPER12)TempStr12(L"TestRanGenSpeed"),
+        (LPXLOPER12)TempStr12(L"QQQQ"),
+        (LPXLOPER12)TempStr12(L"TestRanGenSpeed"),
+        (LPXLOPER12)TempStr12(L"dim,numPoints,[Seed]"),
+        (LPXLOPER12)TempStr12(L"1"),
+        (LPXLOPER12)TempStr12(L"myOwnCppFunctions"),
+        (LPXLOPER12)TempStr12(L""),
+        (LPXLOPER12)TempStr12(L""),
+        (LPXLOPER12)TempStr12(L""),
+        (LPXLOPER12)TempStr12(L""));
+
+    Excel12f(xlfRegister, 0, 11, (LPXLOPER12)&xDLL,
+        (LPXLOPER12)TempStr12(L"TestChecks"),
+        (LPXLOPER12)TempStr12(L"QQQ"),
+        (LPXLOPER12)TempStr12(L"TestChecks"),
+        (LPXLOPER12)TempStr12(L"[NumSim],[Seed]"),
         (LPXLOPER12)TempStr12(L"1"),
         (LPXLOPER12)TempStr12(L"myOwnCppFunctions"),
         (LPXLOPER12)TempStr12(L""),